@@ -0,0 +1,640 @@
+// Microbenchmark of the intersection kernels: Sphere::hit, Quadrilateral::hit, Triangle::hit and AABB::hit.
+// Every kernel is run on large batches of random rays, each against its own random primitive, in three
+// flavours: hit-heavy (aimed inside the primitive), miss-heavy (aimed beside it) and grazing (aimed at the
+// silhouette or the edges, or almost parallel to the surface). The time per test is the best of several runs.
+// Before being timed, every variant is checked against the reference implementation, a frozen copy of the
+// original kernels below: the hit flag and, for hits, every field of the HitStatus must be identical.
+// To try an optimization, register it in the variants of its kernel, or change the class itself.
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <chrono>
+#include <cstring>
+#include <functional>
+
+#include "common.h"
+#include "geometry.h"
+#include "json.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+// Results are folded in here so that the timed loops cannot be optimized away
+volatile double bench_sink = 0;
+
+namespace reference {
+
+// The kernels as they were when the benchmark was written, without the statistics counters, with the (u, v)
+// conventions of the renderer: longitude from -z for spheres, barycentric coordinates for triangles.
+// They are Hittables too, so that they are called through the same virtual call as the classes of the renderer.
+
+class Sphere : public Hittable {
+public:
+    Point3d center;
+    double radius;
+
+    Sphere(const Point3d& center, double radius) : center(center), radius(radius) {}
+    bool hit(const Ray& ray, Interval t_ray, HitStatus& stat) const override;
+    AABB bounding_box() const override { return AABB(); }
+    void bind_materials(MaterialTable&) override {}  // No material
+};
+
+bool Sphere::hit(const Ray& ray, Interval t_ray, HitStatus& stat) const {
+    const Sphere& s = *this;
+    Vector3d v = s.center - ray.origin();
+    auto a = ray.direction().squared_length();
+    auto half_b = dot(ray.direction(), v);
+    auto c = v.squared_length() - s.radius * s.radius;
+
+    auto discriminant = half_b*half_b - a*c;
+    if (discriminant < 0) return false;
+    auto sqrt_dis = std::sqrt(discriminant);
+    auto root = (half_b - sqrt_dis) / a;
+    if (!t_ray.surrounds(root)) {
+        root = (half_b + sqrt_dis) / a;
+        if (!t_ray.surrounds(root)) return false;
+    }
+
+    stat.t = root;
+    stat.hit_point = ray.at(stat.t);
+    Vector3d outward_normal = (stat.hit_point - s.center) / s.radius;
+    stat.set_face_normal(ray, outward_normal);
+    auto theta = std::acos(-outward_normal.get_y());
+    auto phi = std::atan2(-outward_normal.get_z(), outward_normal.get_x()) + pi;
+    stat.u = phi / (2*pi);
+    stat.v = theta / pi;
+    return true;
+}
+
+class Quadrilateral : public Hittable {
+public:
+    Point3d Q;
+    Vector3d u, v, w, normal;
+    double D;
+
+    Quadrilateral(const Point3d& Q, const Vector3d& u, const Vector3d& v) : Q(Q), u(u), v(v) {
+        auto n = cross(u, v);
+        normal = unit_vector(n);
+        D = dot(normal, Q);
+        w = n / dot(n, n);
+    }
+    bool hit(const Ray& ray, Interval t_ray, HitStatus& stat) const override;
+    AABB bounding_box() const override { return AABB(); }
+    void bind_materials(MaterialTable&) override {}  // No material
+};
+
+bool Quadrilateral::hit(const Ray& ray, Interval t_ray, HitStatus& stat) const {
+    const Quadrilateral& q = *this;
+    auto denom = dot(q.normal, ray.direction());
+    if (fabs(denom) < 1e-8) return false;
+
+    auto t = (q.D - dot(q.normal, ray.origin())) / denom;
+    if (!t_ray.contains(t)) return false;
+
+    auto intersection = ray.at(t);
+    Vector3d planar_hitpoint_vec = intersection - q.Q;
+    auto alpha = dot(q.w, cross(planar_hitpoint_vec, q.v));
+    auto beta = dot(q.w, cross(q.u, planar_hitpoint_vec));
+
+    Interval unit_interval = Interval(0, 1);
+    if (!unit_interval.contains(alpha) || !unit_interval.contains(beta))
+        return false;
+
+    stat.u = alpha;
+    stat.v = beta;
+    stat.t = t;
+    stat.hit_point = intersection;
+    stat.set_face_normal(ray, q.normal);
+    return true;
+}
+
+class Triangle : public Hittable {
+public:
+    Point3d v0, v1, v2;
+    Vector3d normal;
+
+    Triangle(const Point3d& v0, const Point3d& v1, const Point3d& v2)
+        : v0(v0), v1(v1), v2(v2), normal(unit_vector(cross(v1 - v0, v2 - v0))) {}
+    bool hit(const Ray& ray, Interval t_ray, HitStatus& stat) const override;
+    AABB bounding_box() const override { return AABB(); }
+    void bind_materials(MaterialTable&) override {}  // No material
+};
+
+bool Triangle::hit(const Ray& ray, Interval t_ray, HitStatus& stat) const {
+    const Triangle& tri = *this;
+    Vector3d e1 = tri.v1 - tri.v0;
+    Vector3d e2 = tri.v2 - tri.v0;
+    Vector3d h = cross(ray.direction(), e2);
+    double a = dot(e1, h);
+    if (a > -1e-8 && a < 1e-8) return false;
+
+    double f = 1.0 / a;
+    Vector3d s = ray.origin() - tri.v0;
+    double u = f * dot(s, h);
+    if (u < 0.0 || u > 1.0) return false;
+
+    Vector3d q = cross(s, e1);
+    double v = f * dot(ray.direction(), q);
+    if (v < 0.0 || u + v > 1.0) return false;
+
+    double t = f * dot(e2, q);
+    if (t > t_ray.get_min() && t < t_ray.get_max()) {
+        stat.t = t;
+        stat.hit_point = ray.at(t);
+        stat.u = u;
+        stat.v = v;
+        stat.set_face_normal(ray, tri.normal);
+        return true;
+    }
+    return false;
+}
+
+inline bool aabb_hit(const AABB& box, const Ray& ray, Interval t_ray) {
+    for (int a = 0; a < 3; a++) {
+        auto invD = 1 / ray.direction()[a];
+        auto orig = ray.origin()[a];
+        auto t0 = (box.axis(a).get_min() - orig) * invD;
+        auto t1 = (box.axis(a).get_max() - orig) * invD;
+        if (invD < 0)
+            std::swap(t0, t1);
+        if (t0 > t_ray.get_min())
+            t_ray.set_min(t0);
+        if (t1 < t_ray.get_max())
+            t_ray.set_max(t1);
+        if (t_ray.get_min() >= t_ray.get_max())
+            return false;
+    }
+    return true;
+}
+
+} // namespace reference
+
+// ---------------------------------------------------------------- Batches
+
+// Every test i intersects rays[i] with the i-th primitive of the batch
+template <class Data>
+struct Batch {
+    string name;
+    std::vector<Data> prims;
+    std::vector<Ray> rays;
+};
+
+// A unit vector orthogonal to d
+static Vector3d random_orthogonal(const Vector3d& d) {
+    while (true) {
+        Vector3d o = cross(d, random_unit_vector());
+        if (o.squared_length() > 1e-6) return unit_vector(o);
+    }
+}
+
+// Ray from a random point at some distance of target towards it, with a random direction length
+// (the renderer does not normalize its directions)
+static Ray ray_towards(const Point3d& target, double distance) {
+    Point3d origin = target + distance * random_unit_vector();
+    return Ray(origin, (target - origin) * random_double(0.05, 2.0));
+}
+
+// Ray almost parallel to a plane of normal n, crossing it near target
+static Ray ray_along_plane(const Point3d& target, const Vector3d& n) {
+    Vector3d along = random_orthogonal(n);
+    Vector3d dir = along + random_double(-1e-8, 1e-8) * n;
+    return Ray(target - 20 * dir + random_double(-1e-7, 1e-7) * n, dir);
+}
+
+enum class Flavour { Hit, Miss, Grazing };
+static const char* flavour_names[] = {"hit", "miss", "grazing"};
+
+// Point beside center, seen from origin, such that the ray from origin through it passes at the given
+// distance of center
+static Point3d beside(const Point3d& center, const Point3d& origin, double distance) {
+    double d = (center - origin).length();
+    double offset = distance * d / std::sqrt(d * d - distance * distance);
+    return center + offset * random_orthogonal(center - origin);
+}
+
+struct SphereParams {
+    Point3d center;
+    double radius;
+};
+
+static Batch<SphereParams> sphere_batch(Flavour flavour, size_t n) {
+    Batch<SphereParams> batch;
+    batch.name = flavour_names[int(flavour)];
+    for (size_t i = 0; i < n; ++i) {
+        SphereParams s = {Vector3d::random(-10, 10), random_double(0.5, 2.0)};
+        Point3d origin = s.center + random_double(5, 40) * random_unit_vector();
+        Point3d target;
+        if (flavour == Flavour::Hit)
+            target = s.center + 0.95 * s.radius * random_in_unit_sphere();
+        else if (flavour == Flavour::Miss)
+            target = beside(s.center, origin, random_double(1.05, 4.0) * s.radius);
+        else
+            target = beside(s.center, origin, s.radius * (1 + random_double(-1e-6, 1e-6)));
+        batch.prims.push_back(s);
+        batch.rays.push_back(Ray(origin, (target - origin) * random_double(0.05, 2.0)));
+    }
+    return batch;
+}
+
+struct QuadParams {
+    Point3d Q;
+    Vector3d u, v;
+};
+
+static Batch<QuadParams> quad_batch(Flavour flavour, size_t n) {
+    Batch<QuadParams> batch;
+    batch.name = flavour_names[int(flavour)];
+    for (size_t i = 0; i < n; ++i) {
+        QuadParams q = {Vector3d::random(-10, 10), Vector3d::random(-3, 3), Vector3d::random(-3, 3)};
+        if (cross(q.u, q.v).length() < 0.5) { --i; continue; }
+        double a, b;
+        if (flavour == Flavour::Hit) {
+            a = random_double(0.02, 0.98);
+            b = random_double(0.02, 0.98);
+        } else if (flavour == Flavour::Miss) {
+            do {
+                a = random_double(-1.5, 2.5);
+                b = random_double(-1.5, 2.5);
+            } while (a > -0.05 && a < 1.05 && b > -0.05 && b < 1.05);
+        } else {
+            // On one of the four edges, give or take a rounding error
+            a = random_double();
+            b = random_int(0, 1) + random_double(-1e-9, 1e-9);
+            if (random_int(0, 1)) std::swap(a, b);
+        }
+        Point3d target = q.Q + a * q.u + b * q.v;
+        batch.prims.push_back(q);
+        if (flavour == Flavour::Grazing && random_int(0, 1))
+            batch.rays.push_back(ray_along_plane(target, unit_vector(cross(q.u, q.v))));
+        else
+            batch.rays.push_back(ray_towards(target, random_double(5, 40)));
+    }
+    return batch;
+}
+
+struct TriangleParams {
+    Point3d v0, v1, v2;
+};
+
+static Batch<TriangleParams> triangle_batch(Flavour flavour, size_t n) {
+    Batch<TriangleParams> batch;
+    batch.name = flavour_names[int(flavour)];
+    for (size_t i = 0; i < n; ++i) {
+        Point3d v0 = Vector3d::random(-10, 10);
+        TriangleParams tri = {v0, v0 + Vector3d::random(-3, 3), v0 + Vector3d::random(-3, 3)};
+        Vector3d e1 = tri.v1 - tri.v0, e2 = tri.v2 - tri.v0;
+        if (cross(e1, e2).length() < 0.5) { --i; continue; }
+        double a, b;
+        if (flavour == Flavour::Hit) {
+            do {
+                a = random_double(0.02, 0.96);
+                b = random_double(0.02, 0.96);
+            } while (a + b > 0.98);
+        } else if (flavour == Flavour::Miss) {
+            do {
+                a = random_double(-1.5, 2.5);
+                b = random_double(-1.5, 2.5);
+            } while (a > -0.05 && b > -0.05 && a + b < 1.05);
+        } else {
+            // On one of the three edges, give or take a rounding error
+            double s = random_double(), eps = random_double(-1e-9, 1e-9);
+            int edge = random_int(0, 2);
+            a = edge == 0 ? eps : edge == 1 ? s : s + eps;
+            b = edge == 0 ? s : edge == 1 ? eps : 1 - s;
+        }
+        Point3d target = tri.v0 + a * e1 + b * e2;
+        batch.prims.push_back(tri);
+        if (flavour == Flavour::Grazing && random_int(0, 1))
+            batch.rays.push_back(ray_along_plane(target, unit_vector(cross(e1, e2))));
+        else
+            batch.rays.push_back(ray_towards(target, random_double(5, 40)));
+    }
+    return batch;
+}
+
+static Batch<AABB> aabb_batch(Flavour flavour, size_t n) {
+    Batch<AABB> batch;
+    batch.name = flavour_names[int(flavour)];
+    for (size_t i = 0; i < n; ++i) {
+        Point3d lo = Vector3d::random(-10, 10);
+        Point3d hi = lo + Vector3d::random(0.1, 4);
+        AABB box(lo, hi);
+        Point3d center = 0.5 * (lo + hi);
+        Vector3d extent = hi - lo;
+        Point3d target;
+        Ray ray;
+        if (flavour == Flavour::Hit) {
+            target = lo + Vector3d::random(0.02, 0.98) * extent;
+            ray = ray_towards(target, random_double(5, 40));
+        } else if (flavour == Flavour::Miss) {
+            // Aimed beside the bounding sphere of the box
+            double radius = 0.5 * extent.length();
+            Point3d origin = center + random_double(5, 40) * random_unit_vector();
+            target = beside(center, origin, random_double(1.05, 4.0) * radius);
+            ray = Ray(origin, (target - origin) * random_double(0.05, 2.0));
+        } else {
+            // On an edge of the box, or along a face with a direction that has a zero component,
+            // which gives infinite inverse directions in the slab test
+            target = lo + Vector3d::random(0, 1) * extent;
+            int a = random_int(0, 2), b = (a + 1) % 3;
+            double t[3] = {target[0], target[1], target[2]};
+            t[a] = random_int(0, 1) ? hi[a] : lo[a];
+            if (random_int(0, 1)) {
+                t[b] = random_int(0, 1) ? hi[b] : lo[b];
+                ray = ray_towards(Point3d(t[0], t[1], t[2]), random_double(5, 40));
+            } else {
+                double d[3] = {random_double(-1, 1), random_double(-1, 1), random_double(-1, 1)};
+                d[a] = 0;
+                Vector3d dir(d[0], d[1], d[2]);
+                Point3d p(t[0], t[1], t[2]);
+                ray = Ray(p - 20 * dir, dir);
+            }
+        }
+        batch.prims.push_back(box);
+        batch.rays.push_back(ray);
+    }
+    return batch;
+}
+
+// ---------------------------------------------------------------- Measurement
+
+struct Outcome {
+    bool hit;
+    HitStatus stat;
+};
+
+static bool same(double a, double b, double tolerance) {
+    if (tolerance == 0) return std::memcmp(&a, &b, sizeof(double)) == 0;
+    return std::fabs(a - b) <= tolerance * std::fmax(1.0, std::fmax(std::fabs(a), std::fabs(b)));
+}
+
+static bool same(const Vector3d& a, const Vector3d& b, double tolerance) {
+    return same(a[0], b[0], tolerance) && same(a[1], b[1], tolerance) && same(a[2], b[2], tolerance);
+}
+
+// Misses only compare the flag, what a kernel leaves in the HitStatus on a miss does not matter
+static bool same(const Outcome& a, const Outcome& b, double tolerance) {
+    if (a.hit != b.hit) return false;
+    if (!a.hit) return true;
+    return same(a.stat.t, b.stat.t, tolerance) && same(a.stat.hit_point, b.stat.hit_point, tolerance)
+           && same(a.stat.normal, b.stat.normal, tolerance) && same(a.stat.u, b.stat.u, tolerance)
+           && same(a.stat.v, b.stat.v, tolerance) && a.stat.front_face == b.stat.front_face;
+}
+
+struct Options {
+    size_t batch_size = 1 << 16;
+    int repeats = 7;
+    double tolerance = 0;
+    string only;
+};
+
+struct Measure {
+    string kernel, variant, batch;
+    double ns_per_test;
+    double hit_rate;
+    size_t mismatches;
+};
+
+class Bench {
+public:
+    explicit Bench(const Options& options) : options(options) {}
+
+    std::vector<Measure> measures;
+
+    // Runs the variant hit(i, stat) on the n tests of a batch. The first variant of a kernel and batch is the
+    // reference, its outcomes are kept to check the next ones.
+    template <class Hit>
+    void run(const string& kernel, const string& variant, const string& batch, size_t n, Hit hit) {
+        std::vector<Outcome> outcomes(n);
+        size_t hits = 0;
+        for (size_t i = 0; i < n; ++i) {
+            Outcome& o = outcomes[i];
+            o.stat.hit_point = o.stat.normal = Vector3d(0, 0, 0);
+            o.stat.t = o.stat.u = o.stat.v = 0;
+            o.stat.front_face = false;
+            o.hit = hit(i, o.stat);
+            hits += o.hit;
+        }
+
+        size_t mismatches = 0;
+        string key = kernel + "/" + batch;
+        bool is_reference = key != expected_key;
+        if (is_reference) {
+            expected_key = key;
+            expected.swap(outcomes);
+        } else {
+            for (size_t i = 0; i < n; ++i) {
+                if (same(expected[i], outcomes[i], options.tolerance)) continue;
+                if (mismatches++ < 3)
+                    std::cerr << "Mismatch " << kernel << " " << variant << " (" << batch << ") test " << i
+                              << ": hit " << outcomes[i].hit << " t " << std::setprecision(17) << outcomes[i].stat.t
+                              << ", reference hit " << expected[i].hit << " t " << expected[i].stat.t << std::endl;
+            }
+        }
+
+        double best = inf;
+        for (int r = 0; r < options.repeats; ++r) {
+            HitStatus stat;
+            stat.hit_point = stat.normal = Vector3d(0, 0, 0);
+            stat.t = stat.u = stat.v = 0;
+            stat.front_face = false;
+            size_t count = 0;
+            double sum = 0;
+            auto start = Clock::now();
+            for (size_t i = 0; i < n; ++i) {
+                if (hit(i, stat)) {
+                    // Every field, or the compiler could skip computing the unused ones of an inlined variant
+                    ++count;
+                    sum += stat.t + stat.u + stat.v + stat.hit_point[0] + stat.normal[0] + stat.front_face;
+                }
+            }
+            best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+            bench_sink = bench_sink + sum + double(count);
+        }
+
+        Measure m = {kernel, variant, batch, best * 1e9 / double(n), double(hits) / double(n), mismatches};
+        std::cout << std::left << std::setw(16) << kernel << std::setw(22) << variant << std::setw(10) << batch
+                  << std::right << std::fixed << std::setprecision(2) << std::setw(10) << m.ns_per_test
+                  << std::setw(9) << std::setprecision(1) << 100 * m.hit_rate << "%"
+                  << std::setw(12) << (is_reference ? string("-") : mismatches ? std::to_string(mismatches) : string("ok"))
+                  << std::endl;
+        measures.push_back(m);
+    }
+
+    bool wanted(const string& kernel) const {
+        return options.only.empty() || kernel.find(options.only) != string::npos;
+    }
+
+    const Options& options;
+
+private:
+    string expected_key;
+    std::vector<Outcome> expected;
+};
+
+// ---------------------------------------------------------------- Kernels
+
+static void bench_spheres(Bench& bench) {
+    const string kernel = "Sphere::hit";
+    if (!bench.wanted(kernel)) return;
+    const Interval t_ray(0.001, inf);
+    for (int f = 0; f < 3; ++f) {
+        auto batch = sphere_batch(Flavour(f), bench.options.batch_size);
+        const auto& rays = batch.rays;
+        std::vector<reference::Sphere> references;
+        std::vector<Sphere> spheres;
+        references.reserve(batch.prims.size());
+        spheres.reserve(batch.prims.size());
+        for (const auto& s : batch.prims) {
+            references.push_back(reference::Sphere(s.center, s.radius));
+            spheres.push_back(Sphere(s.center, s.radius, nullptr));
+        }
+        const size_t n = rays.size();
+
+        bench.run(kernel, "reference", batch.name, n, [&](size_t i, HitStatus& stat) {
+            return references[i].hit(rays[i], t_ray, stat);
+        });
+        bench.run(kernel, "Sphere::hit", batch.name, n, [&](size_t i, HitStatus& stat) {
+            return spheres[i].hit(rays[i], t_ray, stat);
+        });
+    }
+}
+
+static void bench_quads(Bench& bench) {
+    const string kernel = "Quad::hit";
+    if (!bench.wanted(kernel)) return;
+    const Interval t_ray(0.001, inf);
+    for (int f = 0; f < 3; ++f) {
+        auto batch = quad_batch(Flavour(f), bench.options.batch_size);
+        const auto& rays = batch.rays;
+        std::vector<reference::Quadrilateral> references;
+        std::vector<Quadrilateral> quads;
+        references.reserve(batch.prims.size());
+        quads.reserve(batch.prims.size());
+        for (const auto& q : batch.prims) {
+            references.push_back(reference::Quadrilateral(q.Q, q.u, q.v));
+            quads.push_back(Quadrilateral(q.Q, q.u, q.v, nullptr));
+        }
+        const size_t n = rays.size();
+
+        bench.run(kernel, "reference", batch.name, n, [&](size_t i, HitStatus& stat) {
+            return references[i].hit(rays[i], t_ray, stat);
+        });
+        bench.run(kernel, "Quadrilateral::hit", batch.name, n, [&](size_t i, HitStatus& stat) {
+            return quads[i].hit(rays[i], t_ray, stat);
+        });
+    }
+}
+
+static void bench_triangles(Bench& bench) {
+    const string kernel = "Triangle::hit";
+    if (!bench.wanted(kernel)) return;
+    const Interval t_ray(0.001, inf);
+    for (int f = 0; f < 3; ++f) {
+        auto batch = triangle_batch(Flavour(f), bench.options.batch_size);
+        const auto& rays = batch.rays;
+        std::vector<reference::Triangle> references;
+        std::vector<Triangle> triangles;
+        references.reserve(batch.prims.size());
+        triangles.reserve(batch.prims.size());
+        for (const auto& t : batch.prims) {
+            references.push_back(reference::Triangle(t.v0, t.v1, t.v2));
+            triangles.push_back(Triangle(t.v0, t.v1, t.v2, nullptr));
+        }
+        const size_t n = rays.size();
+
+        bench.run(kernel, "reference", batch.name, n, [&](size_t i, HitStatus& stat) {
+            return references[i].hit(rays[i], t_ray, stat);
+        });
+        bench.run(kernel, "Triangle::hit", batch.name, n, [&](size_t i, HitStatus& stat) {
+            return triangles[i].hit(rays[i], t_ray, stat);
+        });
+    }
+}
+
+static void bench_boxes(Bench& bench) {
+    const string kernel = "AABB::hit";
+    if (!bench.wanted(kernel)) return;
+    const Interval t_ray(0.001, inf);
+    for (int f = 0; f < 3; ++f) {
+        auto batch = aabb_batch(Flavour(f), bench.options.batch_size);
+        const auto& boxes = batch.prims;
+        const auto& rays = batch.rays;
+        const size_t n = rays.size();
+
+        // The box test has no HitStatus, only the flag is compared
+        bench.run(kernel, "reference", batch.name, n, [&](size_t i, HitStatus&) {
+            return reference::aabb_hit(boxes[i], rays[i], t_ray);
+        });
+        bench.run(kernel, "AABB::hit", batch.name, n, [&](size_t i, HitStatus&) {
+            return boxes[i].hit(rays[i], t_ray);
+        });
+    }
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    long long seed = 42;
+    string output;
+
+    auto cli = (
+            option("-b", "--batch").doc("tests per batch, 65536 by default") & value("N", options.batch_size),
+            option("-r", "--repeats").doc("timed runs of every batch, the best is kept, 7 by default") & value("N", options.repeats),
+            option("--seed").doc("seed of the batches, 42 by default") & value("SEED", seed),
+            option("--tolerance").doc("relative tolerance of the cross-check, 0 (bitwise identical) by default") & value("EPS", options.tolerance),
+            option("--only").doc("run the kernels whose name contains NAME") & value("NAME", options.only),
+            option("-o", "--output").doc("also write the measures to a JSON file") & value("FILE", output)
+            );
+    if (!parse(argc, argv, cli)) {
+        std::cerr << make_man_page(cli, argv[0]);
+        return 1;
+    }
+    options.batch_size = std::max(size_t(1), options.batch_size);
+    options.repeats = std::max(1, options.repeats);
+    seed_random(uint64_t(seed));
+
+#if RAY_TRACING_STATS
+    std::cerr << "Warning: the statistics counters are compiled in, the kernels of the renderer count their tests "
+                 "but the references do not. Configure with -DRAY_TRACING_STATS=OFF to compare them." << std::endl;
+#endif
+
+    std::cout << std::left << std::setw(16) << "kernel" << std::setw(22) << "variant" << std::setw(10) << "batch"
+              << std::right << std::setw(10) << "ns/test" << std::setw(10) << "hits" << std::setw(12) << "check"
+              << std::endl;
+
+    Bench bench(options);
+    bench_spheres(bench);
+    bench_quads(bench);
+    bench_triangles(bench);
+    bench_boxes(bench);
+
+    size_t mismatches = 0;
+    for (const auto& m : bench.measures)
+        mismatches += m.mismatches;
+
+    if (!output.empty()) {
+        nlohmann::json report;
+        report["batch_size"] = options.batch_size;
+        report["repeats"] = options.repeats;
+        report["seed"] = seed;
+        report["stats_counters"] = bool(RAY_TRACING_STATS);
+        report["measures"] = nlohmann::json::array();
+        for (const auto& m : bench.measures) {
+            report["measures"].push_back({{"kernel", m.kernel}, {"variant", m.variant}, {"batch", m.batch},
+                                          {"ns_per_test", m.ns_per_test}, {"hit_rate", m.hit_rate},
+                                          {"mismatches", m.mismatches}});
+        }
+        std::ofstream file(output);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open file: " << output << std::endl;
+            return 1;
+        }
+        file << report.dump(2) << std::endl;
+    }
+
+    if (mismatches) {
+        std::cerr << mismatches << " results differ from the reference implementations" << std::endl;
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,247 @@
+// Reproducible benchmark of the renderer on canonical scenes.
+// Every scene is built and rendered several times with fixed seeds; the build time, the render time,
+// the rays per second and the peak memory are reported as median and min (max for the throughput),
+// along with a description of the machine, on the terminal and in a JSON file.
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <ctime>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <sys/utsname.h>
+#endif
+
+#include "common.h"
+#include "camera.h"
+#include "load_scene.h"
+#include "scenes.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchScene {
+    string name;
+    std::function<HittableList()> build;
+};
+
+struct Summary {
+    double median;
+    double min;
+    double max;
+};
+
+static Summary summarize(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    double median = n % 2 ? values[n / 2] : 0.5 * (values[n / 2 - 1] + values[n / 2]);
+    return {median, values.front(), values.back()};
+}
+
+// The peak resident set size can be reset on Linux, so that every scene gets its own peak.
+// Elsewhere the process-wide peak is reported.
+static void reset_peak_memory() {
+#ifdef __linux__
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    if (clear_refs.is_open()) clear_refs << "5";
+#endif
+}
+
+// Peak resident set size in MiB, -1 when unknown
+static double peak_memory_mb() {
+#ifdef __linux__
+    std::ifstream status("/proc/self/status");
+    string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return std::stod(line.substr(6)) / 1024.;
+    }
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        return usage.ru_maxrss / (1024. * 1024.);  // Bytes
+#else
+        return usage.ru_maxrss / 1024.;            // KiB
+#endif
+    }
+#endif
+    return -1;
+}
+
+static nlohmann::json machine_info() {
+    nlohmann::json info;
+    info["hardware_threads"] = std::thread::hardware_concurrency();
+#ifdef __linux__
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") == 0) {
+            info["cpu"] = line.substr(line.find(':') + 2);
+            break;
+        }
+    }
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+    struct utsname name;
+    if (uname(&name) == 0) {
+        info["os"] = string(name.sysname) + " " + name.release;
+        info["arch"] = name.machine;
+    }
+#elif defined(_WIN32)
+    info["os"] = "Windows";
+#endif
+#if defined(__clang__)
+    info["compiler"] = string("clang ") + __clang_version__;
+#elif defined(__GNUC__)
+    info["compiler"] = string("gcc ") + __VERSION__;
+#elif defined(_MSC_VER)
+    info["compiler"] = "msvc " + std::to_string(_MSC_VER);
+#endif
+#ifdef NDEBUG
+    info["assertions"] = false;
+#else
+    info["assertions"] = true;
+#endif
+    info["stats_counters"] = bool(RAY_TRACING_STATS);
+    std::time_t now = std::time(nullptr);
+    char date[32];
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+    info["date"] = date;
+    return info;
+}
+
+int main(int argc, char** argv) {
+    int repeats = 5;
+    int image_width = 320;
+    int samples_per_pixel = 8;
+    int max_depth = 10;
+    int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    long long seed = 42;
+    string scene_file = "scene.json";
+    string only;
+    string output = "result/bench.json";
+
+    auto cli = (
+            option("-r", "--repeats").doc("runs of every scene, 5 by default") & value("N", repeats),
+            option("-w", "--width").doc("image width, 320 by default") & value("WIDTH", image_width),
+            option("-s", "--spp").doc("samples per pixel, 8 by default") & value("N_SAMPLES", samples_per_pixel),
+            option("-d", "--depth").doc("maximum depth of the paths, 10 by default") & value("MAX_DEPTH", max_depth),
+            option("-n", "--threads").doc("render threads, all hardware threads by default") & value("N", num_threads),
+            option("--seed").doc("seed of the scenes and of the samples, 42 by default") & value("SEED", seed),
+            option("-f", "--scene-file").doc("JSON scene of the 'scene_json' benchmark") & value("FILE", scene_file),
+            option("--only").doc("run the scenes whose name contains NAME") & value("NAME", only),
+            option("-o", "--output").doc("JSON report, result/bench.json by default") & value("FILE", output)
+            );
+    if (!parse(argc, argv, cli)) {
+        std::cerr << make_man_page(cli, argv[0]);
+        return 1;
+    }
+    repeats = std::max(1, repeats);
+
+    // Open the report first: the images go to the same directory, which must exist
+    std::ofstream file(output);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open file: " << output << std::endl;
+        return 1;
+    }
+    size_t slash = output.find_last_of("/\\");
+    string directory = slash == string::npos ? "" : output.substr(0, slash + 1);
+
+    std::vector<BenchScene> scenes = {
+            {"random_spheres", random_spheres_scene},
+            {"scene_json", [&]() { return HittableList(std::make_shared<BVH_Node>(load_scene(scene_file))); }},
+            {"mesh_heavy", mesh_heavy_scene},
+            {"glass_heavy", glass_heavy_scene},
+    };
+
+    nlohmann::json report;
+    report["machine"] = machine_info();
+    report["config"] = {{"repeats", repeats}, {"width", image_width}, {"samples_per_pixel", samples_per_pixel},
+                        {"max_depth", max_depth}, {"threads", num_threads}, {"seed", seed}};
+    report["scenes"] = nlohmann::json::array();
+
+    std::cout << std::left << std::setw(16) << "scene" << std::right
+              << std::setw(12) << "build ms" << std::setw(12) << "render s" << std::setw(12) << "Mrays/s"
+              << std::setw(12) << "best" << std::setw(12) << "peak MiB" << "\n";
+
+    for (const auto& scene : scenes) {
+        if (!only.empty() && scene.name.find(only) == string::npos) continue;
+        if (scene.name == "scene_json" && !std::ifstream(scene_file).good()) {
+            std::cerr << "Skipping scene_json, " << scene_file << " not found" << std::endl;
+            continue;
+        }
+
+        std::vector<double> build_times, render_times;
+        uint64_t rays = 0;
+        reset_peak_memory();
+        for (int run = 0; run < repeats; ++run) {
+            // The same seed every run: same scene, same samples
+            seed_random(uint64_t(seed));
+            auto start = Clock::now();
+            HittableList world = scene.build();
+            MaterialTable materials(world);
+            build_times.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+
+            Camera cam;
+            cam.aspect_ratio      = 16.0 / 9.0;
+            cam.image_width       = image_width;
+            cam.samples_per_pixel = samples_per_pixel;
+            cam.max_depth         = max_depth;
+            cam.vertical_fov      = 20;
+            cam.look_from         = Point3d(13,2,3);
+            cam.look_at           = Point3d(0,0,0);
+            cam.vec_up            = Vector3d(0,1,0);
+            cam.defocus_angle     = 0.6;
+            cam.focus_dist        = 10.0;
+            cam.rp.use_parallel   = true;
+            cam.rp.num_threads    = num_threads;
+            cam.rp.seed           = seed;
+            cam.rp.output         = directory + "bench_" + scene.name + ".ppm";
+
+            // The renderer reports its progress on clog
+            std::streambuf* clog_buffer = std::clog.rdbuf(nullptr);
+            start = Clock::now();
+            cam.render(world, materials);
+            render_times.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+            std::clog.rdbuf(clog_buffer);
+            std::clog.clear();
+
+#if RAY_TRACING_STATS
+            RenderStats stats = collect_stats();
+            rays = stats.primary_rays + stats.secondary_rays;
+#else
+            // Without the counters only the camera rays are known
+            rays = uint64_t(image_width) * int(image_width / cam.aspect_ratio) * samples_per_pixel;
+#endif
+        }
+        double peak = peak_memory_mb();
+
+        Summary build = summarize(build_times);
+        Summary render = summarize(render_times);
+        double mrays_median = double(rays) / render.median * 1e-6;
+        double mrays_best = double(rays) / render.min * 1e-6;
+
+        std::cout << std::left << std::setw(16) << scene.name << std::right << std::fixed << std::setprecision(3)
+                  << std::setw(12) << build.median * 1e3 << std::setw(12) << render.median
+                  << std::setw(12) << mrays_median << std::setw(12) << mrays_best
+                  << std::setw(12) << std::setprecision(1) << peak << std::endl;
+
+        report["scenes"].push_back({
+                {"name", scene.name},
+                {"rays", rays},
+                {"rays_counted", bool(RAY_TRACING_STATS)},
+                {"build_seconds", {{"median", build.median}, {"min", build.min}, {"runs", build_times}}},
+                {"render_seconds", {{"median", render.median}, {"min", render.min}, {"runs", render_times}}},
+                {"mrays_per_second", {{"median", mrays_median}, {"best", mrays_best}}},
+                {"peak_memory_mb", peak},
+        });
+    }
+
+    file << report.dump(2) << std::endl;
+    std::cout << "Report written to " << output << std::endl;
+    return 0;
+}
@@ -0,0 +1,191 @@
+#ifndef RAY_TRACING_ACCUMULATOR_H
+#define RAY_TRACING_ACCUMULATOR_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+
+#include "common.h"
+
+// Accumulation framebuffer for progressive rendering.
+// Holds the running sum of radiance, the sum of squared luminance and the number of samples
+// of every pixel, plus the number of passes each row went through, so that a render stopped in
+// the middle of a pass can be resumed exactly where it was left.
+// The squared luminance gives the running variance that drives adaptive sampling.
+class AccumulationBuffer {
+public:
+    int width = 0;
+    int height = 0;
+    uint64_t seed = 0;           // Base seed, per (pass, row) streams are derived from it
+    int samples_per_pixel = 0;   // Settings of the render, which a resumed render must use as well
+    int samples_per_pass = 0;
+    bool adaptive = false;       // Stopping rule of the pixels, converged ones are no longer sampled
+    int min_samples = 0;
+    double error_threshold = 0;
+    std::vector<Color> sum;      // Sum of all samples of a pixel
+    std::vector<double> sum_sq;  // Sum of the squared luminance of all samples of a pixel
+    std::vector<int> count;      // Number of samples of a pixel
+    std::vector<int> row_passes; // Number of finished passes of a row
+
+    AccumulationBuffer() = default;
+    AccumulationBuffer(int width, int height, uint64_t seed, int samples_per_pixel, int samples_per_pass,
+                       bool adaptive, int min_samples, double error_threshold)
+        : width(width), height(height), seed(seed),
+          samples_per_pixel(samples_per_pixel), samples_per_pass(samples_per_pass),
+          adaptive(adaptive), min_samples(min_samples), error_threshold(error_threshold),
+          sum(size_t(width) * height), sum_sq(size_t(width) * height, 0), count(size_t(width) * height, 0),
+          row_passes(height, 0) {}
+
+    void add_sample(int x, int y, const Color& c) {
+        size_t index = size_t(y) * width + x;
+        double l = luminance(c);
+        sum[index] += c;
+        sum_sq[index] += l * l;
+        count[index]++;
+    }
+
+    Color mean(int x, int y) const {
+        size_t index = size_t(y) * width + x;
+        return count[index] > 0 ? sum[index] / count[index] : Color(0, 0, 0);
+    }
+
+    // Unbiased sample variance of the luminance of a pixel
+    double variance(int x, int y) const {
+        size_t index = size_t(y) * width + x;
+        int n = count[index];
+        if (n < 2) return inf;
+        double m = luminance(sum[index]) / n;
+        return fmax(0., (sum_sq[index] - n * m * m) / (n - 1));
+    }
+
+    // Standard error of the mean luminance relative to the mean itself.
+    // The small bias keeps nearly black pixels from never converging.
+    double relative_error(int x, int y) const {
+        size_t index = size_t(y) * width + x;
+        int n = count[index];
+        if (n < 2) return inf;
+        double m = luminance(sum[index]) / n;
+        return std::sqrt(variance(x, y) / n) / (m + 0.01);
+    }
+
+    bool converged(int x, int y, int min_samples, double threshold) const {
+        return count[size_t(y) * width + x] >= min_samples && relative_error(x, y) < threshold;
+    }
+
+    int completed_passes() const {
+        int passes = row_passes.empty() ? 0 : row_passes[0];
+        for (int p : row_passes)
+            passes = std::min(passes, p);
+        return passes;
+    }
+
+    long long total_samples() const {
+        long long total = 0;
+        for (int c : count)
+            total += c;
+        return total;
+    }
+
+    // Binary checkpoint layout (native endianness):
+    //   "RTCK" | version | width | height | seed | samples_per_pixel | samples_per_pass
+    //   | adaptive (int32) | min_samples | error_threshold
+    //   | row_passes[height] | count[w*h] | sum[w*h*3] | sum_sq[w*h]
+    bool save(const std::string& path) const {
+        // Write to a temporary file first, a killed job must never leave a truncated checkpoint
+        std::string tmp = path + ".tmp";
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open file: " << tmp << std::endl;
+            return false;
+        }
+        file.write("RTCK", 4);
+        write_pod(file, format_version());
+        write_pod(file, width);
+        write_pod(file, height);
+        write_pod(file, seed);
+        write_pod(file, samples_per_pixel);
+        write_pod(file, samples_per_pass);
+        write_pod(file, int32_t(adaptive));
+        write_pod(file, min_samples);
+        write_pod(file, error_threshold);
+        file.write(reinterpret_cast<const char*>(row_passes.data()), sizeof(int) * row_passes.size());
+        file.write(reinterpret_cast<const char*>(count.data()), sizeof(int) * count.size());
+        for (const auto& c : sum) {
+            double rgb[3] = {c.get_x(), c.get_y(), c.get_z()};
+            file.write(reinterpret_cast<const char*>(rgb), sizeof(rgb));
+        }
+        file.write(reinterpret_cast<const char*>(sum_sq.data()), sizeof(double) * sum_sq.size());
+        file.close();
+        if (!file) {
+            std::cerr << "Failed to write checkpoint: " << tmp << std::endl;
+            return false;
+        }
+        std::remove(path.c_str());
+        return std::rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    bool load(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open file: " << path << std::endl;
+            return false;
+        }
+        char m[4];
+        uint32_t v = 0;
+        file.read(m, 4);
+        read_pod(file, v);
+        if (!file || std::string(m, 4) != "RTCK" || v != format_version()) {
+            std::cerr << "Not a valid checkpoint (or wrong version): " << path << std::endl;
+            return false;
+        }
+        read_pod(file, width);
+        read_pod(file, height);
+        read_pod(file, seed);
+        read_pod(file, samples_per_pixel);
+        read_pod(file, samples_per_pass);
+        int32_t adaptive_flag = 0;
+        read_pod(file, adaptive_flag);
+        read_pod(file, min_samples);
+        read_pod(file, error_threshold);
+        adaptive = adaptive_flag != 0;
+        if (!file || width <= 0 || height <= 0 || samples_per_pixel <= 0 || samples_per_pass <= 0) {
+            std::cerr << "Corrupted checkpoint header: " << path << std::endl;
+            return false;
+        }
+        size_t n = size_t(width) * height;
+        row_passes.assign(height, 0);
+        count.assign(n, 0);
+        sum.assign(n, Color(0, 0, 0));
+        sum_sq.assign(n, 0);
+        file.read(reinterpret_cast<char*>(row_passes.data()), sizeof(int) * row_passes.size());
+        file.read(reinterpret_cast<char*>(count.data()), sizeof(int) * count.size());
+        for (auto& c : sum) {
+            double rgb[3];
+            file.read(reinterpret_cast<char*>(rgb), sizeof(rgb));
+            c = Color(rgb[0], rgb[1], rgb[2]);
+        }
+        file.read(reinterpret_cast<char*>(sum_sq.data()), sizeof(double) * sum_sq.size());
+        if (!file) {
+            std::cerr << "Truncated checkpoint: " << path << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static uint32_t format_version() { return 4; }
+
+    template <typename T>
+    static void write_pod(std::ofstream& file, const T& value) {
+        file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    static void read_pod(std::ifstream& file, T& value) {
+        file.read(reinterpret_cast<char*>(&value), sizeof(T));
+    }
+};
+
+#endif //RAY_TRACING_ACCUMULATOR_H
@@ -8,14 +8,28 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <sstream>
 #include <thread>
 #include <chrono>
 #include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <functional>
 
 #include "common.h"
+#include "accumulator.h"
+#include "denoiser.h"
+#include "heatmap.h"
 #include "hittable.h"
 #include "material.h"
-#include "svpng.inc"
+#include "image_texture.h"
+#include "png_writer.h"
+#include "image_writer.h"
+#include "hdr_writer.h"
+#include "thread_pool.h"
+#include "json.hpp"
+
+static_assert(int(MaterialType::Count) <= stats_material_slots, "Too many material types for RenderStats");
 
 class RenderParams {
 public:
@@ -24,10 +38,42 @@ public:
     int num_threads;
     string output;
     string log;
-    
-    RenderParams()
-            : use_anti_alias(true), use_parallel(true), num_threads(4), output("cout") {}
-    RenderParams(bool uaa, bool up, int n_t, const string& o)
+
+    // Progressive rendering
+    bool progressive = false;
+    int samples_per_pass = 1;    // Samples added to every pixel in one pass
+    double time_limit = 0;       // Wall-clock budget in seconds, 0 for unlimited
+    double checkpoint_interval = 60; // Seconds between two checkpoints
+    string checkpoint;           // Checkpoint file, defaults to OUTPUT.ckpt
+    string resume;               // Checkpoint to resume from
+    long long seed = -1;         // Base seed of the random streams, negative for a random one.
+                                 // Every row (or block of rows) then gets its own stream, so that renders are reproducible
+
+    // Adaptive sampling, samples_per_pixel is then the maximum number of samples of a pixel
+    bool adaptive = false;
+    int min_samples = 8;         // Samples taken by every pixel before it may be considered converged
+    double error_threshold = 0.02; // Relative standard error under which a pixel is converged
+
+    // Edge-avoiding denoiser applied after the render loop
+    bool denoise = false;
+    int denoise_iterations = 5;
+
+    int packet_size = 1;         // Primary rays traced together as one packet, 1 to trace them one by one
+    string integrator = "path";  // "path" (depth-first) or "wavefront" (breadth-first)
+    int tile_size = 16;          // Tile side in pixels of the wavefront integrator
+    bool ascii_ppm = false;      // Write P3 text instead of binary P6
+    bool binary_stdout = false;  // Write binary P6 instead of P3 text to the standard output
+    bool stream_output = false;  // Write PPM rows as soon as they are rendered
+    int png_level = 6;           // PNG compression level, 0 (stored) to 9
+    bool aov = false;            // Add albedo, normal and depth layers to .exr and .pfm outputs
+    string exr_compression = "zip"; // "none", "rle", "zips" or "zip"
+    string tone_map = "gamma";   // Operator of 8-bit outputs: "gamma", "srgb", "reinhard" or "aces"
+    double exposure = 1.0;       // Radiance scale applied before tone mapping
+    bool dither = false;         // Add one step of triangular noise before quantization
+    bool stats = false;          // Write the render statistics as JSON next to the image
+    string heatmap;              // Per-pixel cost map written next to the image: "" (none), "time" or "visits"
+
+    explicit RenderParams(bool uaa = true, bool up = true, int n_t = 4, const string& o = "cout")
         : use_anti_alias(uaa), use_parallel(up), num_threads(n_t), output(o) {}
 };
 
@@ -47,43 +93,76 @@ public:
 
     double defocus_angle = 0;  // Variation angle of rays through each pixel
     double focus_dist = 10;    // Distance from camera look_from point to plane of perfect focus
+
+    double shutter_open = 0;   // Times of the scene the shutter opens and closes at, rays are spread between
+    double shutter_close = 0;  // them for the motion blur of moving objects
     
     RenderParams rp;
 
-    void render(const Hittable& world) {
-        if (rp.output == "cout") {
+    // Render world, whose primitives were bound to the table of its materials
+    void render(const Hittable& world, const MaterialTable& materials) {
+        this->materials = &materials;
+        reset_stats();
+        auto start = std::chrono::steady_clock::now();
+        {
+            TRACE_SCOPE("render", "render");
+            dispatch(world);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (rp.stats) writeStats(elapsed.count());
+    }
+
+private:
+    int image_height;    // Rendered image height
+    double pixel_samples_scale;
+    Point3d center;          // Camera center
+    Point3d pixel_00_loc;     // Location of pixel 0, 0
+    Vector3d pixel_delta_u;   // Offset to pixel to the right
+    Vector3d pixel_delta_v;   // Offset to pixel below
+    Vector3d u, v, w;         // Camera frame basis vectors
+    Vector3d defocus_disk_u;  // Defocus disk horizontal radius
+    Vector3d defocus_disk_v;  // Defocus disk vertical radius;
+    FeatureBuffers features;  // First-hit albedo, normals and depth for the denoiser and the AOVs, computed once
+    RowStreamer* streamer = nullptr; // Receives finished rows when streaming the output
+    HeatmapMode heatmap_mode = HeatmapMode::Off;
+    CostBuffer heatmap;       // Cost of every pixel, empty unless rp.heatmap is set
+    const MaterialTable* materials = nullptr; // Materials of the scene being rendered, indexed by its hits
+
+    // Pick the renderer matching the options and the output format
+    void dispatch(const Hittable& world) {
+        // The denoiser needs the whole image, so it always goes through the buffered renderers
+        bool buffered = rp.use_parallel || rp.denoise || !rp.heatmap.empty();
+        int numThreads = rp.use_parallel ? rp.num_threads : 1;
+        if (!rp.heatmap.empty() && (rp.progressive || rp.output == "cout"))
+            std::cerr << "The cost heatmap is not available in progressive mode nor when writing to cout" << std::endl;
+        if (rp.progressive) {
+            renderProgressive(world);
+        } else if (rp.output == "cout") {
+            if (rp.denoise) std::cerr << "Denoising is not available when writing to cout" << std::endl;
             renderToCOUT(world);
         } else {
             string extension = rp.output.substr(rp.output.size() - 4);
             if (extension == ".ppm") {
-                if (rp.use_parallel) {
-                    renderToPPM_parallel(world, rp.output, rp.num_threads);
+                if (buffered) {
+                    renderToPPM_parallel(world, rp.output, numThreads);
                 } else {
                     renderToPPM(world, rp.output);
                 }
             } else if (extension == ".png") {
-                if (rp.use_parallel) {
-                    renderToPNG_parallel(world, rp.output, rp.num_threads);
+                if (buffered) {
+                    renderToImage_parallel(world, rp.output, numThreads);
                 } else {
                     renderToPNG(world, rp.output);
                 }
+            } else if (extension == ".exr" || extension == ".pfm") {
+                // The linear framebuffer is written as a whole
+                renderToImage_parallel(world, rp.output, numThreads);
             } else {
-                std::cerr << "Unsupported file format. Please use .ppm or .png" << std::endl;
+                std::cerr << "Unsupported file format. Please use .ppm, .png, .exr or .pfm" << std::endl;
             }
         }
     }
 
-private:
-    int image_height;    // Rendered image height
-    double pixel_samples_scale;
-    Point3d center;          // Camera center
-    Point3d pixel_00_loc;     // Location of pixel 0, 0
-    Vector3d pixel_delta_u;   // Offset to pixel to the right
-    Vector3d pixel_delta_v;   // Offset to pixel below
-    Vector3d u, v, w;         // Camera frame basis vectors
-    Vector3d defocus_disk_u;  // Defocus disk horizontal radius
-    Vector3d defocus_disk_v;  // Defocus disk vertical radius;
-
     void initialize() {
         image_height = int(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
@@ -95,6 +174,7 @@ private:
         auto h = std::tan(theta/2);
         auto viewport_height = 2 * h * focus_dist;
         auto viewport_width = viewport_height * (double(image_width)/image_height);
+        texture_pixel_angle() = 2 * h / image_height;
 
         // Calculate the u,v,w unit basis vectors for the camera coordinate frame.
         // w - backward of camera, u - right hand side of camera, v - upside of camera
@@ -138,8 +218,10 @@ private:
                             + ((j + offset.get_y()) * pixel_delta_v);
         auto ray_origin = (defocus_angle <= 0) ? center: defocus_disk_sample();
         auto ray_direction = pixel_sample - ray_origin;
+        auto ray_time = (shutter_close > shutter_open)
+                        ? shutter_open + random_double() * (shutter_close - shutter_open) : shutter_open;
 
-        return Ray(ray_origin, ray_direction);
+        return Ray(ray_origin, ray_direction, ray_time);
     }
 
     Vector3d pixel_sample_square() const {
@@ -155,94 +237,704 @@ private:
 
     Color ray_color(const Ray& ray, int depth, const Hittable& obj) const {
         // If we've exceeded the ray bounce limit, no more light is gathered.
-        if (depth <= 0)
+        if (depth <= 0) {
+            STAT_PATH(max_depth);
             return Color(0,0,0);
+        }
 
+        if (depth == max_depth) STAT_INC(primary_rays);
+        else STAT_INC(secondary_rays);
         HitStatus stat;
+        bool is_hit = obj.hit(ray, Interval(0.001, inf), stat);
+        return shade(ray, is_hit, stat, depth, obj);
+    }
+
+    // Color of a ray whose closest hit is already known, the bounces are traced recursively
+    Color shade(const Ray& ray, bool is_hit, const HitStatus& stat, int depth, const Hittable& obj) const {
+        if (depth <= 0)
+            return Color(0,0,0);
 
-        if (obj.hit(ray, Interval(0.001, inf), stat)) {
+        // Paths end here on a miss or an absorption, after max_depth - depth + 1 segments
+        if (is_hit) {
+            STAT_INC(material_hits[int(materials->type(stat.material))]);
             Ray scattered;
             Color attenuation;
-            if (stat.material->scatter(ray, stat, attenuation, scattered))
+            if (materials->scatter(ray, stat, attenuation, scattered))
                 return attenuation * ray_color(scattered, depth-1, obj);
+            STAT_PATH(max_depth - depth + 1);
             return Color(0,0,0);
         }
 
+        STAT_PATH(max_depth - depth + 1);
+        return background(ray);
+    }
+
+    Color background(const Ray& ray) const {
         // TODO HERE WHEN MISS THE HIT WE MODEL THE COLOR TO BACKGROUND COLOR, WHICH IS FIXED, BUT SHOULD BE MORE FLEXIBLE
         Vector3d unit_direction = unit_vector(ray.direction());
         auto a = 0.5*(unit_direction.get_y() + 1.0);
         return (1.0-a)*Color(1.0, 1.0, 1.0) + a*Color(0.5, 0.7, 1.0);
     }
 
+    // Fill the albedo, normal and depth buffers from the first hit of a few camera rays per pixel
+    void renderFeatures(const Hittable& world, int numThreads) {
+        const int feature_samples = 4;
+        features = FeatureBuffers(image_width, image_height);
+        numThreads = std::max(1, std::min(numThreads, image_height));
+
+        int linesPerThread = image_height / numThreads;
+        ThreadPool::shared().run(numThreads, [&](int i) {
+            int startLine = i * linesPerThread;
+            int endLine = (i == numThreads - 1) ? image_height : (i + 1) * linesPerThread;
+            {
+                TRACE_SCOPE_AT("features", "post", 0, startLine);
+                for (int y = startLine; y < endLine; ++y) {
+                    seedFeatureRow(y);
+                    for (int x = 0; x < image_width; ++x) {
+                        Color albedo(0, 0, 0);
+                        Vector3d normal(0, 0, 0);
+                        double depth = 0;
+                        int n_hits = 0;
+                        for (int sample = 0; sample < feature_samples; ++sample) {
+                            Ray ray = get_ray(x, y, rp.use_anti_alias);
+                            HitStatus stat;
+                            if (world.hit(ray, Interval(0.001, inf), stat)) {
+                                albedo += materials->albedo(stat);
+                                normal += stat.normal;
+                                depth += stat.t * dot(ray.direction(), -w);
+                                n_hits++;
+                            } else {
+                                albedo += background(ray);
+                            }
+                        }
+                        size_t index = size_t(y) * image_width + x;
+                        features.albedo[index] = albedo / feature_samples;
+                        features.normal[index] = normal / feature_samples;
+                        features.depth[index] = n_hits > 0 ? depth / n_hits : inf;
+                    }
+                }
+            }
+        });
+    }
+
+    void denoiseImage(const Hittable& world, std::vector<std::vector<Color>>& linesBuffer) {
+        int numThreads = rp.use_parallel ? std::max(1, rp.num_threads) : 1;
+        if (features.empty()) renderFeatures(world, numThreads);
+
+        std::vector<Color> image(size_t(image_width) * image_height);
+        for (int j = 0; j < image_height; ++j)
+            std::copy(linesBuffer[j].begin(), linesBuffer[j].end(), image.begin() + size_t(j) * image_width);
+
+        Denoiser denoiser;
+        denoiser.iterations = rp.denoise_iterations;
+        denoiser.num_threads = numThreads;
+        denoiser.apply(image, features);
+
+        for (int j = 0; j < image_height; ++j)
+            std::copy(image.begin() + size_t(j) * image_width, image.begin() + size_t(j + 1) * image_width,
+                      linesBuffer[j].begin());
+    }
+
     // 将渲染单个区域（一组行）的任务分配给线程
     void renderSection(const Hittable& world, int startY, int endY, std::vector<std::vector<Color>>& linesBuffer, int& completedLines, std::mutex& progressMutex) {
-        int progressBarWidth = 50;
+        TRACE_SCOPE_AT("section", "render", 0, startY);
+        if (rp.integrator == "wavefront") {
+            renderSectionWavefront(world, startY, endY, linesBuffer, completedLines, progressMutex);
+            return;
+        }
+        if (rp.packet_size > 1) {
+            renderSectionPackets(world, startY, endY, linesBuffer, completedLines, progressMutex);
+            return;
+        }
+        CostMeter meter(heatmap_mode);
         for (int y = startY; y < endY; ++y) {
+            TRACE_SCOPE_AT("row", "render", 0, y);
+            seedRow(y);
             for (int x = 0; x < image_width; ++x) {
+                if (!heatmap.empty()) meter.start();
                 Color pixel_color(0, 0, 0);
                 for (int sample = 0; sample < samples_per_pixel; ++sample) {
                     Ray ray = get_ray(x, y, rp.use_anti_alias);
                     pixel_color += ray_color(ray, max_depth, world);
                 }
                 linesBuffer[y][x] = pixel_samples_scale * pixel_color;
+                if (!heatmap.empty()) heatmap.set(x, y, meter.stop());
             }
-            // Progress update
-            {
-                std::lock_guard<std::mutex> lock(progressMutex);
-                completedLines++;
-                // Optional: Progress output can be handled here or elsewhere
-                double progress = double(completedLines) / image_height;
-                int pos = int(progressBarWidth * progress);
-                std::clog << "\r[";
-                for (int k = 0; k < progressBarWidth; ++k) {
-                    if (k < pos) std::clog << "=";
-                    else if (k == pos) std::clog << ">";
-                    else std::clog << " ";
+            if (streamer) streamer->rows_done(y, y + 1);
+            updateProgress(1, completedLines, progressMutex);
+        }
+    }
+
+    // Same as renderSection, but the primary rays of a block of pixels are traced together as one packet.
+    // Blocks are 2x2, 4x2 or 4x4 pixels for packets of 4, 8 or 16 rays.
+    void renderSectionPackets(const Hittable& world, int startY, int endY, std::vector<std::vector<Color>>& linesBuffer, int& completedLines, std::mutex& progressMutex) {
+        int block_w = rp.packet_size >= 8 ? 4 : 2;
+        int block_h = rp.packet_size / block_w;
+        CostMeter meter(heatmap_mode);
+        for (int y0 = startY; y0 < endY; y0 += block_h) {
+            int y1 = std::min(y0 + block_h, endY);
+            TRACE_SCOPE_AT("packet_rows", "render", 0, y0);
+            seedRow(y0);
+            for (int x0 = 0; x0 < image_width; x0 += block_w) {
+                int x1 = std::min(x0 + block_w, image_width);
+                if (!heatmap.empty()) meter.start();
+                Color pixel_colors[RayPacket::max_size];
+                for (int sample = 0; sample < samples_per_pixel; ++sample) {
+                    RayPacket packet;
+                    for (int y = y0; y < y1; ++y)
+                        for (int x = x0; x < x1; ++x)
+                            packet.add(get_ray(x, y, rp.use_anti_alias));
+                    packet.finalize();
+                    STAT_ADD(primary_rays, packet.size);
+
+                    HitStatus stats[RayPacket::max_size];
+                    world.hit_packet(packet, packet.full_mask(), stats);
+                    for (int k = 0; k < packet.size; ++k)
+                        pixel_colors[k] += shade(packet.ray(k), packet.hit_mask >> k & 1u, stats[k], max_depth, world);
                 }
-                std::clog << "] " << int(progress * 100.0) << "% " << "Lines Remaining: " << (image_height - completedLines) << " ";
-                std::clog << std::flush; // Ensure immediate output
+                int k = 0;
+                for (int y = y0; y < y1; ++y)
+                    for (int x = x0; x < x1; ++x)
+                        linesBuffer[y][x] = pixel_samples_scale * pixel_colors[k++];
+                if (!heatmap.empty()) heatmap.set_block(x0, y0, x1, y1, meter.stop());
             }
+            if (streamer) streamer->rows_done(y0, y1);
+            updateProgress(y1 - y0, completedLines, progressMutex);
         }
     }
 
+    // State of one path of the wavefront integrator
+    struct PathState {
+        Ray ray;
+        Color throughput;  // Product of the attenuations along the path
+        int pixel;         // Index of the pixel in the tile
+    };
 
-    void renderToCOUT(const Hittable& world) {
-        initialize();
-        ProgressBar pb(image_height);
+    // Texture lookups of the Lambertian hits of a wave, made material by material
+    struct TextureBatch {
+        std::vector<int> order;       // Positions in the bin, grouped by material
+        std::vector<double> u, v, width;
+        std::vector<Point3d> points;
+        std::vector<Color> colors;    // By position in the bin
+        std::vector<Color> values;
+    };
 
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+    // Breadth-first path tracing of square tiles: all camera rays of a tile are generated first, then
+    // every bounce is one wave that intersects all rays of the tile, bins the hits by material type and
+    // shades each bin with a kernel specialized for its material. Surviving paths form the next wave.
+    // Produces the same estimate as ray_color, with better instruction and data locality.
+    void renderSectionWavefront(const Hittable& world, int startY, int endY, std::vector<std::vector<Color>>& linesBuffer, int& completedLines, std::mutex& progressMutex) {
+        const int tile = std::max(1, rp.tile_size);
+        const int n_types = int(MaterialType::Count);
+        std::vector<PathState> wave, next;
+        std::vector<HitStatus> stats;
+        std::vector<char> hits;
+        std::vector<std::vector<int>> bins(n_types);
+        std::vector<Color> tile_colors;
+        TextureBatch textures;
+        CostMeter meter(heatmap_mode);
 
-        for (int j = 0; j < image_height; ++j) {
-            pb.update(j);
+        for (int y0 = startY; y0 < endY; y0 += tile) {
+            int y1 = std::min(y0 + tile, endY);
+            seedRow(y0);
+            for (int x0 = 0; x0 < image_width; x0 += tile) {
+                int x1 = std::min(x0 + tile, image_width);
+                int tile_w = x1 - x0;
+                TRACE_SCOPE_AT("tile", "render", x0, y0);
+                if (!heatmap.empty()) meter.start();
+                tile_colors.assign(size_t(tile_w) * (y1 - y0), Color(0, 0, 0));
 
-            for (int i = 0; i < image_width; ++i) {
-                Color pixel_color(0,0,0);
-                for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                    Ray ray = get_ray(i, j, rp.use_anti_alias);
-                    pixel_color += ray_color(ray, max_depth, world);
+                // Camera rays of the whole tile
+                wave.clear();
+                for (int y = y0; y < y1; ++y)
+                    for (int x = x0; x < x1; ++x)
+                        for (int sample = 0; sample < samples_per_pixel; ++sample)
+                            wave.push_back({get_ray(x, y, rp.use_anti_alias), Color(1, 1, 1), (y - y0) * tile_w + (x - x0)});
+
+                for (int depth = max_depth; depth > 0 && !wave.empty(); --depth) {
+                    // Intersect the whole wave
+                    if (depth == max_depth) STAT_ADD(primary_rays, wave.size());
+                    else STAT_ADD(secondary_rays, wave.size());
+                    stats.resize(wave.size());
+                    hits.resize(wave.size());
+                    for (size_t i = 0; i < wave.size(); ++i)
+                        hits[i] = world.hit(wave[i].ray, Interval(0.001, inf), stats[i]);
+
+                    // Misses gather the background, hits are binned by material
+                    for (auto& bin : bins) bin.clear();
+                    for (size_t i = 0; i < wave.size(); ++i) {
+                        if (hits[i]) {
+                            bins[int(materials->type(stats[i].material))].push_back(int(i));
+                        } else {
+                            tile_colors[wave[i].pixel] += wave[i].throughput * background(wave[i].ray);
+                            STAT_PATH(max_depth - depth + 1);
+                        }
+                    }
+                    for (int type = 0; type < n_types; ++type)
+                        STAT_ADD(material_hits[type], bins[type].size());
+
+                    // Shade bin by bin, the next wave is grouped by material as well
+                    next.clear();
+                    shadeLambertianBin(bins[int(MaterialType::Lambertian)], wave, stats, next, textures);
+                    shadeBin<Metal>(bins[int(MaterialType::Metal)], wave, stats, next);
+                    shadeBin<Dielectric>(bins[int(MaterialType::Dielectric)], wave, stats, next);
+                    for (int i : bins[int(MaterialType::Other)]) {
+                        Ray scattered;
+                        Color attenuation;
+                        if (materials->scatter(wave[i].ray, stats[i], attenuation, scattered))
+                            next.push_back({scattered, wave[i].throughput * attenuation, wave[i].pixel});
+                    }
+                    // Hits that did not scatter were absorbed
+                    size_t n_hits = 0;
+                    for (const auto& bin : bins) n_hits += bin.size();
+                    STAT_ADD(path_lengths[stats_detail::path_bin(max_depth - depth + 1)], n_hits - next.size());
+                    std::swap(wave, next);
                 }
-                write_color_PPM(std::cout, pixel_samples_scale * pixel_color); // take average of multi-sampling
+                // Paths still alive after max_depth bounces gather no light
+                STAT_ADD(path_lengths[stats_detail::path_bin(max_depth)], wave.size());
+
+                for (int y = y0; y < y1; ++y)
+                    for (int x = x0; x < x1; ++x)
+                        linesBuffer[y][x] = pixel_samples_scale * tile_colors[(y - y0) * tile_w + (x - x0)];
+                if (!heatmap.empty()) heatmap.set_block(x0, y0, x1, y1, meter.stop());
             }
+            if (streamer) streamer->rows_done(y0, y1);
+            updateProgress(y1 - y0, completedLines, progressMutex);
         }
-        pb.done(rp.log);
     }
 
-    void renderToPPM(const Hittable& world, const std::string& filePath) {
-        std::ofstream file;
-        file.open(filePath);
+    // Shading kernel of one material type. The scatter of the type is resolved at compile time and
+    // inlined, it reads the parameters from the closed data of the material in the table.
+    template <typename M>
+    void shadeBin(const std::vector<int>& bin, const std::vector<PathState>& wave,
+                  const std::vector<HitStatus>& stats, std::vector<PathState>& next) const {
+        for (int i : bin) {
+            Ray scattered;
+            Color attenuation;
+            if (M::scatter((*materials)[stats[i].material], wave[i].ray, stats[i], attenuation, scattered))
+                next.push_back({scattered, wave[i].throughput * attenuation, wave[i].pixel});
+        }
+    }
 
+    // Lambertian kernel: the hits of the same material are gathered so that its texture evaluates all of
+    // their points in one call, then the rays scatter in the order of the bin, drawing the same random numbers
+    // as shadeBin would.
+    void shadeLambertianBin(const std::vector<int>& bin, const std::vector<PathState>& wave,
+                            const std::vector<HitStatus>& stats, std::vector<PathState>& next,
+                            TextureBatch& batch) const {
+        auto material_of = [&](int k) { return stats[bin[k]].material; };
+        int n = int(bin.size());
+        batch.order.resize(n);
+        for (int k = 0; k < n; ++k) batch.order[k] = k;
+        std::stable_sort(batch.order.begin(), batch.order.end(),
+                         [&](int a, int b) { return material_of(a) < material_of(b); });
+        batch.colors.resize(n);
+        for (int first = 0; first < n;) {
+            int material = material_of(batch.order[first]);
+            int last = first + 1;
+            while (last < n && material_of(batch.order[last]) == material) last++;
+            int m = last - first;
+            batch.u.resize(m);
+            batch.v.resize(m);
+            batch.width.resize(m);
+            batch.points.resize(m);
+            batch.values.resize(m);
+            for (int k = 0; k < m; ++k) {
+                int i = bin[batch.order[first + k]];
+                batch.u[k] = stats[i].u;
+                batch.v[k] = stats[i].v;
+                batch.points[k] = stats[i].hit_point;
+                batch.width[k] = texture_footprint(wave[i].ray, stats[i]);
+            }
+            Lambertian::texture_values((*materials)[material], m, batch.u.data(), batch.v.data(), batch.points.data(),
+                                       batch.width.data(), batch.values.data());
+            for (int k = 0; k < m; ++k) batch.colors[batch.order[first + k]] = batch.values[k];
+            first = last;
+        }
+        for (int k = 0; k < n; ++k) {
+            int i = bin[k];
+            next.push_back({Lambertian::scatter_ray(wave[i].ray, stats[i]), wave[i].throughput * batch.colors[k],
+                            wave[i].pixel});
+        }
+    }
+
+    // Files are binary P6 unless ascii_ppm is set, the standard output stays text P3 unless binary_stdout is set
+    bool asciiPPM(const string& filePath) const {
+        return rp.ascii_ppm || (filePath == "cout" && !rp.binary_stdout);
+    }
+
+    // With a fixed seed, start the random stream of the row (or block of rows) beginning at y
+    void seedRow(int y) const {
+        if (rp.seed >= 0) seed_random(mix_seed(uint64_t(rp.seed), uint64_t(y)));
+    }
+
+    // Same for the feature rays of row y, on streams of their own so they do not replay the samples of the image
+    void seedFeatureRow(int y) const {
+        if (rp.seed >= 0) seed_random(mix_seed(mix_seed(uint64_t(rp.seed), uint64_t(y)), 1));
+    }
+
+    int pngThreads() const {
+        return rp.use_parallel ? std::max(1, rp.num_threads) : 1;
+    }
+
+    // Merge the counters of all threads and write them, with the render settings, as JSON next to the
+    // image: OUTPUT.stats.json, or render.stats.json when writing to cout
+    void writeStats(double seconds) const {
+#if RAY_TRACING_STATS
+        RenderStats stats = collect_stats();
+        nlohmann::json j;
+        j["image"] = {{"output", rp.output}, {"width", image_width}, {"height", image_height},
+                      {"samples_per_pixel", samples_per_pixel}, {"max_depth", max_depth}};
+        j["settings"] = {{"threads", rp.use_parallel ? rp.num_threads : 1}, {"integrator", rp.integrator},
+                         {"packet_size", rp.packet_size}, {"progressive", rp.progressive}, {"adaptive", rp.adaptive}};
+        uint64_t rays = stats.primary_rays + stats.secondary_rays;
+        j["time_seconds"] = seconds;
+        j["rays"] = {{"primary", stats.primary_rays}, {"secondary", stats.secondary_rays}, {"total", rays},
+                     {"mrays_per_second", seconds > 0 ? double(rays) / seconds * 1e-6 : 0.}};
+        j["bvh"] = {{"nodes_visited", stats.bvh_nodes_visited},
+                    {"packet_nodes_visited", stats.bvh_packet_nodes_visited},
+                    {"nodes_per_ray", rays > 0 ? double(stats.bvh_nodes_visited) / rays : 0.}};
+        for (int type = 0; type < int(PrimitiveType::Count); ++type) {
+            j["primitives"][RenderStats::primitive_name(type)] = {{"tests", stats.primitive_tests[type]},
+                                                                  {"hits", stats.primitive_hits[type]}};
+        }
+        for (int type = 0; type < int(MaterialType::Count); ++type)
+            j["material_hits"][material_type_name(MaterialType(type))] = stats.material_hits[type];
+        // Index i counts the paths made of i ray segments, trailing zeros are dropped
+        int last = stats_path_bins - 1;
+        while (last > 0 && stats.path_lengths[last] == 0) --last;
+        j["path_lengths"] = std::vector<uint64_t>(stats.path_lengths, stats.path_lengths + last + 1);
+        j["textures"] = {{"lookups", stats.texture_lookups}, {"tile_reads", stats.texture_tile_reads},
+                         {"cache_bytes", TextureCache::shared().size()},
+                         {"cache_budget", TextureCache::shared().get_budget()}};
+
+        string base = rp.output == "cout" ? "render" : rp.output.substr(0, rp.output.find_last_of('.'));
+        string path = base + ".stats.json";
+        std::ofstream file(path);
         if (!file.is_open()) {
-            std::cerr << "Failed to open file: " << filePath << std::endl;
+            std::cerr << "Failed to open file: " << path << std::endl;
+            return;
+        }
+        file << j.dump(2) << std::endl;
+        std::clog << "Render statistics written to " << path << std::endl;
+#else
+        (void)seconds;
+        std::cerr << "Render statistics are disabled in this build (RAY_TRACING_STATS=0)" << std::endl;
+#endif
+    }
+
+    // Allocate the cost buffer when rp.heatmap asks for one, the renderers fill it
+    void startHeatmap() {
+        heatmap = CostBuffer();
+        heatmap_mode = HeatmapMode::Off;
+        if (rp.heatmap.empty()) return;
+        if (!parse_heatmap_mode(rp.heatmap, heatmap_mode)) {
+            std::cerr << "Unknown heatmap " << rp.heatmap << ", use time or visits." << std::endl;
             return;
         }
+        if (heatmap_mode == HeatmapMode::Visits && !RAY_TRACING_STATS) {
+            std::cerr << "BVH visits are not counted in this build (RAY_TRACING_STATS=0), the heatmap shows the time."
+                      << std::endl;
+            heatmap_mode = HeatmapMode::Time;
+        }
+        if (heatmap_mode != HeatmapMode::Off) heatmap = CostBuffer(image_width, image_height);
+    }
+
+    // Write OUTPUT.heatmap.png and OUTPUT.heatmap.pfm next to the image
+    void writeHeatmap(const string& filePath) {
+        if (heatmap.empty()) return;
+        string base = filePath.substr(0, filePath.find_last_of('.'));
+        if (heatmap.write(base, pngThreads())) {
+            std::clog << "\nCost heatmap (" << rp.heatmap << ", white above " << heatmap.scale()
+                      << (heatmap_mode == HeatmapMode::Time ? " us" : " nodes") << " per pixel) written to "
+                      << base << ".heatmap.png" << std::endl;
+        }
+        heatmap = CostBuffer();
+    }
+
+    ToneMapper toneMapper() const {
+        ToneMapper mapper;
+        if (!parse_tone_operator(rp.tone_map, mapper.op))
+            std::cerr << "Unknown tone mapping operator " << rp.tone_map << ", using gamma." << std::endl;
+        mapper.exposure = rp.exposure;
+        mapper.dither = rp.dither;
+        return mapper;
+    }
+
+    void updateProgress(int lines, int& completedLines, std::mutex& progressMutex) {
+        int progressBarWidth = 50;
+        std::lock_guard<std::mutex> lock(progressMutex);
+        completedLines += lines;
+        // Optional: Progress output can be handled here or elsewhere
+        double progress = double(completedLines) / image_height;
+        int pos = int(progressBarWidth * progress);
+        std::clog << "\r[";
+        for (int k = 0; k < progressBarWidth; ++k) {
+            if (k < pos) std::clog << "=";
+            else if (k == pos) std::clog << ">";
+            else std::clog << " ";
+        }
+        std::clog << "] " << int(progress * 100.0) << "% " << "Lines Remaining: " << (image_height - completedLines) << " ";
+        std::clog << std::flush; // Ensure immediate output
+    }
+
+    // Render one pass of the progressive mode on the rows [startY, endY).
+    // Every (pass, row) pair has its own random stream, so a resumed render replays exactly the
+    // samples an uninterrupted one would have taken. Rows are the unit of work: when the time
+    // budget runs out the current row is finished and the thread returns.
+    // In adaptive mode converged pixels are skipped, active_pixels counts the ones still sampled.
+    void renderPass(const Hittable& world, AccumulationBuffer& acc, int pass, int n_samples, int startY, int endY,
+                    const std::chrono::steady_clock::time_point* deadline, std::atomic<bool>& out_of_time,
+                    std::atomic<long long>& active_pixels) {
+        long long active = 0;
+        for (int y = startY; y < endY; ++y) {
+            if (out_of_time) break;
+            if (deadline && std::chrono::steady_clock::now() >= *deadline) {
+                out_of_time = true;
+                break;
+            }
+            if (acc.row_passes[y] > pass) { // Already done before the checkpoint
+                active++;
+                continue;
+            }
+
+            TRACE_SCOPE_AT("row", "render", 0, y);
+            seed_random(mix_seed(acc.seed, uint64_t(pass) * image_height + y));
+            for (int x = 0; x < image_width; ++x) {
+                if (rp.adaptive && acc.converged(x, y, rp.min_samples, rp.error_threshold))
+                    continue;
+                active++;
+                for (int sample = 0; sample < n_samples; ++sample) {
+                    Ray ray = get_ray(x, y, rp.use_anti_alias);
+                    acc.add_sample(x, y, ray_color(ray, max_depth, world));
+                }
+            }
+            acc.row_passes[y]++;
+        }
+        active_pixels += active;
+    }
 
+    // Adaptive sampling settings as they are reported on a mismatched resume
+    static string adaptiveSettings(bool adaptive, int min_samples, double error_threshold) {
+        if (!adaptive) return "off";
+        std::ostringstream os;
+        os << "min " << min_samples << " samples, error threshold " << error_threshold;
+        return os.str();
+    }
+
+    void renderProgressive(const Hittable& world) {
         initialize();
-        ProgressBar pb(image_height);
 
-        file << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+        AccumulationBuffer acc;
+        int samples_per_pass = std::max(1, rp.samples_per_pass);
+        if (!rp.resume.empty()) {
+            if (!acc.load(rp.resume)) return;
+            if (acc.width != image_width || acc.height != image_height) {
+                std::cerr << "Checkpoint resolution (" << acc.width << " x " << acc.height
+                          << ") does not match the image (" << image_width << " x " << image_height << ")" << std::endl;
+                return;
+            }
+            // Passes of other sizes or from other random streams would be mixed with those of the checkpoint
+            if (acc.samples_per_pixel != samples_per_pixel || acc.samples_per_pass != samples_per_pass) {
+                std::cerr << "Checkpoint samples (" << acc.samples_per_pixel << " per pixel, " << acc.samples_per_pass
+                          << " per pass) do not match the render (" << samples_per_pixel << " per pixel, "
+                          << samples_per_pass << " per pass)" << std::endl;
+                return;
+            }
+            // Pixels stopped by another rule would be mixed with those the render stops
+            if (acc.adaptive != rp.adaptive
+                || (rp.adaptive && (acc.min_samples != rp.min_samples || acc.error_threshold != rp.error_threshold))) {
+                std::cerr << "Checkpoint adaptive sampling ("
+                          << adaptiveSettings(acc.adaptive, acc.min_samples, acc.error_threshold)
+                          << ") does not match the render ("
+                          << adaptiveSettings(rp.adaptive, rp.min_samples, rp.error_threshold) << ")" << std::endl;
+                return;
+            }
+            if (rp.seed >= 0 && acc.seed != uint64_t(rp.seed)) {
+                std::cerr << "Checkpoint seed (" << acc.seed << ") does not match the render (" << rp.seed << ")"
+                          << std::endl;
+                return;
+            }
+            std::clog << "Resuming from " << rp.resume << " after " << acc.completed_passes() << " passes\n";
+        } else {
+            uint64_t seed = rp.seed >= 0 ? uint64_t(rp.seed) : (uint64_t(std::random_device{}()) << 32 | std::random_device{}());
+            acc = AccumulationBuffer(image_width, image_height, seed, samples_per_pixel, samples_per_pass,
+                                     rp.adaptive, rp.min_samples, rp.error_threshold);
+        }
+
+        string checkpoint = rp.checkpoint.empty() ? rp.output + ".ckpt" : rp.checkpoint;
+        int total_passes = (samples_per_pixel + samples_per_pass - 1) / samples_per_pass;
+        int numThreads = rp.use_parallel ? std::max(1, rp.num_threads) : 1;
+
+        auto start = std::chrono::steady_clock::now();
+        auto last_checkpoint = start;
+        auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(rp.time_limit));
+        std::atomic<bool> out_of_time(false);
+        bool all_converged = false;
+
+        ProgressBar pb(total_passes);
+        for (int pass = acc.completed_passes(); pass < total_passes && !out_of_time; ++pass) {
+            pb.update(pass);
+            int n_samples = std::min(samples_per_pass, samples_per_pixel - pass * samples_per_pass);
+            std::atomic<long long> active_pixels(0);
+
+            int linesPerThread = image_height / numThreads;
+            ThreadPool::shared().run(numThreads, [&](int i) {
+                int startLine = i * linesPerThread;
+                int endLine = (i == numThreads - 1) ? image_height : (i + 1) * linesPerThread;
+                renderPass(world, acc, pass, n_samples, startLine, endLine,
+                           rp.time_limit > 0 ? &deadline : nullptr, out_of_time, active_pixels);
+            });
+            if (rp.adaptive && active_pixels == 0) {
+                all_converged = true;
+                break;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if (std::chrono::duration<double>(now - last_checkpoint).count() >= rp.checkpoint_interval
+                && pass + 1 < total_passes && !out_of_time) {
+                writeProgress(world, acc, checkpoint, false);
+                last_checkpoint = now;
+            }
+        }
+
+        writeProgress(world, acc, checkpoint, true);
+        if (out_of_time) {
+            std::clog << std::endl << "Time limit of " << rp.time_limit << "s reached after "
+                      << acc.completed_passes() << " complete passes, "
+                      << double(acc.total_samples()) / (double(image_width) * image_height)
+                      << " samples per pixel on average.\n";
+        }
+        if (rp.adaptive) {
+            long long converged = 0;
+            for (int j = 0; j < image_height; ++j)
+                for (int i = 0; i < image_width; ++i)
+                    converged += acc.converged(i, j, rp.min_samples, rp.error_threshold);
+            std::clog << std::endl << (all_converged ? "All pixels converged. " : "")
+                      << "Adaptive sampling: " << converged << "/" << (long long)image_width * image_height
+                      << " pixels converged, "
+                      << double(acc.total_samples()) / (double(image_width) * image_height)
+                      << " samples per pixel on average.\n";
+        }
+        pb.done(rp.log);
+    }
+
+    // Write the current estimate of the image and the checkpoint it can be resumed from
+    void writeProgress(const Hittable& world, const AccumulationBuffer& acc, const string& checkpoint, bool final) {
+        if (rp.output != "cout" || final) {
+            std::vector<std::vector<Color>> linesBuffer(image_height, std::vector<Color>(image_width));
+            for (int j = 0; j < image_height; ++j)
+                for (int i = 0; i < image_width; ++i)
+                    linesBuffer[j][i] = acc.mean(i, j);
+            // Only the image is denoised, the checkpoint keeps the raw samples
+            if (rp.denoise) denoiseImage(world, linesBuffer);
+            writeImage(world, linesBuffer, rp.output);
+        }
+        acc.save(checkpoint);
+    }
+
+    void writeImage(const Hittable& world, const std::vector<std::vector<Color>>& linesBuffer, const string& filePath) {
+        string extension = filePath.size() >= 4 ? filePath.substr(filePath.size() - 4) : "";
+        if (filePath == "cout" || extension == ".ppm") {
+            PPMWriter writer;
+            writer.tone_mapper = toneMapper();
+            if (!writer.open(filePath, image_width, image_height, asciiPPM(filePath))) return;
+            writer.write_rows(linesBuffer);
+        } else if (extension == ".png") {
+            std::vector<unsigned char> pixels(image_width * image_height * 3);
+            toneMapper().map_image(linesBuffer, pixels.data(), pngThreads());
+            FILE* fp = fopen(filePath.c_str(), "wb");
+            if (!fp) {
+                std::cerr << "Failed to open file " << filePath << " for writing." << std::endl;
+                return;
+            }
+            write_png(fp, image_width, image_height, pixels.data(), pngThreads(), rp.png_level);
+            fclose(fp);
+        } else if (extension == ".exr" || extension == ".pfm") {
+            writeHDR(world, linesBuffer, filePath, extension);
+        } else {
+            std::cerr << "Unsupported file format. Please use .ppm, .png, .exr or .pfm" << std::endl;
+        }
+    }
+
+    // Write the linear radiance, without tone mapping nor quantization.
+    // With rp.aov, the albedo, normal and depth of the first hit are added as layers of the EXR file,
+    // or written next to the PFM file as NAME.albedo.pfm, NAME.normal.pfm and NAME.depth.pfm.
+    void writeHDR(const Hittable& world, const std::vector<std::vector<Color>>& linesBuffer,
+                  const string& filePath, const string& extension) {
+        if (rp.aov && features.empty()) renderFeatures(world, pngThreads());
+        size_t n = size_t(image_width) * image_height;
+
+        // Planar channels, rows from top to bottom
+        std::vector<ExrChannel> channels = {ExrChannel("R", n), ExrChannel("G", n), ExrChannel("B", n)};
+        for (int j = 0; j < image_height; ++j) {
+            for (int i = 0; i < image_width; ++i) {
+                size_t index = size_t(j) * image_width + i;
+                for (int c = 0; c < 3; ++c)
+                    channels[c].data[index] = float(linesBuffer[j][i][c]);
+            }
+        }
+        if (rp.aov) {
+            const char* rgb[3] = {"R", "G", "B"};
+            const char* xyz[3] = {"X", "Y", "Z"};
+            for (int c = 0; c < 3; ++c) {
+                channels.push_back(ExrChannel(string("albedo.") + rgb[c], n));
+                for (size_t index = 0; index < n; ++index)
+                    channels.back().data[index] = float(features.albedo[index][c]);
+            }
+            for (int c = 0; c < 3; ++c) {
+                channels.push_back(ExrChannel(string("normal.") + xyz[c], n));
+                for (size_t index = 0; index < n; ++index)
+                    channels.back().data[index] = float(features.normal[index][c]);
+            }
+            // Half floats lack the precision for depth
+            channels.push_back(ExrChannel("Z", n, true));
+            for (size_t index = 0; index < n; ++index)
+                channels.back().data[index] = float(features.depth[index]);
+        }
+
+        if (extension == ".exr") {
+            ExrCompression compression = ExrCompression::ZIP;
+            if (!parse_exr_compression(rp.exr_compression, compression))
+                std::cerr << "Unknown EXR compression " << rp.exr_compression << ", using zip." << std::endl;
+            write_exr(filePath, image_width, image_height, channels, compression, pngThreads());
+            return;
+        }
+
+        // PFM holds a single RGB or grayscale image per file, channels are interleaved
+        string base = filePath.substr(0, filePath.size() - 4);
+        auto write_layer = [&](const string& path, size_t first, int n_channels) {
+            std::vector<float> pixels(n * n_channels);
+            for (size_t index = 0; index < n; ++index)
+                for (int c = 0; c < n_channels; ++c)
+                    pixels[index * n_channels + c] = channels[first + c].data[index];
+            write_pfm(path, image_width, image_height, pixels.data(), n_channels);
+        };
+        write_layer(filePath, 0, 3);
+        if (rp.aov) {
+            write_layer(base + ".albedo.pfm", 3, 3);
+            write_layer(base + ".normal.pfm", 6, 3);
+            write_layer(base + ".depth.pfm", 9, 1);
+        }
+    }
+
+    void renderToCOUT(const Hittable& world) {
+        renderToPPM(world, "cout");
+    }
+
+    void renderToPPM(const Hittable& world, const std::string& filePath) {
+        initialize();
+        PPMWriter writer;
+        writer.tone_mapper = toneMapper();
+        if (!writer.open(filePath, image_width, image_height, asciiPPM(filePath))) return;
+        ProgressBar pb(image_height);
+        std::vector<Color> line(image_width);
 
         for (int j = 0; j < image_height; ++j) {
+            TRACE_SCOPE_AT("row", "render", 0, j);
             pb.update(j);
+            seedRow(j);
 
             for (int i = 0; i < image_width; ++i) {
                 Color pixel_color(0,0,0);
@@ -250,10 +942,11 @@ private:
                     Ray ray = get_ray(i, j, rp.use_anti_alias);
                     pixel_color += ray_color(ray, max_depth, world);
                 }
-                write_color_PPM(file, pixel_samples_scale * pixel_color); // Now writes to file
+                line[i] = pixel_samples_scale * pixel_color; // take average of multi-sampling
             }
+            writer.write_row(line); // one write per row
         }
-        file.close();
+        writer.close();
         pb.done(rp.log);
     }
 
@@ -261,9 +954,13 @@ private:
         initialize();
         ProgressBar pb(image_height);
         std::vector<unsigned char> pixels(image_width * image_height * 3);
+        std::vector<Color> line(image_width);
+        ToneMapper mapper = toneMapper();
 
         for (int j = 0; j < image_height; ++j) {
+            TRACE_SCOPE_AT("row", "render", 0, j);
             pb.update(j);
+            seedRow(j);
 
             for (int i = 0; i < image_width; ++i) {
                 Color pixel_color(0,0,0);
@@ -271,8 +968,9 @@ private:
                     Ray ray = get_ray(i, j, rp.use_anti_alias);
                     pixel_color += ray_color(ray, max_depth, world);
                 }
-                write_color_PNG(pixels, pixel_samples_scale * pixel_color, (j * image_width + i) * 3);
+                line[i] = pixel_samples_scale * pixel_color;
             }
+            mapper.map_row(line.data(), image_width, j, pixels.data() + size_t(j) * image_width * 3);
         }
 
         FILE* fp = fopen(filePath.c_str(), "wb");
@@ -280,107 +978,75 @@ private:
             std::cerr << "Failed to open file " << filePath << " for writing." << std::endl;
             return;
         }
-        svpng(fp, image_width, image_height, pixels.data(), 0);
+        write_png(fp, image_width, image_height, pixels.data(), pngThreads(), rp.png_level);
         fclose(fp);
         pb.done(rp.log);
     }
 
     void renderToPPM_parallel(const Hittable& world, const std::string& filePath, int numThreads) {
-    std::ofstream file(filePath);
-        if (!file.is_open()) {
-            std::cerr << "Failed to open file: " << filePath << std::endl;
-            return;
-        }
-
         initialize();
+        startHeatmap();
+        PPMWriter writer;
+        writer.tone_mapper = toneMapper();
+        if (!writer.open(filePath, image_width, image_height, asciiPPM(filePath))) return;
         std::clog << "Starting rendering...\n";
 
-        file << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-
-        std::vector<std::thread> threads;
         std::vector<std::vector<Color>> linesBuffer(image_height, std::vector<Color>(image_width));
 
+        // Rows can only be streamed when nothing processes the whole image afterwards
+        RowStreamer rowStreamer(writer, linesBuffer);
+        streamer = (rp.stream_output && !rp.denoise) ? &rowStreamer : nullptr;
+
         std::mutex progressMutex;
         int completedLines = 0;
 
         auto start = std::chrono::high_resolution_clock::now();
         int linesPerThread = image_height / numThreads;
-        for (int i = 0; i < numThreads; ++i) {
+        // Returns once all threads are finished
+        ThreadPool::shared().run(numThreads, [&](int i) {
             int startLine = i * linesPerThread;
             int endLine = (i + 1) * linesPerThread;
             if (i == numThreads - 1) {
                 endLine = image_height; // Ensure the last thread handles all remaining lines
             }
-            threads.push_back(std::thread([&, startLine, endLine]() {
-                renderSection(world, startLine, endLine, std::ref(linesBuffer), std::ref(completedLines), std::ref(progressMutex));
-            }));
-        }
+            renderSection(world, startLine, endLine, std::ref(linesBuffer), std::ref(completedLines), std::ref(progressMutex));
+        });
+        writeHeatmap(filePath);
+        if (rp.denoise) denoiseImage(world, linesBuffer);
 
-        for (auto& t : threads) {
-            t.join(); // Wait for all threads to finish
-        }
+        // Write the lines to the file, whole rows at once
+        if (!streamer) writer.write_rows(linesBuffer);
+        streamer = nullptr;
 
-        // Write the lines to the file
-        for (const auto& line : linesBuffer) {
-            for (const auto& color : line) {
-                write_color_PPM(file, color);
-            }
-        }
-
-        file.close();
+        writer.close();
         auto end = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double> elapsed = end - start;
         std::clog << std::endl << "Done.\n";
         std::clog << "Time elapsed: " << elapsed.count() << "s" << std::endl;
     }
 
-
-    void renderToPNG_parallel(const Hittable& world, const std::string& filePath, int numThreads) {
+    // Render the whole image into memory, then write it in any format supported by writeImage
+    void renderToImage_parallel(const Hittable& world, const std::string& filePath, int numThreads) {
         initialize();
+        startHeatmap();
         std::vector<std::vector<Color>> linesBuffer(image_height, std::vector<Color>(image_width));
-        std::vector<std::thread> threads;
         std::mutex progressMutex;
         int completedLines = 0;
 
         auto start = std::chrono::high_resolution_clock::now();
         int linesPerThread = image_height / numThreads;
-        for (int i = 0; i < numThreads; ++i) {
+        ThreadPool::shared().run(numThreads, [&](int i) {
             int startLine = i * linesPerThread;
             int endLine = (i + 1) * linesPerThread;
             if (i == numThreads - 1) {
                 endLine = image_height; // Ensure the last thread handles all remaining lines
             }
             // Utilizing the universal renderSection function
-            // threads.emplace_back([&world, startLine, endLine, &linesBuffer, &completedLines, &progressMutex](){
-            //     renderSection(world, startLine, endLine, linesBuffer, completedLines, progressMutex);
-            // });
-            threads.push_back(std::thread([&, startLine, endLine]() {
-                renderSection(world, startLine, endLine, std::ref(linesBuffer), std::ref(completedLines), std::ref(progressMutex));
-            }));
-        }
-
-        for (auto& thread : threads) {
-            thread.join();
-        }
-
-        // After rendering, convert the Color data in linesBuffer to pixel data for the PNG
-        std::vector<unsigned char> pixels(image_width * image_height * 3);
-        for (int j = 0; j < image_height; ++j) {
-            for (int i = 0; i < image_width; ++i) {
-                int index = (j * image_width + i) * 3;
-                auto& color = linesBuffer[j][i];
-                write_color_PNG(pixels, color, index); // Assuming write_color_PNG can directly accept a Color object
-            }
-        }
-
-        // Write the pixel data to a PNG file
-        FILE* fp = fopen(filePath.c_str(), "wb");
-        if (!fp) {
-            std::cerr << "Failed to open file " << filePath << " for writing." << std::endl;
-            return;
-        }
-        svpng(fp, image_width, image_height, pixels.data(), 0);
-        fclose(fp);
+            renderSection(world, startLine, endLine, std::ref(linesBuffer), std::ref(completedLines), std::ref(progressMutex));
+        });
+        writeHeatmap(filePath);
+        if (rp.denoise) denoiseImage(world, linesBuffer);
+        writeImage(world, linesBuffer, filePath);
 
         auto end = std::chrono::high_resolution_clock::now();
         std::chrono::duration<double> elapsed = end - start;
@@ -0,0 +1,166 @@
+#ifndef RAY_TRACING_CAMERA_PATH_H
+#define RAY_TRACING_CAMERA_PATH_H
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+
+#include "common.h"
+#include "json.hpp"
+
+// Position and lens of the camera for one frame
+struct CameraPose {
+    Point3d look_from;
+    Point3d look_at;
+    Vector3d vec_up;
+    double vertical_fov;
+    double defocus_angle;
+    double focus_dist;
+    double shutter_open;
+    double shutter_close;
+
+    static CameraPose of(const Args& args) {
+        return {args.look_from, args.look_at, args.vec_up, args.vertical_fov, args.defocus_angle, args.focus_dist,
+                args.shutter_open, args.shutter_close};
+    }
+};
+
+// Camera poses of a sequence of frames, from the "Frames" member of a scene or of a --frames file. It is either
+// an array of poses, one per frame, or a path through keyframes:
+//     {"count": 120, "interpolation": "smooth", "keyframes": [{"frame": 0, "look_from": [13, 2, 3]}, ...]}
+// A pose has the members of the "Camera" block, those it does not give are the ones of the pose before it (the
+// camera of the scene for the first one). Between keyframes the pose follows a Catmull-Rom spline through them,
+// or straight lines with "interpolation": "linear"; "count" defaults to one frame past the last keyframe.
+class CameraPath {
+public:
+    std::vector<CameraPose> frames;
+
+    bool empty() const { return frames.empty(); }
+    size_t size() const { return frames.size(); }
+
+    // Throws std::runtime_error prefixed with where on invalid paths
+    static CameraPath from_json(const nlohmann::json& j, const CameraPose& base, const std::string& where) {
+        CameraPath path;
+        try {
+            if (j.is_array()) {
+                CameraPose pose = base;
+                for (const auto& p : j) {
+                    pose = read_pose(p, pose, false);
+                    path.frames.push_back(pose);
+                }
+            } else if (j.is_object()) {
+                path.interpolate(j, base);
+            } else {
+                throw std::runtime_error("an array of poses or an object with keyframes is expected");
+            }
+        } catch (const nlohmann::json::exception& e) {
+            std::string m = e.what();
+            throw std::runtime_error(where + ": \"Frames\": " + m.substr(m.find(']') + 2));
+        } catch (const std::runtime_error& e) {
+            throw std::runtime_error(where + ": \"Frames\": " + e.what());
+        }
+        if (path.empty()) throw std::runtime_error(where + ": \"Frames\": no frame");
+        return path;
+    }
+
+    // OUTPUT with the frame number before the extension: result/frame.png gives result/frame.0007.png
+    static std::string frame_file(const std::string& output, size_t frame, size_t n_frames) {
+        size_t digits = 4;
+        for (size_t n = n_frames - 1; n >= 10000; n /= 10) digits++;
+        std::string number = std::to_string(frame);
+        if (number.size() < digits) number.insert(0, digits - number.size(), '0');
+        number.insert(0, 1, '.');
+        size_t dot = output.find_last_of('.');
+        size_t slash = output.find_last_of("/\\");
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) return output + number;
+        return output.substr(0, dot) + number + output.substr(dot);
+    }
+
+private:
+    struct Keyframe {
+        int frame;
+        CameraPose pose;
+    };
+
+    static CameraPose read_pose(const nlohmann::json& p, const CameraPose& previous, bool keyframe) {
+        if (!p.is_object()) throw std::runtime_error("a pose must be an object");
+        CameraPose pose = previous;
+        for (auto it = p.begin(); it != p.end(); ++it) {
+            const std::string& key = it.key();
+            if (key == "look_from") pose.look_from = vector_of(it.value(), key);
+            else if (key == "look_at") pose.look_at = vector_of(it.value(), key);
+            else if (key == "vec_up") pose.vec_up = vector_of(it.value(), key);
+            else if (key == "vertical_fov") pose.vertical_fov = it.value().get<double>();
+            else if (key == "defocus_angle") pose.defocus_angle = it.value().get<double>();
+            else if (key == "focus_dist") pose.focus_dist = it.value().get<double>();
+            else if (key == "shutter_open") pose.shutter_open = it.value().get<double>();
+            else if (key == "shutter_close") pose.shutter_close = it.value().get<double>();
+            else if (!(keyframe && key == "frame")) throw std::runtime_error("unknown pose member \"" + key + "\"");
+        }
+        return pose;
+    }
+
+    static Vector3d vector_of(const nlohmann::json& v, const std::string& key) {
+        if (!v.is_array() || v.size() != 3)
+            throw std::runtime_error("\"" + key + "\" must be an array of 3 numbers");
+        return Vector3d(v[0].get<double>(), v[1].get<double>(), v[2].get<double>());
+    }
+
+    void interpolate(const nlohmann::json& j, const CameraPose& base) {
+        std::vector<Keyframe> keys;
+        CameraPose pose = base;
+        for (const auto& k : j.at("keyframes")) {
+            pose = read_pose(k, pose, true);
+            int frame = k.at("frame").get<int>();
+            if (frame < 0 || (!keys.empty() && frame <= keys.back().frame))
+                throw std::runtime_error("keyframes must be given by increasing frame numbers from 0");
+            keys.push_back({frame, pose});
+        }
+        if (keys.empty()) throw std::runtime_error("no keyframe");
+        int count = j.value("count", keys.back().frame + 1);
+        std::string mode = j.value("interpolation", std::string("smooth"));
+        if (mode != "smooth" && mode != "linear")
+            throw std::runtime_error("\"interpolation\" must be smooth or linear");
+
+        size_t k = 0;
+        for (int f = 0; f < count; ++f) {
+            while (k + 1 < keys.size() && keys[k + 1].frame <= f) k++;
+            if (f <= keys[k].frame || k + 1 == keys.size()) {
+                // Before the first keyframe or after the last one
+                frames.push_back(keys[k].pose);
+                continue;
+            }
+            double t = double(f - keys[k].frame) / (keys[k + 1].frame - keys[k].frame);
+            const CameraPose& p0 = keys[k > 0 ? k - 1 : k].pose;
+            const CameraPose& p1 = keys[k].pose;
+            const CameraPose& p2 = keys[k + 1].pose;
+            const CameraPose& p3 = keys[k + 2 < keys.size() ? k + 2 : k + 1].pose;
+            frames.push_back(mode == "linear" ? blend(p1, p1, p2, p2, t, true) : blend(p0, p1, p2, p3, t, false));
+        }
+    }
+
+    // Catmull-Rom spline from p1 (t = 0) to p2 (t = 1), or the straight line between them
+    template <class T>
+    static T spline(const T& p0, const T& p1, const T& p2, const T& p3, double t, bool linear) {
+        if (linear) return p1 + t * (p2 - p1);
+        double t2 = t * t, t3 = t2 * t;
+        return 0.5 * ((2 * p1) + t * (p2 - p0) + t2 * (2 * p0 - 5 * p1 + 4 * p2 - p3) + t3 * (3 * p1 - p0 - 3 * p2 + p3));
+    }
+
+    static CameraPose blend(const CameraPose& p0, const CameraPose& p1, const CameraPose& p2, const CameraPose& p3,
+                            double t, bool linear) {
+        CameraPose pose;
+        pose.look_from = spline(p0.look_from, p1.look_from, p2.look_from, p3.look_from, t, linear);
+        pose.look_at = spline(p0.look_at, p1.look_at, p2.look_at, p3.look_at, t, linear);
+        pose.vec_up = spline(p0.vec_up, p1.vec_up, p2.vec_up, p3.vec_up, t, linear);
+        pose.vertical_fov = spline(p0.vertical_fov, p1.vertical_fov, p2.vertical_fov, p3.vertical_fov, t, linear);
+        pose.defocus_angle = spline(p0.defocus_angle, p1.defocus_angle, p2.defocus_angle, p3.defocus_angle, t, linear);
+        pose.focus_dist = spline(p0.focus_dist, p1.focus_dist, p2.focus_dist, p3.focus_dist, t, linear);
+        pose.shutter_open = spline(p0.shutter_open, p1.shutter_open, p2.shutter_open, p3.shutter_open, t, linear);
+        pose.shutter_close = spline(p0.shutter_close, p1.shutter_close, p2.shutter_close, p3.shutter_close, t, linear);
+        return pose;
+    }
+};
+
+#endif //RAY_TRACING_CAMERA_PATH_H
@@ -0,0 +1,132 @@
+#ifndef RAY_TRACING_DENOISER_H
+#define RAY_TRACING_DENOISER_H
+
+#include <vector>
+#include <cmath>
+
+#include "common.h"
+#include "thread_pool.h"
+
+// Auxiliary buffers of the first hit of every pixel, used to guide the denoiser and written as AOV layers
+class FeatureBuffers {
+public:
+    int width = 0;
+    int height = 0;
+    std::vector<Color> albedo;   // Surface albedo of the first hit, background color on a miss
+    std::vector<Vector3d> normal; // Shading normal of the first hit, zero on a miss
+    std::vector<double> depth;    // Distance of the first hit along the view axis, infinite on a miss
+
+    FeatureBuffers() = default;
+    FeatureBuffers(int width, int height)
+        : width(width), height(height), albedo(size_t(width) * height), normal(size_t(width) * height),
+          depth(size_t(width) * height, inf) {}
+
+    bool empty() const { return albedo.empty(); }
+};
+
+// Edge-avoiding A-Trous wavelet filter (Dammertz et al., 2010).
+// Each iteration convolves the image with a 5x5 B3-spline kernel whose taps are spread 2^i pixels apart,
+// and every tap is weighted by how close its color, normal and albedo are to the ones of the center pixel,
+// so that edges of the geometry and of the textures are kept while the noise is smoothed out.
+// Filtering is done on the illumination (color divided by albedo), the texture details are multiplied
+// back at the end.
+class Denoiser {
+public:
+    int iterations = 5;
+    double sigma_color = 0.5;   // Color tolerance of the first iteration, halved at each iteration
+    double sigma_normal = 0.3;
+    double sigma_albedo = 0.1;
+    int num_threads = 4;
+
+    void apply(std::vector<Color>& image, const FeatureBuffers& features) const {
+        TRACE_SCOPE("denoise", "post");
+        int width = features.width, height = features.height;
+        size_t n = size_t(width) * height;
+        if (image.size() != n || n == 0) return;
+
+        // Demodulate the albedo
+        std::vector<Color> current(n), next(n);
+        for (size_t i = 0; i < n; ++i)
+            current[i] = demodulate(image[i], features.albedo[i]);
+
+        for (int it = 0; it < iterations; ++it) {
+            int step = 1 << it;
+            double sigma_c = sigma_color / (1 << it);
+            parallel_rows(height, [&](int startY, int endY) {
+                for (int y = startY; y < endY; ++y)
+                    for (int x = 0; x < width; ++x)
+                        next[size_t(y) * width + x] = filter_pixel(current, features, x, y, step, sigma_c);
+            });
+            std::swap(current, next);
+        }
+
+        for (size_t i = 0; i < n; ++i)
+            image[i] = remodulate(current[i], features.albedo[i]);
+    }
+
+private:
+    // Black albedo would lose the illumination, clamp it
+    static double safe_albedo(double a) { return fmax(a, 1e-3); }
+
+    static Color demodulate(const Color& c, const Color& albedo) {
+        return Color(c.get_x() / safe_albedo(albedo.get_x()),
+                     c.get_y() / safe_albedo(albedo.get_y()),
+                     c.get_z() / safe_albedo(albedo.get_z()));
+    }
+
+    static Color remodulate(const Color& c, const Color& albedo) {
+        return Color(c.get_x() * safe_albedo(albedo.get_x()),
+                     c.get_y() * safe_albedo(albedo.get_y()),
+                     c.get_z() * safe_albedo(albedo.get_z()));
+    }
+
+    Color filter_pixel(const std::vector<Color>& image, const FeatureBuffers& features,
+                       int x, int y, int step, double sigma_c) const {
+        static const double kernel[5] = {1. / 16, 1. / 4, 3. / 8, 1. / 4, 1. / 16};
+        int width = features.width, height = features.height;
+        size_t p = size_t(y) * width + x;
+
+        // Distances are measured on gamma-compressed colors so that bright pixels do not dominate
+        Color cp = compress(image[p]);
+        const Vector3d& np = features.normal[p];
+        const Color& ap = features.albedo[p];
+        double inv_c = 1. / (sigma_c * sigma_c);
+        double inv_n = 1. / (sigma_normal * sigma_normal);
+        double inv_a = 1. / (sigma_albedo * sigma_albedo);
+
+        Color sum(0, 0, 0);
+        double weight_sum = 0;
+        for (int dy = -2; dy <= 2; ++dy) {
+            int qy = y + dy * step;
+            if (qy < 0 || qy >= height) continue;
+            for (int dx = -2; dx <= 2; ++dx) {
+                int qx = x + dx * step;
+                if (qx < 0 || qx >= width) continue;
+                size_t q = size_t(qy) * width + qx;
+
+                double w_c = std::exp(-(compress(image[q]) - cp).squared_length() * inv_c);
+                double w_n = std::exp(-(features.normal[q] - np).squared_length() * inv_n);
+                double w_a = std::exp(-(features.albedo[q] - ap).squared_length() * inv_a);
+                double w = kernel[dx + 2] * kernel[dy + 2] * w_c * w_n * w_a;
+                sum += w * image[q];
+                weight_sum += w;
+            }
+        }
+        // The center tap always has a weight of 9/64 * 1, the sum is never zero
+        return sum / weight_sum;
+    }
+
+    static Color compress(const Color& c) {
+        return Color(std::sqrt(fmax(c.get_x(), 0.)), std::sqrt(fmax(c.get_y(), 0.)), std::sqrt(fmax(c.get_z(), 0.)));
+    }
+
+    template <typename Func>
+    void parallel_rows(int height, Func&& func) const {
+        if (height <= 0) return;
+        ThreadPool::shared().run_bands(num_threads, height, [&func](int, int startLine, int endLine) {
+            func(startLine, endLine);
+        });
+    }
+};
+
+#endif //RAY_TRACING_DENOISER_H
@@ -0,0 +1,116 @@
+#ifndef RAY_TRACING_HEATMAP_H
+#define RAY_TRACING_HEATMAP_H
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+
+#include "common.h"
+#include "png_writer.h"
+#include "hdr_writer.h"
+
+// Cost of every pixel of a render, to find the expensive regions of a frame.
+// The cost is either the wall-clock time spent on the pixel, in microseconds, or the number of BVH nodes
+// visited by its rays (which needs the statistics counters). The renderers that trace several pixels at
+// once, ray packets and wavefront tiles, measure the whole block and share its cost evenly between its pixels.
+enum class HeatmapMode { Off, Time, Visits };
+
+inline bool parse_heatmap_mode(const std::string& name, HeatmapMode& mode) {
+    if (name.empty() || name == "off") mode = HeatmapMode::Off;
+    else if (name == "time") mode = HeatmapMode::Time;
+    else if (name == "visits") mode = HeatmapMode::Visits;
+    else return false;
+    return true;
+}
+
+// Measures the cost of what runs between start() and stop() on the calling thread
+class CostMeter {
+public:
+    explicit CostMeter(HeatmapMode mode) : mode(mode) {}
+
+    void start() {
+        if (mode == HeatmapMode::Time) begin_time = std::chrono::steady_clock::now();
+        else begin_visits = visits();
+    }
+
+    double stop() const {
+        if (mode == HeatmapMode::Time)
+            return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin_time).count();
+        return double(visits() - begin_visits);
+    }
+
+private:
+    HeatmapMode mode;
+    std::chrono::steady_clock::time_point begin_time;
+    uint64_t begin_visits = 0;
+
+    static uint64_t visits() {
+        const RenderStats& s = stats_detail::local();
+        return s.bvh_nodes_visited + s.bvh_packet_nodes_visited;
+    }
+};
+
+class CostBuffer {
+public:
+    int width = 0;
+    int height = 0;
+    std::vector<float> cost;  // Rows from top to bottom
+
+    CostBuffer() = default;
+    CostBuffer(int width, int height) : width(width), height(height), cost(size_t(width) * height, 0.f) {}
+
+    bool empty() const { return cost.empty(); }
+
+    // Threads only write the pixels of their own rows, no locking is needed
+    void set(int x, int y, double c) { cost[size_t(y) * width + x] = float(c); }
+
+    void set_block(int x0, int y0, int x1, int y1, double c) {
+        float share = float(c / ((x1 - x0) * (y1 - y0)));
+        for (int y = y0; y < y1; ++y)
+            std::fill(cost.begin() + size_t(y) * width + x0, cost.begin() + size_t(y) * width + x1, share);
+    }
+
+    // Top of the color scale: the 99th percentile, so that a few outliers do not flatten the rest of the map
+    double scale() const {
+        std::vector<float> sorted(cost);
+        size_t k = std::min(sorted.size() - 1, sorted.size() * 99 / 100);
+        std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+        double top = sorted[k];
+        if (top <= 0) top = *std::max_element(cost.begin(), cost.end());
+        return top > 0 ? top : 1;
+    }
+
+    // Write BASE.heatmap.png, the costs in false colors, and BASE.heatmap.pfm, the raw costs
+    bool write(const std::string& base, int num_threads = 1) const {
+        double top = scale();
+        std::vector<unsigned char> rgb(cost.size() * 3);
+        for (size_t i = 0; i < cost.size(); ++i)
+            heat_color(cost[i] / top, &rgb[3 * i]);
+
+        string png_path = base + ".heatmap.png";
+        FILE* fp = fopen(png_path.c_str(), "wb");
+        if (!fp) {
+            std::cerr << "Failed to open file " << png_path << " for writing." << std::endl;
+            return false;
+        }
+        bool ok = write_png(fp, width, height, rgb.data(), num_threads);
+        fclose(fp);
+        return write_pfm(base + ".heatmap.pfm", width, height, cost.data(), 1) && ok;
+    }
+
+    // Black, purple, red, orange, yellow, white as t goes from 0 to 1, like the "inferno" color map
+    static void heat_color(double t, unsigned char* rgb) {
+        static const double stops[6][3] = {
+                {0, 0, 4}, {87, 16, 110}, {188, 55, 84}, {249, 142, 9}, {252, 255, 164}, {255, 255, 255}};
+        t = std::max(0., std::min(t, 1.)) * 4.999;
+        int k = int(t);
+        double f = t - k;
+        for (int c = 0; c < 3; ++c)
+            rgb[c] = (unsigned char)(stops[k][c] + f * (stops[k + 1][c] - stops[k][c]) + 0.5);
+    }
+};
+
+#endif //RAY_TRACING_HEATMAP_H
@@ -11,6 +11,7 @@
 #include "interval.h"
 #include "vector.h"
 #include "ray.h"
+#include "ray_packet.h"
 
 class AABB {
 public:
@@ -59,6 +60,49 @@ public:
         return true;
     }
 
+    // Returns the rays in mask that may hit the box.
+    // If the first active ray hits, the whole mask is kept without testing the others (the primitives
+    // test each ray exactly anyway). Otherwise a coherent packet is culled as a whole against the box,
+    // using the bounds of its origins and inverse directions, before the per-ray slab tests.
+    uint32_t hit_packet(const RayPacket& packet, uint32_t mask) const {
+        int first = 0;
+        while (!(mask >> first & 1u)) first++;
+        if (hit_ray(packet, first))
+            return mask;
+        if (packet.coherent && frustum_misses(packet))
+            return 0;
+
+        double t_near[RayPacket::max_size], t_far[RayPacket::max_size];
+        const int n = packet.size;
+        for (int i = 0; i < n; ++i) {
+            t_near[i] = packet.t_min;
+            t_far[i] = packet.t_max[i];
+        }
+        for (int a = 0; a < 3; ++a) {
+            const double lo = axis(a).get_min(), hi = axis(a).get_max();
+            const double* orig = packet.org[a];
+            const double* inv = packet.inv_dir[a];
+            for (int i = 0; i < n; ++i) {
+                // Plain comparisons instead of fmin/fmax, they map to packed min/max instructions
+                double t0 = (lo - orig[i]) * inv[i];
+                double t1 = (hi - orig[i]) * inv[i];
+                double t_enter = t0 < t1 ? t0 : t1;
+                double t_exit = t0 < t1 ? t1 : t0;
+                t_near[i] = t_enter > t_near[i] ? t_enter : t_near[i];
+                t_far[i] = t_exit < t_far[i] ? t_exit : t_far[i];
+            }
+        }
+        uint32_t result = 0;
+        for (int i = 0; i < n; ++i)
+            result |= uint32_t(t_near[i] < t_far[i]) << i;
+        return result & mask;
+    }
+
+    double surface_area() const {
+        double dx = x.size(), dy = y.size(), dz = z.size();
+        return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+
     int longest_axis() const {
         if (x.size() > y.size())
             return x.size() > z.size() ? 0 : 2;
@@ -66,9 +110,62 @@ public:
             return y.size() > z.size() ? 1 : 2;
     }
 
+    // Box at s of the linear motion from a (s = 0) to b (s = 1)
+    static AABB lerp(const AABB& a, const AABB& b, double s) {
+        auto mix = [s](const Interval& i, const Interval& j) {
+            return Interval(i.get_min() + s * (j.get_min() - i.get_min()), i.get_max() + s * (j.get_max() - i.get_max()));
+        };
+        return AABB(mix(a.x, b.x), mix(a.y, b.y), mix(a.z, b.z));
+    }
+
     static const AABB empty, universe;
 
 private:
+    bool hit_ray(const RayPacket& packet, int i) const {
+        double t_near = packet.t_min, t_far = packet.t_max[i];
+        for (int a = 0; a < 3; a++) {
+            double t0 = (axis(a).get_min() - packet.org[a][i]) * packet.inv_dir[a][i];
+            double t1 = (axis(a).get_max() - packet.org[a][i]) * packet.inv_dir[a][i];
+            if (packet.inv_dir[a][i] < 0)
+                std::swap(t0, t1);
+            if (t0 > t_near) t_near = t0;
+            if (t1 < t_far) t_far = t1;
+            if (t_near >= t_far)
+                return false;
+        }
+        return true;
+    }
+
+    // Interval arithmetic: the packet misses if the latest possible entry of all its rays
+    // is after the earliest possible exit.
+    bool frustum_misses(const RayPacket& packet) const {
+        double entry = packet.t_min;
+        double exit = -inf;
+        for (int i = 0; i < packet.size; ++i)
+            exit = packet.t_max[i] > exit ? packet.t_max[i] : exit;
+        for (int a = 0; a < 3; ++a) {
+            double lo = axis(a).get_min(), hi = axis(a).get_max();
+            double near_plane = packet.inv_lo[a] > 0 ? lo : hi;
+            double far_plane = packet.inv_lo[a] > 0 ? hi : lo;
+            double near_lo, near_hi, far_lo, far_hi;
+            interval_product(near_plane - packet.org_hi[a], near_plane - packet.org_lo[a],
+                             packet.inv_lo[a], packet.inv_hi[a], near_lo, near_hi);
+            interval_product(far_plane - packet.org_hi[a], far_plane - packet.org_lo[a],
+                             packet.inv_lo[a], packet.inv_hi[a], far_lo, far_hi);
+            entry = near_lo > entry ? near_lo : entry;
+            exit = far_hi < exit ? far_hi : exit;
+        }
+        return entry > exit;
+    }
+
+    static void interval_product(double a, double b, double c, double d, double& lo, double& hi) {
+        double ac = a * c, ad = a * d, bc = b * c, bd = b * d;
+        double lo1 = ac < ad ? ac : ad, lo2 = bc < bd ? bc : bd;
+        double hi1 = ac < ad ? ad : ac, hi2 = bc < bd ? bd : bc;
+        lo = lo1 < lo2 ? lo1 : lo2;
+        hi = hi1 < hi2 ? hi2 : hi1;
+    }
+
     void pad_to_minimums() {
         double delta = 0.00001;
         if (x.size() < delta) x = x.expand(delta);
@@ -12,11 +12,19 @@
 #include "hittable.h"
 #include "material.h"
 
+// Scene statistics of a primitive and, the first time it is seen, of its material
+inline void gather_primitive_stats(SceneStats& stats, PrimitiveType type, size_t bytes, const Material* material) {
+    stats.add_primitive(type, bytes);
+    if (stats.add_material(material)) material->gather_stats(stats);
+}
+
 class Sphere: public Hittable {
 public:
     Sphere(const Point3d& center, double radius, std::shared_ptr<Material> material)
             : center(center), radius(fmax(radius,0)), material(std::move(material))
     {
+        // u goes around the equator and v from pole to pole
+        uv_length = pi * std::sqrt(2.) * this->radius;
         auto rvec = Vector3d(radius, radius, radius);
         bbox = AABB(center - rvec, center + rvec);
     }
@@ -24,6 +32,7 @@ public:
     AABB bounding_box() const override { return bbox; }
 
     bool hit(const Ray& ray, Interval t_ray, HitStatus& stat) const override {
+        STAT_INC(primitive_tests[int(PrimitiveType::Sphere)]);
         Vector3d v = center - ray.origin();
         auto a = ray.direction().squared_length();
         auto half_b = dot(ray.direction(), v);
@@ -43,13 +52,23 @@ public:
         Vector3d outward_normal = (stat.hit_point - center) / radius;
         stat.set_face_normal(ray, outward_normal);
         get_sphere_uv(outward_normal, stat.u, stat.v);
-        stat.material = material;
+        stat.uv_length = uv_length;
+        stat.material = material_index;
+        STAT_INC(primitive_hits[int(PrimitiveType::Sphere)]);
         return true;
     }
+
+    void gather_stats(SceneStats& stats) const override {
+        gather_primitive_stats(stats, PrimitiveType::Sphere, sizeof(*this), material.get());
+    }
+
+    void bind_materials(MaterialTable& table) override { table.bind(material, material_index); }
 private:
     Point3d center;
     double radius;
+    double uv_length;
     std::shared_ptr<Material> material;
+    int material_index = -1;  // In the MaterialTable of the scene
     AABB bbox;
 
     static void get_sphere_uv(const Point3d& p, double& u, double& v) {
@@ -61,7 +80,7 @@ private:
         //     <0 0 1> yields <0.25 0.50>       < 0  0 -1> yields <0.75 0.50>
 
         auto theta = std::acos(-p.get_y());
-        auto phi = std::atan2(-p.get_y(), p.get_x()) + pi;
+        auto phi = std::atan2(-p.get_z(), p.get_x()) + pi;
 
         u = phi / (2*pi);
         v = theta / pi;
@@ -76,6 +95,7 @@ public:
         normal = unit_vector(n);
         D = dot(normal, Q);
         w = n / dot(n, n);
+        uv_length = std::sqrt(n.length());
 
         set_bounding_box();
     }
@@ -90,6 +110,7 @@ public:
     AABB bounding_box() const override { return bbox; }
 
     bool hit (const Ray& ray, Interval t_ray, HitStatus& stat) const override {
+        STAT_INC(primitive_tests[int(PrimitiveType::Quadrilateral)]);
         auto denom = dot(normal, ray.direction());
 
         // No hit if the ray is parallel with the plane
@@ -110,12 +131,20 @@ public:
 
         stat.t = t;
         stat.hit_point = intersection;
-        stat.material = material;
+        stat.uv_length = uv_length;
+        stat.material = material_index;
         stat.set_face_normal(ray, normal);
+        STAT_INC(primitive_hits[int(PrimitiveType::Quadrilateral)]);
 
         return true;
     }
 
+    void gather_stats(SceneStats& stats) const override {
+        gather_primitive_stats(stats, PrimitiveType::Quadrilateral, sizeof(*this), material.get());
+    }
+
+    void bind_materials(MaterialTable& table) override { table.bind(material, material_index); }
+
     virtual bool is_interior(double a, double b, HitStatus& stat) const {
         Interval unit_interval = Interval(0, 1);
 
@@ -133,9 +162,11 @@ private:
     Vector3d v; // vector leading to another side
     Vector3d w;
     std::shared_ptr<Material> material;
+    int material_index = -1;  // In the MaterialTable of the scene
     AABB bbox;
     Vector3d normal;
     double D;
+    double uv_length;
 };
 
 inline std::shared_ptr<HittableList> box(const Point3d& a, const Point3d& b, std::shared_ptr<Material> mat)
@@ -168,11 +199,13 @@ public:
         : v0(v0), v1(v1), v2(v2), material(material) {
         // Precompute normal for efficiency
         normal = unit_vector(cross(v1 - v0, v2 - v0));
+        uv_length = std::sqrt(cross(v1 - v0, v2 - v0).length());
         // Set up bounding box
         set_bounding_box();
     }
 
     bool hit(const Ray& ray, Interval t_ray, HitStatus& stat) const override {
+        STAT_INC(primitive_tests[int(PrimitiveType::Triangle)]);
         Vector3d e1 = v1 - v0;
         Vector3d e2 = v2 - v0;
         Vector3d h = cross(ray.direction(), e2);
@@ -203,8 +236,12 @@ public:
         if (t > t_ray.get_min() && t < t_ray.get_max()) {
             stat.t = t;
             stat.hit_point = ray.at(t);
+            stat.u = u;  // Barycentric coordinates along v1 - v0 and v2 - v0
+            stat.v = v;
+            stat.uv_length = uv_length;
             stat.set_face_normal(ray, normal);  // Ensure proper orientation of the normal
-            stat.material = material;
+            stat.material = material_index;
+            STAT_INC(primitive_hits[int(PrimitiveType::Triangle)]);
             return true;
         }
 
@@ -216,10 +253,18 @@ public:
         return bbox;
     }
 
+    void gather_stats(SceneStats& stats) const override {
+        gather_primitive_stats(stats, PrimitiveType::Triangle, sizeof(*this), material.get());
+    }
+
+    void bind_materials(MaterialTable& table) override { table.bind(material, material_index); }
+
 private:
     Point3d v0, v1, v2;
     Vector3d normal;
+    double uv_length;
     std::shared_ptr<Material> material;
+    int material_index = -1;  // In the MaterialTable of the scene
     AABB bbox;
 
     void set_bounding_box() {
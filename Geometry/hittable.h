@@ -8,17 +8,20 @@
 #include <iostream>
 #include <memory>
 #include <algorithm>
+#include <vector>
 #include "common.h"
+#include "scene_stats.h"
 
-class Material;
+class MaterialTable;
 
 class HitStatus {
 public:
     Point3d hit_point;
     Vector3d normal;
-    std::shared_ptr<Material> material;
+    int material = -1;  // Index of the material of the object hit in the MaterialTable of the scene
     double t;
     double u, v; // quadrilateral
+    double uv_length;  // World length of one unit of u and v at the hit point, for the level of detail of textures
     bool front_face;
 
     void set_face_normal(const Ray& ray, const Vector3d& outward_normal) {
@@ -34,6 +37,28 @@ public:
     virtual ~Hittable() = default;
     virtual bool hit(const Ray& ray, Interval t_ray, HitStatus& stat) const = 0;
     virtual AABB bounding_box() const = 0;
+    // Moving objects: bounds at a time of the scene, and the times at which they change speed, between two of
+    // which they move linearly. bounding_box() holds the object at every time.
+    virtual AABB bounding_box_at(double time) const { return bounding_box(); }
+    virtual void motion_times(std::vector<double>& times) const {}
+    // Report this object and what it references (children, material) to the scene statistics
+    virtual void gather_stats(SceneStats& stats) const {}
+    // Add the materials of this object and its children to the table of the scene and keep their indices,
+    // which the hits report. Done once the scene is built, before rendering it. Every object says what it
+    // binds, one that forgot to would report hits without a material.
+    virtual void bind_materials(MaterialTable& table) = 0;
+
+    // Closest hit of the rays of a packet selected by mask, stats[i] is filled for ray i.
+    // Primitives simply test the rays one by one, acceleration structures traverse with the whole packet.
+    virtual void hit_packet(RayPacket& packet, uint32_t mask, HitStatus* stats) const {
+        for (int i = 0; i < packet.size; ++i) {
+            if (!(mask >> i & 1u)) continue;
+            if (hit(packet.ray(i), Interval(packet.t_min, packet.t_max[i]), stats[i])) {
+                packet.t_max[i] = stats[i].t;
+                packet.hit_mask |= 1u << i;
+            }
+        }
+    }
 };
 
 class HittableList: public Hittable {
@@ -65,9 +90,38 @@ public:
 
         return is_hit;
     }
+
+    void hit_packet(RayPacket& packet, uint32_t mask, HitStatus* stats) const override {
+        // t_max of every ray shrinks as closer hits are found, the last one written is the closest
+        for (const auto& obj : objects)
+            obj->hit_packet(packet, mask, stats);
+    }
+
+    void gather_stats(SceneStats& stats) const override {
+        stats.add_list(sizeof(*this) + objects.capacity() * sizeof(objects[0]));
+        for (const auto& obj : objects)
+            obj->gather_stats(stats);
+    }
+
+    void bind_materials(MaterialTable& table) override {
+        for (const auto& obj : objects)
+            obj->bind_materials(table);
+    }
     
     AABB bounding_box() const override { return bbox; }
 
+    AABB bounding_box_at(double time) const override {
+        AABB box = AABB::empty;
+        for (const auto& obj : objects)
+            box = AABB(box, obj->bounding_box_at(time));
+        return box;
+    }
+
+    void motion_times(std::vector<double>& times) const override {
+        for (const auto& obj : objects)
+            obj->motion_times(times);
+    }
+
 private:
     AABB bbox;
 };
@@ -82,8 +136,76 @@ class rotate_y: public Hittable {
 
 class BVH_Node: public Hittable {
 public:
-    explicit BVH_Node(HittableList list) : BVH_Node(list.objects, 0, list.objects.size()) {}
-    BVH_Node(std::vector<std::shared_ptr<Hittable>>& src_objects, size_t start, size_t end){
+    explicit BVH_Node(HittableList list) {
+        TRACE_SCOPE("bvh_build", "scene");
+        build(list.objects, 0, list.objects.size());
+    }
+    BVH_Node(std::vector<std::shared_ptr<Hittable>>& src_objects, size_t start, size_t end) {
+        build(src_objects, start, end);
+    }
+
+    bool hit(const Ray& ray, Interval t_ray, HitStatus& stat) const override {
+        STAT_INC(bvh_nodes_visited);
+        if (!(motion ? motion->at(ray.time()) : bbox).hit(ray, t_ray)) return false;
+        bool hit_left = left->hit(ray, t_ray, stat);
+        bool hit_right = right->hit(ray, Interval(t_ray.get_min(), hit_left ? stat.t : t_ray.get_max()), stat);
+        return hit_left || hit_right;
+    }
+
+    // The rays of a packet may have different times, they are culled with the bounds of the whole motion
+    void hit_packet(RayPacket& packet, uint32_t mask, HitStatus* stats) const override {
+        STAT_INC(bvh_packet_nodes_visited);
+        mask = bbox.hit_packet(packet, mask);
+        if (!mask) return;
+        left->hit_packet(packet, mask, stats);
+        if (right != left)
+            right->hit_packet(packet, mask, stats);
+    }
+
+    AABB bounding_box() const override { return bbox; }
+
+    AABB bounding_box_at(double time) const override { return motion ? motion->at(time) : bbox; }
+
+    void motion_times(std::vector<double>& times) const override {
+        if (!motion) return;
+        times.push_back(motion->t0);
+        times.push_back(motion->t1);
+    }
+
+    void gather_stats(SceneStats& stats) const override {
+        stats.enter_bvh_node(bbox.surface_area(), sizeof(*this));
+        left->gather_stats(stats);
+        // Single objects are stored as both children
+        if (right != left)
+            right->gather_stats(stats);
+        stats.leave_bvh_node();
+    }
+
+    void bind_materials(MaterialTable& table) override {
+        left->bind_materials(table);
+        if (right != left)
+            right->bind_materials(table);
+    }
+
+private:
+    // Bounds of the children moving from box0 at t0 to box1 at t1, they stay still before and after
+    struct MotionBounds {
+        double t0, t1;
+        AABB box0, box1;
+
+        AABB at(double time) const {
+            double s = (time - t0) / (t1 - t0);
+            return AABB::lerp(box0, box1, s < 0 ? 0 : s > 1 ? 1 : s);
+        }
+    };
+
+    std::shared_ptr<Hittable> left;
+    std::shared_ptr<Hittable> right;
+    AABB bbox;  // Bounds of the whole motion
+    std::unique_ptr<MotionBounds> motion;  // Only for nodes over moving objects
+
+    // Split src_objects[start, end) in two halves along the longest axis of their bounds
+    void build(std::vector<std::shared_ptr<Hittable>>& src_objects, size_t start, size_t end) {
         // Build the bounding box of the span of source objects.
         bbox = AABB::empty;
         for (size_t object_index=start; object_index < end; object_index++)
@@ -109,21 +231,46 @@ public:
             left = std::make_shared<BVH_Node>(src_objects, start, mid);
             right = std::make_shared<BVH_Node>(src_objects, mid, end);
         }
+        build_motion();
     }
 
-    bool hit(const Ray& ray, Interval t_ray, HitStatus& stat) const override {
-        if (!bbox.hit(ray, t_ray)) return false;
-        bool hit_left = left->hit(ray, t_ray, stat);
-        bool hit_right = right->hit(ray, Interval(t_ray.get_min(), hit_left ? stat.t : t_ray.get_max()), stat);
-        return hit_left || hit_right;
+    AABB children_box_at(double time) const {
+        return right == left ? left->bounding_box_at(time)
+                             : AABB(left->bounding_box_at(time), right->bounding_box_at(time));
     }
 
-    AABB bounding_box() const override { return bbox; }
+    // Bounds at the first and last of the times reported by the children, interpolated in between.
+    // The children move linearly between two of these times, so if the interpolated bounds hold them at
+    // each of these times they hold them at any time: they are grown by how far the children are out of them.
+    void build_motion() {
+        std::vector<double> times;
+        left->motion_times(times);
+        if (right != left) right->motion_times(times);
+        if (times.empty()) return;
+        std::sort(times.begin(), times.end());
+        times.erase(std::unique(times.begin(), times.end()), times.end());
+        if (times.size() < 2) return;
 
-private:
-    std::shared_ptr<Hittable> left;
-    std::shared_ptr<Hittable> right;
-    AABB bbox;
+        motion.reset(new MotionBounds{times.front(), times.back(), children_box_at(times.front()),
+                                      children_box_at(times.back())});
+        for (size_t k = 1; k + 1 < times.size(); ++k) {
+            AABB box = children_box_at(times[k]);
+            AABB interpolated = motion->at(times[k]);
+            double grow_min[3], grow_max[3];
+            for (int a = 0; a < 3; ++a) {
+                grow_min[a] = std::max(0.0, interpolated.axis(a).get_min() - box.axis(a).get_min());
+                grow_max[a] = std::max(0.0, box.axis(a).get_max() - interpolated.axis(a).get_max());
+            }
+            motion->box0 = grown(motion->box0, grow_min, grow_max);
+            motion->box1 = grown(motion->box1, grow_min, grow_max);
+        }
+    }
+
+    static AABB grown(const AABB& box, const double* grow_min, const double* grow_max) {
+        return AABB(Interval(box.x.get_min() - grow_min[0], box.x.get_max() + grow_max[0]),
+                    Interval(box.y.get_min() - grow_min[1], box.y.get_max() + grow_max[1]),
+                    Interval(box.z.get_min() - grow_min[2], box.z.get_max() + grow_max[2]));
+    }
 
     static bool box_compare(const std::shared_ptr<Hittable>& a, const std::shared_ptr<Hittable>& b, int idx_axis) {
         return a->bounding_box().axis(idx_axis).get_min() < b->bounding_box().axis(idx_axis).get_min();
@@ -9,71 +9,656 @@
 #include "camera.h"
 #include "material.h"
 #include "geometry.h"
+#include "motion.h"
 #include "texture.h"
+#include "image_texture.h"
+#include "noise_texture.h"
+#include "scene_cache.h"
 
 #include <fstream>
 #include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+#include <stdexcept>
+#include <initializer_list>
 
 using json = nlohmann::json;
 
-std::shared_ptr<Texture> parse_texture(const json& tex_json) {
-    if (tex_json["type"] == "Checker") {
-        double scale = tex_json["scale"];
-        Color even(tex_json["even"][0], tex_json["even"][1], tex_json["even"][2]);
-        Color odd(tex_json["odd"][0], tex_json["odd"][1], tex_json["odd"][2]);
-        return std::make_shared<CheckerTexture>(scale, even, odd);
+// Materials and textures of a scene.
+// They are given inline in the objects, or by the name of a definition of the "Materials" and "Textures"
+// blocks of the scene. Each distinct set of parameters is created once and shared by all the objects
+// using it: a key made of the type and the parameters of a material or texture (with the textures it uses
+// already shared, so identified by their address) is looked up in a hash table before creating anything.
+// With records, every material and texture created is also described there for the scene cache.
+// The files of image textures are relative to directory.
+class SceneLibrary {
+public:
+    explicit SceneLibrary(SceneRecords* records = nullptr, const std::string& directory = "")
+        : texture_defs(json::object()), material_defs(json::object()), records(records), directory(directory) {}
+
+    // Add the definitions of a "Textures" or "Materials" block
+    void define_textures(const json& defs) { define(texture_defs, defs, "Textures"); }
+    void define_materials(const json& defs) { define(material_defs, defs, "Materials"); }
+
+    // True if every name used by a material, and by its textures, is already defined
+    bool ready_material(const json& mat_json, int depth = 0) const {
+        if (depth > 32) return true;  // A definition referring to itself, reported when it is resolved
+        if (mat_json.is_string())
+            return material_defs.contains(mat_json.get<std::string>())
+                   && ready_material(material_defs[mat_json.get<std::string>()], depth + 1);
+        return !mat_json.is_object() || !mat_json.contains("texture") || ready_texture(mat_json["texture"], depth + 1);
     }
-    throw std::runtime_error("Unknown texture type");
-}
 
-std::shared_ptr<Material> parse_material(const json& mat_json) {
-    if (mat_json["type"] == "Lambertian") {
-        // Check if the key "color" exists in the json object
-        if (!mat_json.contains("color")) {
-            std::cout << "Texture detected" << std::endl;
-            auto texture = parse_texture(mat_json["texture"]);
-            return std::make_shared<Lambertian>(texture);
+    bool ready_texture(const json& tex_json, int depth = 0) const {
+        if (depth > 32) return true;
+        if (tex_json.is_string())
+            return texture_defs.contains(tex_json.get<std::string>())
+                   && ready_texture(texture_defs[tex_json.get<std::string>()], depth + 1);
+        if (!tex_json.is_object()) return true;
+        for (const char* square : {"even", "odd"}) {
+            if (tex_json.contains(square) && !tex_json[square].is_array() && !ready_texture(tex_json[square], depth + 1))
+                return false;
+        }
+        return true;
+    }
+
+    // A name of the "Textures" block, or an inline definition
+    std::shared_ptr<Texture> texture(const json& tex_json) {
+        if (tex_json.is_string()) return named(tex_json, texture_defs, named_textures, "texture", &SceneLibrary::texture);
+        return parse_texture(tex_json);
+    }
+
+    // A name of the "Materials" block, or an inline definition
+    std::shared_ptr<Material> material(const json& mat_json) {
+        if (mat_json.is_string()) return named(mat_json, material_defs, named_materials, "material", &SceneLibrary::material);
+        return parse_material(mat_json);
+    }
+
+    // Index of the record of a material created by this library
+    uint32_t record_index(const Material* material) const { return index.at(material); }
+
+private:
+    json texture_defs, material_defs;
+    SceneRecords* records;
+    std::string directory;
+    std::unordered_map<const void*, uint32_t> index;  // Record of every material and texture
+    std::unordered_map<std::string, std::shared_ptr<Texture>> textures;    // By key
+    std::unordered_map<std::string, std::shared_ptr<Material>> materials;  // By key
+    std::unordered_map<std::string, std::shared_ptr<Texture>> named_textures;
+    std::unordered_map<std::string, std::shared_ptr<Material>> named_materials;
+    std::vector<std::string> resolving;  // Names being defined, to report definitions that refer to themselves
+
+    static void define(json& defs, const json& block, const char* kind) {
+        if (!block.is_object())
+            throw std::runtime_error(std::string("\"") + kind + "\" must be an object of named definitions");
+        for (auto it = block.begin(); it != block.end(); ++it) {
+            if (defs.contains(it.key()))
+                throw std::runtime_error(std::string("\"") + it.key() + "\" is defined twice in \"" + kind + "\"");
+            defs[it.key()] = it.value();
+        }
+    }
+
+    template <class T>
+    std::shared_ptr<T> named(const json& name_json, const json& defs,
+                             std::unordered_map<std::string, std::shared_ptr<T>>& cache, const char* kind,
+                             std::shared_ptr<T> (SceneLibrary::*resolve)(const json&)) {
+        std::string name = name_json;
+        auto it = cache.find(name);
+        if (it != cache.end()) return it->second;
+        if (!defs.contains(name))
+            throw std::runtime_error(std::string("unknown ") + kind + " \"" + name + "\"");
+        if (std::find(resolving.begin(), resolving.end(), name) != resolving.end())
+            throw std::runtime_error(std::string("the definition of ") + kind + " \"" + name + "\" refers to itself");
+        resolving.push_back(name);
+        std::shared_ptr<T> value = (this->*resolve)(defs[name]);  // A definition may be the name of another one
+        resolving.pop_back();
+        cache[name] = value;
+        return value;
+    }
+
+    template <class T, class Make>
+    static std::shared_ptr<T> intern(std::unordered_map<std::string, std::shared_ptr<T>>& table,
+                                     const std::string& key, Make make) {
+        auto it = table.find(key);
+        if (it != table.end()) return it->second;
+        std::shared_ptr<T> value = make();
+        table.emplace(key, value);
+        return value;
+    }
+
+    static Color parse_color(const json& c) {
+        if (!c.is_array() || c.size() != 3) throw std::runtime_error("a color must be an array of 3 numbers");
+        return Color(c[0].get<double>(), c[1].get<double>(), c[2].get<double>());
+    }
+
+    static std::string type_of(const json& j, const char* kind) {
+        if (!j.is_object()) throw std::runtime_error(std::string("a ") + kind + " must be a name or an object");
+        if (!j.contains("type")) throw std::runtime_error(std::string("a ") + kind + " has no \"type\"");
+        return j["type"].get<std::string>();
+    }
+
+    static std::string key_of(double x) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.17g|", x);
+        return buffer;
+    }
+
+    static std::string key_of(const Color& c) {
+        return key_of(c[0]) + key_of(c[1]) + key_of(c[2]);
+    }
+
+    static std::string key_of(const void* shared) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%p|", shared);
+        return buffer;
+    }
+
+    // Nothing is recorded any more once the scene is known not to fit in the cache
+    bool recording() const { return records && records->uncacheable.empty(); }
+
+    void record_texture(const Texture* tex, scene_cache::TextureKind kind, double scale, const Color& color,
+                        const Texture* even, const Texture* odd) {
+        if (!recording()) return;
+        scene_cache::TextureRecord r = {kind, 0, 0, 0, scale, {color[0], color[1], color[2]}};
+        if (even) r.even = index.at(even);
+        if (odd) r.odd = index.at(odd);
+        index[tex] = uint32_t(records->textures.size());
+        records->textures.push_back(r);
+    }
+
+    void record_material(const Material* mat, const Texture* tex, const Color& color, double parameter) {
+        if (!recording()) return;
+        scene_cache::MaterialRecord r = {mat->type(), 0, {color[0], color[1], color[2]}, parameter};
+        if (tex) r.texture = index.at(tex);
+        index[mat] = uint32_t(records->materials.size());
+        records->materials.push_back(r);
+    }
+
+    std::shared_ptr<Texture> solid(const Color& color) {
+        return intern(textures, "Solid|" + key_of(color), [&]() {
+            auto tex = std::make_shared<SolidColor>(color);
+            record_texture(tex.get(), scene_cache::TextureKind::Solid, 0, color, nullptr, nullptr);
+            return tex;
+        });
+    }
+
+    // The squares of a checker are colors, or textures given like any other
+    std::shared_ptr<Texture> checker_square(const json& j) {
+        if (j.is_array()) return solid(parse_color(j));
+        return texture(j);
+    }
+
+    std::shared_ptr<Texture> parse_texture(const json& tex_json) {
+        std::string type = type_of(tex_json, "texture");
+        if (type == "Checker") {
+            double scale = tex_json.at("scale");
+            auto even = checker_square(tex_json.at("even"));
+            auto odd = checker_square(tex_json.at("odd"));
+            return intern(textures, "Checker|" + key_of(scale) + key_of(even.get()) + key_of(odd.get()),
+                          [&]() {
+                auto tex = std::make_shared<CheckerTexture>(scale, even, odd);
+                record_texture(tex.get(), scene_cache::TextureKind::Checker, scale, Color(), even.get(), odd.get());
+                return tex;
+            });
+        } else if (type == "Solid") {
+            return solid(parse_color(tex_json.at("color")));
+        } else if (type == "Image") {
+            std::string file = tex_json.at("file");
+            if (file.empty()) throw std::runtime_error("\"file\" must name an image file");
+            if (!directory.empty() && file.front() != '/') file = directory + "/" + file;
+            std::string filter = tex_json.value("filter", std::string("trilinear"));
+            if (filter != "bilinear" && filter != "trilinear")
+                throw std::runtime_error("\"filter\" must be bilinear or trilinear");
+            return intern(textures, "Image|" + file + "|" + filter, [&]() {
+                auto tex = std::make_shared<ImageTexture>(TextureCache::shared().image(file),
+                                                          filter == "bilinear" ? ImageTexture::Filter::Bilinear
+                                                                               : ImageTexture::Filter::Trilinear);
+                if (records) records->uncacheable = "image textures";
+                return tex;
+            });
+        } else if (type == "Noise") {
+            return noise_texture(tex_json);
+        }
+        throw std::runtime_error("unknown texture type \"" + type + "\"");
+    }
+
+    std::shared_ptr<Texture> noise_texture(const json& tex_json) {
+        static const char* patterns[] = {"noise", "fbm", "turbulence", "marble", "wood"};
+        std::string pattern = tex_json.value("pattern", std::string("noise"));
+        int p = int(std::find(patterns, patterns + 5, pattern) - patterns);
+        if (p == 5) throw std::runtime_error("\"pattern\" must be noise, fbm, turbulence, marble or wood");
+        std::string basis = tex_json.value("basis", std::string("perlin"));
+        if (basis != "perlin" && basis != "simplex") throw std::runtime_error("\"basis\" must be perlin or simplex");
+        Noise::Fractal fractal;
+        fractal.basis = basis == "perlin" ? Noise::Basis::Perlin : Noise::Basis::Simplex;
+        fractal.octaves = tex_json.value("octaves", 6);
+        fractal.lacunarity = tex_json.value("lacunarity", 2.0);
+        fractal.gain = tex_json.value("gain", 0.5);
+        if (fractal.octaves < 1 || fractal.octaves > 32) throw std::runtime_error("\"octaves\" must be from 1 to 32");
+        double scale = tex_json.value("scale", 1.0);
+        double distortion = tex_json.value("distortion", 5.0);
+        uint32_t seed = tex_json.value("seed", 0u);
+        Color low = tex_json.contains("low") ? parse_color(tex_json["low"]) : Color(0, 0, 0);
+        Color high = tex_json.contains("high") ? parse_color(tex_json["high"]) : Color(1, 1, 1);
+        std::string key = "Noise|" + pattern + "|" + basis + "|" + key_of(fractal.octaves) + key_of(fractal.lacunarity)
+                          + key_of(fractal.gain) + key_of(scale) + key_of(distortion) + key_of(seed)
+                          + key_of(low) + key_of(high);
+        return intern(textures, key, [&]() {
+            auto tex = std::make_shared<NoiseTexture>(Noise(seed), NoiseTexture::Pattern(p), scale, fractal,
+                                                      distortion, low, high);
+            if (records) records->uncacheable = "noise textures";
+            return tex;
+        });
+    }
+
+    std::shared_ptr<Material> parse_material(const json& mat_json) {
+        std::string type = type_of(mat_json, "material");
+        if (type == "Lambertian") {
+            // Check if the key "color" exists in the json object
+            std::shared_ptr<Texture> tex = mat_json.contains("color") ? solid(parse_color(mat_json["color"]))
+                                                                      : texture(mat_json.at("texture"));
+            return intern(materials, "Lambertian|" + key_of(tex.get()),
+                          [&]() {
+                auto mat = std::make_shared<Lambertian>(tex);
+                record_material(mat.get(), tex.get(), Color(), 0);
+                return mat;
+            });
+        } else if (type == "Metal") {
+            double fuzz = mat_json.value("fuzz", 0.0); // Provide default value if not specifie
+            Color color = parse_color(mat_json.at("color"));
+            return intern(materials, "Metal|" + key_of(color) + key_of(fuzz),
+                          [&]() {
+                auto mat = std::make_shared<Metal>(color, fuzz);
+                record_material(mat.get(), nullptr, color, fuzz);
+                return mat;
+            });
+        } else if (type == "Dielectric") {
+            double ref_idx = mat_json.at("ref_idx");
+            return intern(materials, "Dielectric|" + key_of(ref_idx),
+                          [&]() {
+                auto mat = std::make_shared<Dielectric>(ref_idx);
+                record_material(mat.get(), nullptr, Color(), ref_idx);
+                return mat;
+            });
+        }
+        throw std::runtime_error("unknown material type \"" + type + "\"");
+    }
+};
+
+// Iterator over the characters of a stream that counts the lines read, for the error messages of the parser
+class LineCountingIterator {
+public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef char value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const char* pointer;
+    typedef char reference;
+
+    LineCountingIterator() = default;
+    LineCountingIterator(std::istream& is, size_t* line) : it(is), line(line) {}
+
+    char operator*() const { return *it; }
+    LineCountingIterator& operator++() {
+        if (*it == '\n') ++*line;
+        ++it;
+        return *this;
+    }
+    bool operator==(const LineCountingIterator& other) const { return it == other.it; }
+    bool operator!=(const LineCountingIterator& other) const { return it != other.it; }
+
+private:
+    std::istreambuf_iterator<char> it;
+    size_t* line = nullptr;
+};
+
+// Streaming reader of a scene file, driven by the SAX interface of nlohmann::json.
+// Every element of "Objects" is collected alone and turned into a primitive as soon as it is complete,
+// then dropped: the whole file is never held in memory. The other top-level members ("Materials",
+// "Textures" and the settings) are small and kept as they are. An object using a name that is not defined
+// yet waits until the end of the file, as definitions may come after the objects.
+// Errors are thrown as std::runtime_error prefixed with the file name and the line of the faulty object.
+class SceneParser : public nlohmann::json_sax<json> {
+public:
+    HittableList world;
+    json settings = json::object();   // Top-level members other than "Objects" and the definitions
+
+    SceneParser(const std::string& filename, SceneRecords* records)
+        : filename(filename), records(records), library(records, directory_of(filename)) {}
+
+    void parse(std::istream& is) {
+        line = 1;
+        json::sax_parse(LineCountingIterator(is, &line), LineCountingIterator(), this);
+        for (const Pending& p : pending)
+            add_object(p.object, p.line);
+        pending.clear();
+    }
+
+    bool null() override { return value(json()); }
+    bool boolean(bool b) override { return value(b); }
+    bool number_integer(number_integer_t n) override { return value(n); }
+    bool number_unsigned(number_unsigned_t n) override { return value(n); }
+    bool number_float(number_float_t x, const string_t&) override { return value(x); }
+    bool string(string_t& s) override { return value(s); }
+    bool binary(binary_t& b) override { return value(json::binary(b)); }
+
+    bool start_object(std::size_t) override { return open(json::object()); }
+    bool start_array(std::size_t) override { return open(json::array()); }
+    bool end_object() override { return close(); }
+    bool end_array() override { return close(); }
+
+    bool key(string_t& k) override {
+        if (depth == 1) top_key = k;
+        else current_key = k;
+        return true;
+    }
+
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& ex) override {
+        // The message of the lexer gives the line and column
+        throw std::runtime_error(filename + ": " + ex.what());
+    }
+
+private:
+    struct Pending {
+        json object;
+        size_t line;
+    };
+
+    std::string filename;
+    SceneRecords* records;
+    SceneLibrary library;
+    size_t line = 1;
+    int depth = 0;                  // Containers open at the current position, 1 inside the top-level object
+    std::string top_key, current_key;
+    bool in_objects = false;        // Inside the "Objects" array
+    json captured;                  // Member or object being collected
+    std::vector<json*> containers;  // Open containers of captured
+    size_t captured_line = 0;
+    std::vector<Pending> pending;
+
+    std::string location(size_t at) const { return filename + ":" + std::to_string(at) + ": "; }
+
+    // Depth at which a collected value starts: objects are elements of "Objects", other values members
+    int capture_depth() const { return in_objects ? 2 : 1; }
+
+    bool value(json&& v) {
+        if (!containers.empty()) {
+            insert(std::move(v));
+        } else if (depth == 1) {
+            captured = std::move(v);
+            finish_member();
+        } else if (in_objects && depth == 2) {
+            throw std::runtime_error(location(line) + "the elements of \"Objects\" must be objects");
         } else {
-            Color color(mat_json["color"][0], mat_json["color"][1], mat_json["color"][2]);
-            return std::make_shared<Lambertian>(color);
+            throw std::runtime_error(location(line) + "a scene must be a JSON object");
+        }
+        return true;
+    }
+
+    bool open(json&& container) {
+        if (depth == 0 && !container.is_object())
+            throw std::runtime_error(location(line) + "a scene must be a JSON object");
+        if (depth == 1 && top_key == "Objects" && container.is_array()) {
+            in_objects = true;
+        } else if (depth >= capture_depth()) {
+            if (containers.empty()) {
+                if (in_objects && !container.is_object())
+                    throw std::runtime_error(location(line) + "the elements of \"Objects\" must be objects");
+                captured = std::move(container);
+                captured_line = line;
+                containers.push_back(&captured);
+            } else {
+                containers.push_back(insert(std::move(container)));
+            }
+        }
+        ++depth;
+        return true;
+    }
+
+    bool close() {
+        --depth;
+        if (!containers.empty()) {
+            containers.pop_back();
+            if (containers.empty()) {
+                if (in_objects) finish_object();
+                else finish_member();
+            }
+        } else if (in_objects && depth == 1) {
+            in_objects = false;
+        }
+        return true;
+    }
+
+    json* insert(json&& v) {
+        json& parent = *containers.back();
+        if (parent.is_array()) {
+            parent.push_back(std::move(v));
+            return &parent.back();
+        }
+        json& slot = parent[current_key];
+        slot = std::move(v);
+        return &slot;
+    }
+
+    void finish_member() {
+        try {
+            if (top_key == "Objects") throw std::runtime_error("\"Objects\" must be an array");
+            else if (top_key == "Textures") library.define_textures(captured);
+            else if (top_key == "Materials") library.define_materials(captured);
+            else settings[top_key] = std::move(captured);
+        } catch (const std::exception& e) {
+            throw std::runtime_error(location(captured_line ? captured_line : line) + e.what());
+        }
+        captured = json();
+        captured_line = 0;
+    }
+
+    void finish_object() {
+        if (!captured.contains("material") || library.ready_material(captured["material"]))
+            add_object(captured, captured_line);
+        else
+            pending.push_back({std::move(captured), captured_line});
+        captured = json();
+    }
+
+    static Vector3d vector_of(const json& obj, const char* key) {
+        const json& v = obj.at(key);
+        if (!v.is_array() || v.size() != 3)
+            throw std::runtime_error(std::string("\"") + key + "\" must be an array of 3 numbers");
+        return Vector3d(v[0].get<double>(), v[1].get<double>(), v[2].get<double>());
+    }
+
+    static std::string directory_of(const std::string& path) {
+        size_t slash = path.find_last_of("/\\");
+        return slash == std::string::npos ? "" : path.substr(0, slash);
+    }
+
+    void record(PrimitiveType type, const Material* material, const Vector3d& a, const Vector3d& b, const Vector3d& c) {
+        if (!records || !records->uncacheable.empty()) return;
+        scene_cache::PrimitiveRecord r = {type, library.record_index(material),
+                                          {a[0], a[1], a[2], b[0], b[1], b[2], c[0], c[1], c[2]}};
+        records->primitives.push_back(r);
+    }
+
+    // "motion": {"velocity": [x, y, z]} from time 0 to 1, or keyframes [{"time": 0, "offset": [x, y, z]}, ...]
+    static Motion motion_of(const json& m) {
+        if (m.is_object()) return Motion::linear(vector_of(m, "velocity"));
+        if (!m.is_array()) throw std::runtime_error("\"motion\" must be an object with a velocity or an array of keyframes");
+        std::vector<Motion::Keyframe> keys;
+        for (const auto& k : m)
+            keys.push_back({k.at("time").get<double>(), vector_of(k, "offset")});
+        return Motion(std::move(keys));
+    }
+
+    // With records, the primitive is also described there, in the order of the objects of the world
+    void add_object(const json& obj, size_t at) {
+        try {
+            std::string type = obj.at("type");
+            std::shared_ptr<Hittable> object;
+            if (type == "Sphere") {
+                Point3d center = vector_of(obj, "center");
+                double radius = obj.at("radius");
+                auto material = library.material(obj.at("material"));
+                object = std::make_shared<Sphere>(center, radius, material);
+                record(PrimitiveType::Sphere, material.get(), center, Vector3d(radius, 0, 0), Vector3d());
+            } else if (type == "Quadrilateral") {
+                Point3d vertex = vector_of(obj, "vertex");
+                Vector3d edge1 = vector_of(obj, "edge1");
+                Vector3d edge2 = vector_of(obj, "edge2");
+                auto material = library.material(obj.at("material"));
+                object = std::make_shared<Quadrilateral>(vertex, edge1, edge2, material);
+                record(PrimitiveType::Quadrilateral, material.get(), vertex, edge1, edge2);
+            } else if (type == "Triangle") {
+                Point3d vertex1 = vector_of(obj, "v1");
+                Point3d vertex2 = vector_of(obj, "v2");
+                Point3d vertex3 = vector_of(obj, "v3");
+                auto material = library.material(obj.at("material"));
+                object = std::make_shared<Triangle>(vertex1, vertex2, vertex3, material);
+                record(PrimitiveType::Triangle, material.get(), vertex1, vertex2, vertex3);
+            } else {
+                throw std::runtime_error("unknown object type \"" + type + "\"");
+            }
+            if (obj.contains("motion")) {
+                object = std::make_shared<Moving>(object, motion_of(obj["motion"]));
+                if (records) records->uncacheable = "moving objects";
+            }
+            world.add(object);
+        } catch (const json::exception& e) {
+            // Strip the "[json.exception.type_error.302] " prefix
+            std::string message = e.what();
+            throw std::runtime_error(location(at) + message.substr(message.find(']') + 2));
+        } catch (const std::exception& e) {
+            throw std::runtime_error(location(at) + e.what());
         }
-    } else if (mat_json["type"] == "Metal") {
-        double fuzz = mat_json.value("fuzz", 0.0); // Provide default value if not specifie
-            Color color(mat_json["color"][0], mat_json["color"][1], mat_json["color"][2]);
-            return std::make_shared<Metal>(color, fuzz);
-    } else if (mat_json["type"] == "Dielectric") {
-        double ref_idx = mat_json["ref_idx"];
-        return std::make_shared<Dielectric>(ref_idx);
-    }
-    throw std::runtime_error("Unknown material type");
+    }
+};
+
+// Build the primitives of a scene file, throws std::runtime_error with the file and line on invalid scenes.
+// With records, the scene is also described there for the cache. settings receives the other top-level
+// members of the scene, "Camera" and "Render" among them.
+HittableList load_scene(const std::string& filename, SceneRecords* records = nullptr, json* settings = nullptr) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open())
+        throw std::runtime_error("Failed to open scene file " + filename);
+    SceneParser parser(filename, records);
+    parser.parse(file);
+    if (records) records->settings = parser.settings.dump();
+    if (settings) *settings = std::move(parser.settings);
+    return parser.world;
 }
 
-HittableList load_scene(const std::string& filename) {
-    std::ifstream file(filename);
-    json scene;
-    file >> scene;
+// Reads the members of one settings block into the fields of Args, reporting unknown members
+class SettingsBlock {
+public:
+    SettingsBlock(const json& settings, const char* name, const std::string& filename)
+        : block(settings.contains(name) ? settings[name] : json::object()), name(name), filename(filename) {
+        if (!block.is_object())
+            throw std::runtime_error(filename + ": \"" + name + "\" must be an object");
+    }
 
-    HittableList world;
+    template <class T>
+    void read(const char* key, T& field) {
+        known.push_back(key);
+        if (!block.contains(key)) return;
+        try {
+            field = block[key].get<T>();
+        } catch (const json::exception& e) {
+            fail(key, e.what());
+        }
+    }
+
+    void read(const char* key, Vector3d& field) {
+        known.push_back(key);
+        if (!block.contains(key)) return;
+        const json& v = block[key];
+        if (!v.is_array() || v.size() != 3 || !v[0].is_number() || !v[1].is_number() || !v[2].is_number())
+            fail(key, "an array of 3 numbers is expected");
+        field = Vector3d(v[0].get<double>(), v[1].get<double>(), v[2].get<double>());
+    }
+
+    // One of choices, or unchanged
+    void read(const char* key, std::string& field, std::initializer_list<const char*> choices) {
+        std::string value = field;
+        read(key, value);
+        for (const char* c : choices) {
+            if (value == c) {
+                field = value;
+                return;
+            }
+        }
+        std::string expected;
+        for (const char* c : choices) expected += std::string(expected.empty() ? "" : ", ") + c;
+        fail(key, "\"" + value + "\" is not one of " + expected);
+    }
 
-    for (const auto& obj : scene["Objects"]) {
-        if (obj["type"] == "Sphere") {
-            Point3d center(obj["center"][0], obj["center"][1], obj["center"][2]);
-            double radius = obj["radius"];
-            auto material = parse_material(obj["material"]);
-            world.add(std::make_shared<Sphere>(center, radius, material));
-        } else if (obj["type"] == "Quadrilateral") {
-            Point3d vertex(obj["vertex"][0], obj["vertex"][1], obj["vertex"][2]);
-            Vector3d edge1(obj["edge1"][0], obj["edge1"][1], obj["edge1"][2]);
-            Vector3d edge2(obj["edge2"][0], obj["edge2"][1], obj["edge2"][2]);
-            auto material = parse_material(obj["material"]);
-            world.add(std::make_shared<Quadrilateral>(vertex, edge1, edge2, material));
-        } else if (obj["type"] == "Triangle") {
-            Point3d vertex1(obj["v1"][0], obj["v1"][1], obj["v1"][2]);
-            Point3d vertex2(obj["v2"][0], obj["v2"][1], obj["v2"][2]);
-            Point3d vertex3(obj["v3"][0], obj["v3"][1], obj["v3"][2]);
-            auto material = parse_material(obj["material"]);
-            world.add(std::make_shared<Triangle>(vertex1, vertex2, vertex3, material));
+    void warn_unknown() const {
+        for (auto it = block.begin(); it != block.end(); ++it) {
+            if (std::find(known.begin(), known.end(), it.key()) == known.end())
+                std::cerr << filename << ": unknown setting \"" << name << "\".\"" << it.key() << "\", ignored." << std::endl;
         }
     }
-    return world;
-}
\ No newline at end of file
+
+private:
+    json block;
+    const char* name;
+    std::string filename;
+    std::vector<std::string> known;
+
+    void fail(const char* key, const std::string& message) const {
+        std::string m = message;
+        if (m.compare(0, 16, "[json.exception.") == 0) m = m.substr(m.find(']') + 2);
+        throw std::runtime_error(filename + ": \"" + name + "\".\"" + key + "\": " + m);
+    }
+};
+
+// Settings of the "Camera" and "Render" blocks of a scene, applied to args before the command line,
+// so that a scene file can describe a whole render and every option given on the command line overrides it
+void apply_scene_settings(const json& settings, Args& args, const std::string& filename) {
+    SettingsBlock camera(settings, "Camera", filename);
+    camera.read("look_from", args.look_from);
+    camera.read("look_at", args.look_at);
+    camera.read("vec_up", args.vec_up);
+    camera.read("vertical_fov", args.vertical_fov);
+    camera.read("defocus_angle", args.defocus_angle);
+    camera.read("focus_dist", args.focus_dist);
+    camera.read("shutter_open", args.shutter_open);
+    camera.read("shutter_close", args.shutter_close);
+    camera.warn_unknown();
+
+    SettingsBlock render(settings, "Render", filename);
+    render.read("output", args.output_file);
+    render.read("image_width", args.image_width);
+    render.read("aspect_ratio", args.aspect_ratio);
+    render.read("samples_per_pixel", args.samples_per_pixel);
+    render.read("max_depth", args.max_depth);
+    render.read("anti_alias", args.anti_alias);
+    render.read("parallel", args.parallel);
+    render.read("num_threads", args.num_threads);
+    render.read("seed", args.seed);
+    std::string sampler = args.adaptive ? "adaptive" : "uniform";
+    render.read("sampler", sampler, {"uniform", "adaptive"});
+    args.adaptive = sampler == "adaptive";
+    render.read("min_samples", args.min_samples);
+    render.read("error_threshold", args.error_threshold);
+    render.read("progressive", args.progressive);
+    render.read("samples_per_pass", args.samples_per_pass);
+    render.read("time_limit", args.time_limit);
+    render.read("integrator", args.integrator, {"path", "wavefront"});
+    render.read("tile_size", args.tile_size);
+    render.read("packet_size", args.packet_size);
+    render.read("denoise", args.denoise);
+    render.read("denoise_iterations", args.denoise_iterations);
+    render.read("tone_map", args.tone_map, {"gamma", "srgb", "reinhard", "aces"});
+    render.read("exposure", args.exposure);
+    render.read("dither", args.dither);
+    render.read("png_level", args.png_level);
+    render.read("exr_compression", args.exr_compression, {"none", "rle", "zips", "zip"});
+    render.read("aov", args.aov);
+    render.read("ascii_ppm", args.ascii_ppm);
+    render.read("binary_stdout", args.binary_stdout);
+    render.read("texture_cache", args.texture_cache);
+    render.warn_unknown();
+}
@@ -0,0 +1,95 @@
+#ifndef RAY_TRACING_MOTION_H
+#define RAY_TRACING_MOTION_H
+
+#include <vector>
+#include <memory>
+#include <utility>
+#include <stdexcept>
+
+#include "common.h"
+#include "hittable.h"
+
+// Translation of an object over the time of the scene, through keyframes given by increasing times.
+// The offset goes linearly from one keyframe to the next, and stays at the first and last ones before and after.
+class Motion {
+public:
+    struct Keyframe {
+        double time;
+        Vector3d offset;
+    };
+
+    std::vector<Keyframe> keys;
+
+    Motion() = default;
+    explicit Motion(std::vector<Keyframe> keyframes) : keys(std::move(keyframes)) {
+        if (keys.empty()) throw std::runtime_error("a motion needs at least one keyframe");
+        for (size_t k = 1; k < keys.size(); ++k) {
+            if (keys[k].time <= keys[k - 1].time)
+                throw std::runtime_error("motion keyframes must be given by increasing times");
+        }
+    }
+
+    // Linear motion at velocity from time 0 to time 1
+    static Motion linear(const Vector3d& velocity) {
+        return Motion({{0, Vector3d(0, 0, 0)}, {1, velocity}});
+    }
+
+    Vector3d offset(double time) const {
+        if (time <= keys.front().time) return keys.front().offset;
+        if (time >= keys.back().time) return keys.back().offset;
+        size_t k = 1;
+        while (keys[k].time < time) k++;
+        const Keyframe& a = keys[k - 1];
+        const Keyframe& b = keys[k];
+        return a.offset + ((time - a.time) / (b.time - a.time)) * (b.offset - a.offset);
+    }
+};
+
+// An object moved by a motion: rays are moved the other way before hitting it, at their own time.
+// The object may itself be moving, or be a whole group of objects.
+class Moving : public Hittable {
+public:
+    Moving(std::shared_ptr<Hittable> object, Motion motion)
+            : object(std::move(object)), motion(std::move(motion)) {
+        std::vector<double> times;
+        motion_times(times);
+        bbox = AABB::empty;
+        for (double t : times)
+            bbox = AABB(bbox, bounding_box_at(t));
+    }
+
+    bool hit(const Ray& ray, Interval t_ray, HitStatus& stat) const override {
+        Vector3d offset = motion.offset(ray.time());
+        Ray moved(ray.origin() - offset, ray.direction(), ray.time());
+        if (!object->hit(moved, t_ray, stat)) return false;
+        stat.hit_point += offset;
+        return true;
+    }
+
+    AABB bounding_box() const override { return bbox; }
+
+    AABB bounding_box_at(double time) const override {
+        return object->bounding_box_at(time) + motion.offset(time);
+    }
+
+    void motion_times(std::vector<double>& times) const override {
+        object->motion_times(times);
+        for (const auto& k : motion.keys)
+            times.push_back(k.time);
+    }
+
+    void gather_stats(SceneStats& stats) const override {
+        object->gather_stats(stats);
+    }
+
+    void bind_materials(MaterialTable& table) override {
+        object->bind_materials(table);
+    }
+
+private:
+    std::shared_ptr<Hittable> object;
+    Motion motion;
+    AABB bbox;  // Bounds of the whole motion
+};
+
+#endif //RAY_TRACING_MOTION_H
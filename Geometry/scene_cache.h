@@ -0,0 +1,428 @@
+#ifndef RAY_TRACING_SCENE_CACHE_H
+#define RAY_TRACING_SCENE_CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <type_traits>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "common.h"
+#include "file_stamp.h"
+#include "hittable.h"
+#include "geometry.h"
+#include "material.h"
+#include "texture.h"
+#include "json.hpp"
+
+// Binary cache of a scene file, written with --export-cache next to the JSON scene as SCENE_FILE.cache.
+// It holds the textures, materials and primitives of the scene as flat records, and a BVH built beforehand
+// and flattened in depth-first order: the first child of a node follows it, the node stores the index of
+// the second one. Leaves store a range of primitives, which are written in the order of the leaves.
+// The settings of the scene ("Camera", "Render") follow as JSON text.
+//
+// Loading maps the file in memory (read into one buffer on Windows) and traverses the BVH nodes right
+// where they are. The primitives are constructed from their records into one array per type, the few
+// materials and textures are created again: nothing is allocated per object.
+// The cache records the size and modification time of the scene file it was made from, and is ignored
+// as soon as they change.
+namespace scene_cache {
+
+const char magic[8] = {'R', 'T', 'S', 'C', 'A', 'C', 'H', 'E'};
+const uint32_t version = 2;
+
+enum class TextureKind : uint32_t { Solid, Checker };
+
+struct TextureRecord {
+    TextureKind kind;
+    uint32_t even, odd;   // Indices of the squares of a checker, textures come after those they use
+    uint32_t padding;
+    double scale;
+    double color[3];
+};
+
+struct MaterialRecord {
+    MaterialType type;
+    uint32_t texture;     // Lambertian
+    double color[3];      // Metal
+    double parameter;     // Fuzz of a metal, index of refraction of a dielectric
+};
+
+struct PrimitiveRecord {
+    PrimitiveType type;
+    uint32_t material;
+    double p[9];          // Sphere: center, radius. Quadrilateral: vertex, edge1, edge2. Triangle: v1, v2, v3
+};
+
+struct NodeRecord {
+    AABB bbox;
+    uint32_t index;       // Second child of an inner node, first primitive of a leaf
+    uint32_t count;       // Primitives of a leaf, 0 for an inner node
+};
+
+typedef FileStamp SourceStamp;
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;  // 0x01020304 as written by the machine that made the file
+    uint32_t record_sizes[4];
+    SourceStamp source;
+    uint64_t counts[4];   // Textures, materials, primitives, nodes
+    uint64_t offsets[4];  // From the start of the file
+    uint64_t settings_offset, settings_size;  // Top-level settings of the scene ("Camera", "Render") as JSON text
+};
+
+static_assert(std::is_trivially_copyable<AABB>::value, "BVH nodes are read from the file in place");
+
+inline bool stamp(const std::string& path, SourceStamp& s) { return file_stamp(path, s); }
+
+inline void fill_header(Header& h) {
+    memcpy(h.magic, magic, sizeof(magic));
+    h.version = version;
+    h.byte_order = 0x01020304;
+    h.record_sizes[0] = sizeof(TextureRecord);
+    h.record_sizes[1] = sizeof(MaterialRecord);
+    h.record_sizes[2] = sizeof(PrimitiveRecord);
+    h.record_sizes[3] = sizeof(NodeRecord);
+}
+
+} // namespace scene_cache
+
+// Flat description of a loaded scene, filled by load_scene in the order of the objects of the world
+class SceneRecords {
+public:
+    std::vector<scene_cache::TextureRecord> textures;
+    std::vector<scene_cache::MaterialRecord> materials;
+    std::vector<scene_cache::PrimitiveRecord> primitives;
+    std::string settings;  // JSON text
+    std::string uncacheable;  // What the cache cannot describe in the scene, if anything
+
+    // Write the cache of source_path, world holds the primitives described by the records, in the same order
+    bool write(const std::string& cache_path, const std::string& source_path, const HittableList& world) const {
+        using namespace scene_cache;
+        TRACE_SCOPE("cache_write", "scene");
+        if (!uncacheable.empty()) {
+            std::cerr << "Scene cache: scenes with " << uncacheable << " are not cached, not written." << std::endl;
+            return false;
+        }
+        if (world.objects.size() != primitives.size()) {
+            std::cerr << "Scene cache: " << world.objects.size() << " objects for " << primitives.size()
+                      << " primitive records, not written." << std::endl;
+            return false;
+        }
+
+        std::vector<AABB> boxes(primitives.size());
+        std::vector<uint32_t> order(primitives.size());
+        for (size_t i = 0; i < primitives.size(); ++i) {
+            boxes[i] = world.objects[i]->bounding_box();
+            order[i] = uint32_t(i);
+        }
+        std::vector<NodeRecord> nodes;
+        if (!order.empty()) build(nodes, order, boxes, 0, order.size());
+        std::vector<PrimitiveRecord> sorted(primitives.size());
+        for (size_t i = 0; i < order.size(); ++i) sorted[i] = primitives[order[i]];
+
+        Header h;
+        memset(&h, 0, sizeof(h));
+        fill_header(h);
+        if (!stamp(source_path, h.source)) {
+            std::cerr << "Scene cache: cannot stat " << source_path << ", not written." << std::endl;
+            return false;
+        }
+        h.counts[0] = textures.size();
+        h.counts[1] = materials.size();
+        h.counts[2] = sorted.size();
+        h.counts[3] = nodes.size();
+        h.offsets[0] = sizeof(Header);
+        h.offsets[1] = h.offsets[0] + textures.size() * sizeof(TextureRecord);
+        h.offsets[2] = h.offsets[1] + materials.size() * sizeof(MaterialRecord);
+        h.offsets[3] = h.offsets[2] + sorted.size() * sizeof(PrimitiveRecord);
+        h.settings_offset = h.offsets[3] + nodes.size() * sizeof(NodeRecord);
+        h.settings_size = settings.size();
+
+        FILE* fp = fopen(cache_path.c_str(), "wb");
+        if (!fp) {
+            std::cerr << "Failed to open file " << cache_path << " for writing." << std::endl;
+            return false;
+        }
+        fwrite(&h, sizeof(h), 1, fp);
+        fwrite(textures.data(), sizeof(TextureRecord), textures.size(), fp);
+        fwrite(materials.data(), sizeof(MaterialRecord), materials.size(), fp);
+        fwrite(sorted.data(), sizeof(PrimitiveRecord), sorted.size(), fp);
+        fwrite(nodes.data(), sizeof(NodeRecord), nodes.size(), fp);
+        fwrite(settings.data(), 1, settings.size(), fp);
+        bool ok = !ferror(fp);
+        fclose(fp);
+        std::clog << "Scene cache written to " << cache_path << " (" << sorted.size() << " primitives, "
+                  << nodes.size() << " BVH nodes)" << std::endl;
+        return ok;
+    }
+
+private:
+    // Same splits as BVH_Node: halves along the longest axis of the bounds, leaves of one or two primitives
+    static void build(std::vector<scene_cache::NodeRecord>& nodes, std::vector<uint32_t>& order,
+                      const std::vector<AABB>& boxes, size_t start, size_t end) {
+        AABB bbox = AABB::empty;
+        for (size_t i = start; i < end; ++i) bbox = AABB(bbox, boxes[order[i]]);
+        size_t self = nodes.size();
+        nodes.push_back({bbox, uint32_t(start), uint32_t(end - start)});
+        if (end - start <= 2) return;
+
+        int axis = bbox.longest_axis();
+        std::sort(order.begin() + start, order.begin() + end, [&](uint32_t a, uint32_t b) {
+            return boxes[a].axis(axis).get_min() < boxes[b].axis(axis).get_min();
+        });
+        size_t mid = start + (end - start) / 2;
+        nodes[self].count = 0;
+        build(nodes, order, boxes, start, mid);
+        nodes[self].index = uint32_t(nodes.size());
+        build(nodes, order, boxes, mid, end);
+    }
+};
+
+// A scene loaded from its cache, the whole scene as one Hittable
+class MappedScene : public Hittable {
+public:
+    // The cache of source_path, or nullptr if it is missing, out of date or unreadable
+    static std::shared_ptr<MappedScene> open(const std::string& cache_path, const std::string& source_path) {
+        using namespace scene_cache;
+        struct stat st;
+        if (stat(cache_path.c_str(), &st) != 0) return nullptr;
+        TRACE_SCOPE("cache_load", "scene");
+        std::shared_ptr<MappedScene> scene(new MappedScene);
+        if (!scene->map(cache_path, size_t(st.st_size))) return nullptr;
+
+        Header expected;
+        memset(&expected, 0, sizeof(expected));
+        fill_header(expected);
+        const Header& h = *scene->header();
+        if (scene->size < sizeof(Header) || memcmp(h.magic, expected.magic, sizeof(magic)) != 0
+            || h.version != expected.version || h.byte_order != expected.byte_order
+            || memcmp(h.record_sizes, expected.record_sizes, sizeof(h.record_sizes)) != 0) {
+            std::cerr << "Scene cache " << cache_path << " was written by another version, ignored." << std::endl;
+            return nullptr;
+        }
+        for (int s = 0; s < 4; ++s) {
+            if (h.offsets[s] % 8 || h.offsets[s] + h.counts[s] * h.record_sizes[s] > scene->size) {
+                std::cerr << "Scene cache " << cache_path << " is truncated, ignored." << std::endl;
+                return nullptr;
+            }
+        }
+        if (h.settings_offset + h.settings_size > scene->size) {
+            std::cerr << "Scene cache " << cache_path << " is truncated, ignored." << std::endl;
+            return nullptr;
+        }
+        SourceStamp source;
+        if (!stamp(source_path, source)) {
+            std::cerr << "Scene cache " << cache_path << " cannot be checked, cannot stat " << source_path
+                      << ", ignored." << std::endl;
+            return nullptr;
+        }
+        if (!(source == h.source)) {
+            std::clog << "Scene cache " << cache_path << " is out of date, " << source_path << " changed." << std::endl;
+            return nullptr;
+        }
+        if (!scene->build()) {
+            std::cerr << "Scene cache " << cache_path << " is corrupted, ignored." << std::endl;
+            return nullptr;
+        }
+        std::clog << "Scene loaded from " << cache_path << " (" << scene->primitives.size() << " primitives, "
+                  << scene->n_nodes << " BVH nodes)" << std::endl;
+        return scene;
+    }
+
+    ~MappedScene() override {
+#ifndef _WIN32
+        if (data) munmap(const_cast<unsigned char*>(data), size);
+#endif
+    }
+
+    MappedScene(const MappedScene&) = delete;
+    MappedScene& operator=(const MappedScene&) = delete;
+
+    // Settings of the scene file, an empty object if it has none
+    nlohmann::json settings() const {
+        const scene_cache::Header& h = *header();
+        if (!h.settings_size) return nlohmann::json::object();
+        const char* text = reinterpret_cast<const char*>(data + h.settings_offset);
+        return nlohmann::json::parse(text, text + h.settings_size);
+    }
+
+    AABB bounding_box() const override { return n_nodes ? nodes[0].bbox : AABB::empty; }
+
+    bool hit(const Ray& ray, Interval t_ray, HitStatus& stat) const override {
+        if (!n_nodes) return false;
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        bool is_hit = false;
+        while (top) {
+            const scene_cache::NodeRecord& node = nodes[stack[--top]];
+            STAT_INC(bvh_nodes_visited);
+            if (!node.bbox.hit(ray, t_ray)) continue;
+            if (node.count) {
+                for (uint32_t i = node.index; i < node.index + node.count; ++i) {
+                    if (primitives[i]->hit(ray, t_ray, stat)) {
+                        is_hit = true;
+                        t_ray.set_max(stat.t);
+                    }
+                }
+            } else {
+                // First child on top, visited first like in BVH_Node
+                stack[top++] = node.index;
+                stack[top++] = uint32_t(&node - nodes) + 1;
+            }
+        }
+        return is_hit;
+    }
+
+    void gather_stats(SceneStats& stats) const override {
+        if (n_nodes) gather_node(stats, 0);
+    }
+
+    // The materials go first, in the order of their records, so that their index in an empty table is the one
+    // of their record
+    void bind_materials(MaterialTable& table) override {
+        for (const auto& material : materials) table.add(material);
+        for (auto& sphere : spheres) sphere.bind_materials(table);
+        for (auto& quad : quads) quad.bind_materials(table);
+        for (auto& triangle : triangles) triangle.bind_materials(table);
+    }
+
+private:
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    std::vector<uint64_t> buffer;   // No mmap, the file is read in one 8-byte aligned block
+#endif
+    const scene_cache::NodeRecord* nodes = nullptr;
+    size_t n_nodes = 0;
+    std::vector<std::shared_ptr<Texture>> textures;
+    std::vector<std::shared_ptr<Material>> materials;
+    std::vector<Sphere> spheres;
+    std::vector<Quadrilateral> quads;
+    std::vector<Triangle> triangles;
+    std::vector<const Hittable*> primitives;   // In the order of the records, referenced by the leaves
+
+    MappedScene() = default;
+
+    const scene_cache::Header* header() const { return reinterpret_cast<const scene_cache::Header*>(data); }
+
+    template <class T>
+    const T* section(int s) const { return reinterpret_cast<const T*>(data + header()->offsets[s]); }
+
+    bool map(const std::string& path, size_t file_size) {
+        size = file_size;
+        if (size < sizeof(scene_cache::Header)) return false;
+#ifdef _WIN32
+        buffer.resize((size + 7) / 8);
+        std::ifstream file(path, std::ios::binary);
+        if (!file.read(reinterpret_cast<char*>(buffer.data()), std::streamsize(size))) return false;
+        data = reinterpret_cast<const unsigned char*>(buffer.data());
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) return false;
+        data = static_cast<const unsigned char*>(p);
+#endif
+        return true;
+    }
+
+    static Color color_of(const double* c) { return Color(c[0], c[1], c[2]); }
+
+    // Textures, materials and primitives from their records, false on an invalid index or type
+    bool build() {
+        using namespace scene_cache;
+        const Header& h = *header();
+        const TextureRecord* tex = section<TextureRecord>(0);
+        for (uint64_t i = 0; i < h.counts[0]; ++i) {
+            if (tex[i].kind == TextureKind::Solid) {
+                textures.push_back(std::make_shared<SolidColor>(color_of(tex[i].color)));
+            } else if (tex[i].kind == TextureKind::Checker && tex[i].even < i && tex[i].odd < i) {
+                textures.push_back(std::make_shared<CheckerTexture>(tex[i].scale, textures[tex[i].even], textures[tex[i].odd]));
+            } else {
+                return false;
+            }
+        }
+        const MaterialRecord* mat = section<MaterialRecord>(1);
+        for (uint64_t i = 0; i < h.counts[1]; ++i) {
+            if (mat[i].type == MaterialType::Lambertian && mat[i].texture < textures.size())
+                materials.push_back(std::make_shared<Lambertian>(textures[mat[i].texture]));
+            else if (mat[i].type == MaterialType::Metal)
+                materials.push_back(std::make_shared<Metal>(color_of(mat[i].color), mat[i].parameter));
+            else if (mat[i].type == MaterialType::Dielectric)
+                materials.push_back(std::make_shared<Dielectric>(mat[i].parameter));
+            else
+                return false;
+        }
+
+        const PrimitiveRecord* prim = section<PrimitiveRecord>(2);
+        size_t n_prims = size_t(h.counts[2]);
+        size_t by_type[int(PrimitiveType::Count)] = {};
+        for (size_t i = 0; i < n_prims; ++i) {
+            if (unsigned(prim[i].type) >= unsigned(PrimitiveType::Count) || prim[i].material >= materials.size())
+                return false;
+            by_type[int(prim[i].type)]++;
+        }
+        // Reserved beforehand, primitives keeps pointers into these arrays
+        spheres.reserve(by_type[int(PrimitiveType::Sphere)]);
+        quads.reserve(by_type[int(PrimitiveType::Quadrilateral)]);
+        triangles.reserve(by_type[int(PrimitiveType::Triangle)]);
+        primitives.reserve(n_prims);
+        for (size_t i = 0; i < n_prims; ++i) {
+            const double* p = prim[i].p;
+            const std::shared_ptr<Material>& material = materials[prim[i].material];
+            if (prim[i].type == PrimitiveType::Sphere) {
+                spheres.emplace_back(Point3d(p[0], p[1], p[2]), p[3], material);
+                primitives.push_back(&spheres.back());
+            } else if (prim[i].type == PrimitiveType::Quadrilateral) {
+                quads.emplace_back(Point3d(p[0], p[1], p[2]), Vector3d(p[3], p[4], p[5]), Vector3d(p[6], p[7], p[8]), material);
+                primitives.push_back(&quads.back());
+            } else {
+                triangles.emplace_back(Point3d(p[0], p[1], p[2]), Point3d(p[3], p[4], p[5]), Point3d(p[6], p[7], p[8]), material);
+                primitives.push_back(&triangles.back());
+            }
+        }
+
+        nodes = section<NodeRecord>(3);
+        n_nodes = size_t(h.counts[3]);
+        return valid_node(0, 1);
+    }
+
+    // Child indices and primitive ranges in bounds, and depth within the traversal stack
+    bool valid_node(size_t i, int depth) const {
+        if (i >= n_nodes) return n_nodes == 0;
+        if (depth > 60) return false;
+        const scene_cache::NodeRecord& node = nodes[i];
+        if (node.count) return size_t(node.index) + node.count <= primitives.size();
+        return node.index > i + 1 && valid_node(i + 1, depth + 1) && valid_node(node.index, depth + 1);
+    }
+
+    void gather_node(SceneStats& stats, size_t i) const {
+        const scene_cache::NodeRecord& node = nodes[i];
+        stats.enter_bvh_node(node.bbox.surface_area(), sizeof(node));
+        if (node.count) {
+            for (uint32_t k = node.index; k < node.index + node.count; ++k)
+                primitives[k]->gather_stats(stats);
+        } else {
+            gather_node(stats, i + 1);
+            gather_node(stats, node.index);
+        }
+        stats.leave_bvh_node();
+    }
+};
+
+#endif //RAY_TRACING_SCENE_CACHE_H
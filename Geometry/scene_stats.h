@@ -0,0 +1,193 @@
+#ifndef RAY_TRACING_SCENE_STATS_H
+#define RAY_TRACING_SCENE_STATS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+
+#include "render_stats.h"
+#include "json.hpp"
+
+// Description of a scene once built: primitives by type, distinct materials and textures, shape and
+// quality of the BVH, and an estimate of the memory it takes.
+// Filled by Hittable::gather_stats, which every object implements by reporting itself and visiting what
+// it references. Materials and textures shared by several objects are counted once.
+//
+// The SAH cost is the expected number of box and primitive tests of a ray that hits the root box,
+// assuming rays uniformly distributed: a node's children are tested with the probability that the ray
+// hits the node's box, the ratio of its surface area to the root's. Without a BVH, it is the number of
+// primitives.
+//
+// Memory is estimated from the size of every object, plus the control block of its shared_ptr
+// (allocated with make_shared) and the arrays of the lists; allocator overheads are not counted.
+class SceneStats {
+public:
+    // Name of a material type, MaterialType is defined with the materials
+    typedef const char* (*MaterialName)(int type);
+
+    uint64_t primitives[int(PrimitiveType::Count)] = {};
+    uint64_t lists = 0;                  // HittableLists, the world included
+    uint64_t bvh_nodes = 0;
+    uint64_t bvh_leaves = 0;             // Nodes with primitives among their children
+    int bvh_depth = 0;                   // Nodes on the longest path from the root, 0 without a BVH
+    std::vector<uint64_t> leaf_sizes;    // Index n counts the leaves with n primitives
+    double sah_cost = 0;
+    uint64_t material_references = 0;    // Primitives referencing a material
+    uint64_t materials_by_type[stats_material_slots] = {};
+    uint64_t texture_count = 0;
+
+    uint64_t primitive_bytes = 0;
+    uint64_t list_bytes = 0;
+    uint64_t bvh_bytes = 0;
+    uint64_t material_bytes = 0;
+    uint64_t texture_bytes = 0;
+
+    static const size_t shared_block = 16;  // Reference counts of a make_shared control block, and its vtable
+
+    void add_primitive(PrimitiveType type, size_t bytes) {
+        primitives[int(type)]++;
+        primitive_bytes += bytes + shared_block;
+        sah_cost += hit_probability();
+        if (!nodes.empty()) nodes.back().primitives++;
+    }
+
+    // True the first time a material is seen, the caller then reports its data and textures
+    bool add_material(const void* material) {
+        if (!material) return false;
+        material_references++;
+        return seen_materials.insert(material).second;
+    }
+
+    void add_material_data(int type, size_t bytes) {
+        materials_by_type[std::min(type, stats_material_slots - 1)]++;
+        material_bytes += bytes + shared_block;
+    }
+
+    // True the first time a texture is seen, the caller then reports its data
+    bool add_texture(const void* texture) {
+        if (!texture) return false;
+        return seen_textures.insert(texture).second;
+    }
+
+    void add_texture_data(size_t bytes) {
+        texture_count++;
+        texture_bytes += bytes + shared_block;
+    }
+
+    void add_list(size_t bytes) {
+        lists++;
+        list_bytes += bytes + shared_block;
+    }
+
+    // Called around the visit of the children of a BVH node, area is the surface area of its box
+    void enter_bvh_node(double area, size_t bytes) {
+        if (nodes.empty()) root_area = area;
+        sah_cost += hit_probability();  // Test of the node's box
+        bvh_nodes++;
+        bvh_bytes += bytes + shared_block;
+        nodes.push_back({area, 0});
+        bvh_depth = std::max(bvh_depth, int(nodes.size()));
+    }
+
+    void leave_bvh_node() {
+        uint64_t n = nodes.back().primitives;
+        nodes.pop_back();
+        if (n == 0) return;
+        bvh_leaves++;
+        if (leaf_sizes.size() <= n) leaf_sizes.resize(n + 1, 0);
+        leaf_sizes[n]++;
+    }
+
+    uint64_t total_primitives() const {
+        uint64_t n = 0;
+        for (uint64_t p : primitives) n += p;
+        return n;
+    }
+
+    uint64_t unique_materials() const { return seen_materials.size(); }
+
+    uint64_t total_bytes() const {
+        return primitive_bytes + list_bytes + bvh_bytes + material_bytes + texture_bytes;
+    }
+
+    nlohmann::json to_json(MaterialName material_name) const {
+        nlohmann::json j;
+        for (int type = 0; type < int(PrimitiveType::Count); ++type)
+            j["primitives"][RenderStats::primitive_name(type)] = primitives[type];
+        j["primitives"]["total"] = total_primitives();
+        j["lists"] = lists;
+        j["materials"] = {{"unique", unique_materials()}, {"references", material_references}};
+        for (int type = 0; type < stats_material_slots; ++type) {
+            if (materials_by_type[type]) j["materials"]["by_type"][material_name(type)] = materials_by_type[type];
+        }
+        j["textures"] = {{"unique", texture_count}};
+        j["bvh"] = {{"nodes", bvh_nodes}, {"leaves", bvh_leaves}, {"depth", bvh_depth},
+                    {"leaf_sizes", leaf_sizes}, {"sah_cost", sah_cost}};
+        j["bytes"] = {{"primitives", primitive_bytes}, {"lists", list_bytes}, {"bvh", bvh_bytes},
+                      {"materials", material_bytes}, {"textures", texture_bytes}, {"total", total_bytes()}};
+        return j;
+    }
+
+    void print(std::ostream& os, MaterialName material_name) const {
+        std::ios::fmtflags flags = os.flags();
+        std::streamsize precision = os.precision();
+        os << "************ SCENE STATISTICS ************\n";
+        os << "PRIMITIVES : " << total_primitives() << " (";
+        for (int type = 0; type < int(PrimitiveType::Count); ++type)
+            os << (type ? ", " : "") << primitives[type] << " " << RenderStats::primitive_name(type);
+        os << "), LISTS : " << lists << "\n";
+        os << "MATERIALS : " << unique_materials() << " unique for " << material_references << " references (";
+        bool first = true;
+        for (int type = 0; type < stats_material_slots; ++type) {
+            if (!materials_by_type[type]) continue;
+            os << (first ? "" : ", ") << materials_by_type[type] << " " << material_name(type);
+            first = false;
+        }
+        os << "), TEXTURES : " << texture_count << " unique\n";
+        if (bvh_nodes) {
+            os << "BVH : " << bvh_nodes << " nodes, " << bvh_leaves << " leaves, depth " << bvh_depth
+               << ", SAH cost " << std::fixed << std::setprecision(2) << sah_cost << ", leaf sizes";
+            for (size_t n = 1; n < leaf_sizes.size(); ++n)
+                if (leaf_sizes[n]) os << " " << n << ":" << leaf_sizes[n];
+            os << "\n";
+        } else {
+            os << "BVH : none, every ray tests the " << total_primitives() << " primitives\n";
+        }
+        os << "MEMORY : " << format_bytes(total_bytes()) << " (primitives " << format_bytes(primitive_bytes)
+           << ", BVH " << format_bytes(bvh_bytes) << ", lists " << format_bytes(list_bytes)
+           << ", materials " << format_bytes(material_bytes) << ", textures " << format_bytes(texture_bytes) << ")\n";
+        os << "******************************************\n";
+        os.flags(flags);
+        os.precision(precision);
+    }
+
+private:
+    struct Node {
+        double area;
+        uint64_t primitives;  // Primitives directly below the node, through lists included
+    };
+    std::vector<Node> nodes;  // Path from the root to the node being visited
+    double root_area = 0;
+    std::unordered_set<const void*> seen_materials;
+    std::unordered_set<const void*> seen_textures;
+
+    // Probability that the children of the innermost node are tested
+    double hit_probability() const {
+        if (nodes.empty() || root_area <= 0) return 1;
+        return nodes.back().area / root_area;
+    }
+
+    static std::string format_bytes(uint64_t bytes) {
+        char buffer[32];
+        if (bytes >= (uint64_t(1) << 20)) snprintf(buffer, sizeof(buffer), "%.2f MiB", bytes / 1048576.);
+        else if (bytes >= 1024) snprintf(buffer, sizeof(buffer), "%.1f KiB", bytes / 1024.);
+        else snprintf(buffer, sizeof(buffer), "%llu B", (unsigned long long)bytes);
+        return buffer;
+    }
+};
+
+#endif //RAY_TRACING_SCENE_STATS_H
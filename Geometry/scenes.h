@@ -0,0 +1,146 @@
+#ifndef RAY_TRACING_SCENES_H
+#define RAY_TRACING_SCENES_H
+
+// Built-in scenes, shared by the renderer and the benchmarks.
+// They draw their random parameters from the calling thread's generator: seed it first for a fixed scene.
+
+#include "common.h"
+#include "material.h"
+#include "geometry.h"
+#include "texture.h"
+
+// The cover scene of "Ray Tracing in One Weekend" with a few quadrilaterals, the default of the renderer
+inline HittableList random_spheres_scene() {
+    HittableList world;
+
+//    auto ground_material = std::make_shared<Lambertian>(Color(0.2, 0.2, 0.2));
+    auto checker = make_shared<CheckerTexture>(0.32, Color(0.2, 0.3, 0.1), Color(0.9, 0.9, 0.9));
+    world.add(std::make_shared<Sphere>(Point3d(0,-1000,0), 1000, make_shared<Lambertian>(checker)));
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_double();
+            Point3d center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
+
+            if ((center - Point3d(4, 0.2, 0)).length() > 0.9) {
+                std::shared_ptr<Material> sphere_material;
+
+                if (choose_mat < 0.8) {
+                    // diffuse
+                    auto albedo = Color::random() * Color::random();
+                    sphere_material = std::make_shared<Lambertian>(albedo);
+                    world.add(std::make_shared<Sphere>(center, 0.2, sphere_material));
+                } else if (choose_mat < 0.95) {
+                    // metal
+                    auto albedo = Color::random(0.5, 1);
+                    auto fuzz = random_double(0, 0.5);
+                    sphere_material = std::make_shared<Metal>(albedo, fuzz);
+                    world.add(std::make_shared<Sphere>(center, 0.2, sphere_material));
+                } else {
+                    // glass
+                    sphere_material = std::make_shared<Dielectric>(1.5);
+                    world.add(std::make_shared<Sphere>(center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    auto left_red_diffuse = std::make_shared<Lambertian>(Color(1.0, 0.2, 0.2));
+    auto back_green_diffuse = std::make_shared<Lambertian>(Color(0.2, 1.0, 0.2));
+    auto right_blue_metal = std::make_shared<Metal>(Color(0.2, 0.2, 1.0), random_double(0, 0.5));
+    auto upper_teal_metal = std::make_shared<Metal>(Color(0.2, 0.8, 0.8), random_double(0, 0.5));
+    auto lower_teal_glass = std::make_shared<Dielectric>(-1);
+
+    world.add(std::make_shared<Quadrilateral>(
+            Point3d(-3, -2, 5), Vector3d(0, 0, -4), Vector3d(0, 4, 0),
+            left_red_diffuse));
+    world.add(std::make_shared<Quadrilateral>(
+            Point3d(-2, -2, 0), Vector3d(4, 0, 0), Vector3d(0, 4, 0),
+            back_green_diffuse));
+    world.add(std::make_shared<Quadrilateral>(
+            Point3d(3, -2, 1), Vector3d(0, 0, 4), Vector3d(0, 4, 0),
+            right_blue_metal));
+    world.add(std::make_shared<Quadrilateral>(
+            Point3d(-2, 3, 1), Vector3d(4, 0, 0), Vector3d(0, 0, 4),
+            upper_teal_metal));
+    world.add(std::make_shared<Quadrilateral>(
+            Point3d(-2, -3, 5), Vector3d(4, 0, 0), Vector3d(0, 0, -4),
+            lower_teal_glass));
+
+    auto material1 = std::make_shared<Dielectric>(1.5);
+    world.add(std::make_shared<Sphere>(Point3d(0, 1, 0), 1.0, material1));
+
+    auto material2 = std::make_shared<Lambertian>(Color(0.4, 0.2, 0.1));
+    world.add(std::make_shared<Sphere>(Point3d(-4, 1, 0), 1.0, material2));
+
+    auto material3 = std::make_shared<Metal>(Color(0.7, 0.6, 0.5), 0.0);
+    world.add(std::make_shared<Sphere>(Point3d(4, 1, 0), 1.0, material3));
+
+    // Use BVH to reduce complexity
+    world = HittableList(make_shared<BVH_Node>(world));
+
+    return world;
+}
+
+// Add a sphere tessellated in stacks x slices quads, each split in two triangles
+inline void add_sphere_mesh(HittableList& list, const Point3d& center, double radius, int stacks, int slices,
+                            const std::shared_ptr<Material>& material) {
+    auto vertex = [&](int i, int j) {
+        double theta = pi * i / stacks;
+        double phi = 2 * pi * j / slices;
+        return center + radius * Vector3d(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+    };
+    for (int i = 0; i < stacks; ++i) {
+        for (int j = 0; j < slices; ++j) {
+            Point3d p00 = vertex(i, j), p01 = vertex(i, j + 1), p10 = vertex(i + 1, j), p11 = vertex(i + 1, j + 1);
+            // The triangles touching the poles would be degenerate
+            if (i > 0) list.add(std::make_shared<Triangle>(p00, p01, p11, material));
+            if (i < stacks - 1) list.add(std::make_shared<Triangle>(p00, p11, p10, material));
+        }
+    }
+}
+
+// About 47,000 triangles: five tessellated spheres of mixed materials on a checkered ground
+inline HittableList mesh_heavy_scene() {
+    HittableList world;
+    auto checker = make_shared<CheckerTexture>(0.32, Color(0.2, 0.3, 0.1), Color(0.9, 0.9, 0.9));
+    world.add(std::make_shared<Sphere>(Point3d(0,-1000,0), 1000, make_shared<Lambertian>(checker)));
+
+    const int stacks = 48, slices = 96;
+    add_sphere_mesh(world, Point3d(0, 1, 0), 1.0, stacks, slices, std::make_shared<Lambertian>(Color(0.8, 0.3, 0.2)));
+    add_sphere_mesh(world, Point3d(-4, 1, 0), 1.0, stacks, slices, std::make_shared<Metal>(Color(0.7, 0.6, 0.5), 0.1));
+    add_sphere_mesh(world, Point3d(4, 1, 0), 1.0, stacks, slices, std::make_shared<Lambertian>(Color(0.2, 0.4, 0.8)));
+    add_sphere_mesh(world, Point3d(-2, 0.5, 2.5), 0.5, stacks, slices, std::make_shared<Metal>(Color(0.9, 0.9, 0.9), 0.0));
+    add_sphere_mesh(world, Point3d(2, 0.5, 2.5), 0.5, stacks, slices, std::make_shared<Dielectric>(1.5));
+
+    world = HittableList(make_shared<BVH_Node>(world));
+    return world;
+}
+
+// Mostly glass: a grid of solid and hollow dielectric spheres, where paths go through many refractions
+inline HittableList glass_heavy_scene() {
+    HittableList world;
+    auto checker = make_shared<CheckerTexture>(0.32, Color(0.2, 0.3, 0.1), Color(0.9, 0.9, 0.9));
+    world.add(std::make_shared<Sphere>(Point3d(0,-1000,0), 1000, make_shared<Lambertian>(checker)));
+
+    auto glass = std::make_shared<Dielectric>(1.5);
+    auto air = std::make_shared<Dielectric>(1.0 / 1.5);
+    for (int a = -7; a < 7; a++) {
+        for (int b = -7; b < 7; b++) {
+            Point3d center(a + 0.9 * random_double(), 0.3, b + 0.9 * random_double());
+            world.add(std::make_shared<Sphere>(center, 0.3, glass));
+            // Every other sphere is a bubble: an inner surface with the inverse index
+            if (random_double() < 0.5)
+                world.add(std::make_shared<Sphere>(center, 0.25, air));
+        }
+    }
+    world.add(std::make_shared<Sphere>(Point3d(0, 1, 0), 1.0, glass));
+    world.add(std::make_shared<Sphere>(Point3d(0, 1, 0), 0.9, air));
+    world.add(std::make_shared<Sphere>(Point3d(-4, 1, 0), 1.0, glass));
+    world.add(std::make_shared<Sphere>(Point3d(4, 1, 0), 1.0, std::make_shared<Lambertian>(Color(0.4, 0.2, 0.1))));
+
+    world = HittableList(make_shared<BVH_Node>(world));
+    return world;
+}
+
+#endif //RAY_TRACING_SCENES_H
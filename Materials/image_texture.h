@@ -0,0 +1,455 @@
+#ifndef RAY_TRACING_IMAGE_TEXTURE_H
+#define RAY_TRACING_IMAGE_TEXTURE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <unordered_map>
+#include <algorithm>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "texture.h"
+#include "image_reader.h"
+#include "file_stamp.h"
+#include "render_stats.h"
+#include "trace.h"
+
+// Image textures are read once into a mip-map pyramid cut into square tiles, written next to the image as
+// IMAGE_FILE.tiles and made again only when the image changes. Rendering reads the tiles it needs from that
+// file into the texture cache, shared by all the images and bounded by a memory budget: the least recently
+// used tiles are dropped to make room, so that scenes with many large textures hold only what they look at.
+namespace texture_tiles {
+
+const char magic[8] = {'R', 'T', 'T', 'I', 'L', 'E', 'S', '\0'};
+const uint32_t version = 1;
+const int tile_size = 64;   // Texels on a side
+const int max_levels = 32;
+
+struct Level {
+    uint32_t width, height;
+    uint32_t tiles_x, tiles_y;
+    uint64_t offset;        // Of the first tile, from the start of the file
+};
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;    // 0x01020304 as written by the machine that made the file
+    FileStamp source;
+    uint32_t linear;        // Texels of 3 floats, else of 3 sRGB encoded bytes
+    uint32_t levels;
+    Level level[max_levels];
+};
+
+// sRGB encoded byte to linear value, and back
+inline const float* srgb_to_linear_table() {
+    static const struct Table {
+        float value[256];
+        Table() {
+            for (int i = 0; i < 256; ++i) {
+                double c = i / 255.0;
+                value[i] = float(c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4));
+            }
+        }
+    } table;
+    return table.value;
+}
+
+inline unsigned char linear_to_srgb(double l) {
+    l = l < 0 ? 0 : l > 1 ? 1 : l;
+    double c = l <= 0.0031308 ? 12.92 * l : 1.055 * std::pow(l, 1 / 2.4) - 0.055;
+    return (unsigned char)(c * 255 + 0.5);
+}
+
+} // namespace texture_tiles
+
+// The tiles of the mip-map pyramid of one image file
+class TiledImage {
+public:
+    const uint32_t id;  // Identifies the tiles of this image in the texture cache
+
+    // Throws std::runtime_error if the image cannot be read
+    TiledImage(const std::string& path, uint32_t id) : id(id), path(path) {
+        if (!open_tiles()) make_tiles();
+    }
+
+    ~TiledImage() {
+#ifndef _WIN32
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    TiledImage(const TiledImage&) = delete;
+    TiledImage& operator=(const TiledImage&) = delete;
+
+    int levels() const { return int(header.levels); }
+    int width(int level) const { return int(header.level[level].width); }
+    int height(int level) const { return int(header.level[level].height); }
+    bool linear() const { return header.linear != 0; }
+    size_t texel_bytes() const { return linear() ? 3 * sizeof(float) : 3; }
+    size_t tile_bytes() const { return texture_tiles::tile_size * texture_tiles::tile_size * texel_bytes(); }
+    const std::string& file() const { return path; }
+
+    // Bytes of the tiles held in memory for good, when the tile file could not be written
+    size_t resident_bytes() const { return resident.size(); }
+
+    // Read a tile, texels by rows from the top
+    void read_tile(int level, int tx, int ty, unsigned char* out) const {
+        const texture_tiles::Level& l = header.level[level];
+        uint64_t offset = l.offset + (uint64_t(ty) * l.tiles_x + tx) * tile_bytes();
+        if (!resident.empty()) {
+            memcpy(out, &resident[offset - sizeof(texture_tiles::Header)], tile_bytes());
+            return;
+        }
+        bool ok;
+#ifndef _WIN32
+        ok = pread(fd, out, tile_bytes(), off_t(offset)) == ssize_t(tile_bytes());
+#else
+        {
+            std::lock_guard<std::mutex> lock(read_mutex);
+            tiles_file.seekg(std::streamoff(offset));
+            ok = bool(tiles_file.read(reinterpret_cast<char*>(out), std::streamsize(tile_bytes())));
+        }
+#endif
+        if (!ok) {
+            // The tile file changed under us: render black rather than stop
+            memset(out, 0, tile_bytes());
+            report_read_error();
+        }
+    }
+
+private:
+    std::string path;
+    texture_tiles::Header header;
+    std::vector<unsigned char> resident;
+#ifndef _WIN32
+    int fd = -1;
+#else
+    mutable std::ifstream tiles_file;
+    mutable std::mutex read_mutex;
+#endif
+    mutable std::atomic<bool> read_error{false};
+
+    std::string tiles_path() const { return path + ".tiles"; }
+
+    void report_read_error() const {
+        if (!read_error.exchange(true))
+            std::cerr << "Texture " << path << ": cannot read " << tiles_path() << ", black tiles used." << std::endl;
+    }
+
+    // The tile file, if it was made from the image as it is now
+    bool open_tiles() {
+        using namespace texture_tiles;
+        FileStamp source;
+        if (!file_stamp(path, source)) throw std::runtime_error(path + ": cannot open the image file");
+        FileStamp tiles;
+        if (!file_stamp(tiles_path(), tiles)) return false;
+        std::ifstream in(tiles_path(), std::ios::binary);
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+        if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version
+            || header.byte_order != 0x01020304 || !(header.source == source)
+            || header.levels < 1 || header.levels > uint32_t(max_levels)) return false;
+        const Level& last = header.level[header.levels - 1];
+        if (tiles.size < last.offset + uint64_t(last.tiles_x) * last.tiles_y * tile_bytes()) return false;
+#ifndef _WIN32
+        fd = ::open(tiles_path().c_str(), O_RDONLY);
+        return fd >= 0;
+#else
+        tiles_file.open(tiles_path(), std::ios::binary);
+        return tiles_file.is_open();
+#endif
+    }
+
+    // Decode the image and write its tiles, level by level: only two levels are in memory at a time
+    void make_tiles() {
+        using namespace texture_tiles;
+        TRACE_SCOPE("make_tiles", "texture");
+        DecodedImage image = read_image(path);
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.byte_order = 0x01020304;
+        file_stamp(path, header.source);
+        header.linear = image.linear;
+        uint64_t offset = sizeof(Header);
+        for (int w = image.width, h = image.height; ; w = std::max(1, w / 2), h = std::max(1, h / 2)) {
+            Level& l = header.level[header.levels++];
+            l.width = uint32_t(w);
+            l.height = uint32_t(h);
+            l.tiles_x = uint32_t((w + tile_size - 1) / tile_size);
+            l.tiles_y = uint32_t((h + tile_size - 1) / tile_size);
+            l.offset = offset;
+            offset += uint64_t(l.tiles_x) * l.tiles_y * tile_bytes();
+            if ((w == 1 && h == 1) || header.levels == uint32_t(max_levels)) break;
+        }
+
+        std::string temporary = tiles_path() + ".tmp";
+        FILE* fp = fopen(temporary.c_str(), "wb");
+        if (!fp) {
+            std::cerr << "Texture " << path << ": cannot write " << tiles_path()
+                      << ", its tiles are kept in memory outside of the texture cache." << std::endl;
+            resident.reserve(size_t(offset - sizeof(Header)));
+        }
+        bool ok = !fp || fwrite(&header, sizeof(header), 1, fp) == 1;
+        std::vector<unsigned char> bytes = std::move(image.bytes);
+        std::vector<float> floats = std::move(image.floats);
+        std::vector<unsigned char> tile(tile_bytes());
+        for (uint32_t level = 0; level < header.levels; ++level) {
+            const Level& l = header.level[level];
+            if (level > 0) downsample(bytes, floats, header.level[level - 1], l);
+            const unsigned char* texels = linear() ? reinterpret_cast<const unsigned char*>(floats.data()) : bytes.data();
+            for (uint32_t ty = 0; ty < l.tiles_y; ++ty) {
+                for (uint32_t tx = 0; tx < l.tiles_x; ++tx) {
+                    cut_tile(texels, l, tx, ty, tile.data());
+                    if (fp) ok = ok && fwrite(tile.data(), tile.size(), 1, fp) == 1;
+                    else resident.insert(resident.end(), tile.begin(), tile.end());
+                }
+            }
+        }
+        if (!fp) return;
+        ok = fclose(fp) == 0 && ok;
+        if (ok) ok = std::rename(temporary.c_str(), tiles_path().c_str()) == 0;
+        if (!ok || !open_tiles()) {
+            std::remove(temporary.c_str());
+            throw std::runtime_error(path + ": cannot write the tiles of the image to " + tiles_path());
+        }
+        std::clog << "Texture " << path << ": " << header.levels << " levels of "
+                  << tile_size << "x" << tile_size << " tiles written to " << tiles_path() << std::endl;
+    }
+
+    // Copy tile (tx, ty) of a level, texels out of the image repeat its last row and column
+    void cut_tile(const unsigned char* texels, const texture_tiles::Level& l, uint32_t tx, uint32_t ty,
+                  unsigned char* tile) const {
+        const int size = texture_tiles::tile_size;
+        size_t texel = texel_bytes();
+        for (int y = 0; y < size; ++y) {
+            uint32_t sy = std::min(ty * size + y, l.height - 1);
+            for (int x = 0; x < size; ++x) {
+                uint32_t sx = std::min(tx * size + x, l.width - 1);
+                memcpy(tile + (size_t(y) * size + x) * texel, texels + (size_t(sy) * l.width + sx) * texel, texel);
+            }
+        }
+    }
+
+    // Next level of the pyramid, each texel the average of the 2x2 texels above it in linear values
+    void downsample(std::vector<unsigned char>& bytes, std::vector<float>& floats,
+                    const texture_tiles::Level& from, const texture_tiles::Level& to) const {
+        const float* to_linear = texture_tiles::srgb_to_linear_table();
+        std::vector<unsigned char> next_bytes(linear() ? 0 : size_t(to.width) * to.height * 3);
+        std::vector<float> next_floats(linear() ? size_t(to.width) * to.height * 3 : 0);
+        for (uint32_t y = 0; y < to.height; ++y) {
+            uint32_t y0 = std::min(2 * y, from.height - 1), y1 = std::min(2 * y + 1, from.height - 1);
+            for (uint32_t x = 0; x < to.width; ++x) {
+                uint32_t x0 = std::min(2 * x, from.width - 1), x1 = std::min(2 * x + 1, from.width - 1);
+                size_t corners[4] = {size_t(y0) * from.width + x0, size_t(y0) * from.width + x1,
+                                     size_t(y1) * from.width + x0, size_t(y1) * from.width + x1};
+                size_t out = (size_t(y) * to.width + x) * 3;
+                for (int c = 0; c < 3; ++c) {
+                    double sum = 0;
+                    for (size_t k : corners)
+                        sum += linear() ? floats[3 * k + c] : to_linear[bytes[3 * k + c]];
+                    if (linear()) next_floats[out + c] = float(sum / 4);
+                    else next_bytes[out + c] = texture_tiles::linear_to_srgb(sum / 4);
+                }
+            }
+        }
+        bytes.swap(next_bytes);
+        floats.swap(next_floats);
+    }
+};
+
+// Tiles of the image textures in memory, the least recently used ones dropped beyond the memory budget.
+// The cache is split in shards of their own lock and share of the budget, so that render threads rarely
+// wait for each other; each thread also keeps the last tiles it used, without any lock.
+class TextureCache {
+public:
+    typedef std::shared_ptr<const std::vector<unsigned char>> Tile;
+
+    static TextureCache& shared() {
+        static TextureCache cache;
+        return cache;
+    }
+
+    void set_budget(size_t bytes) { budget = bytes; }
+    size_t get_budget() const { return budget; }
+
+    // The tiles of an image file, made once and shared by all the textures using it
+    std::shared_ptr<TiledImage> image(const std::string& path) {
+        std::lock_guard<std::mutex> lock(images_mutex);
+        auto it = images.find(path);
+        if (it != images.end()) {
+            if (auto image = it->second.lock()) return image;
+        }
+        auto image = std::make_shared<TiledImage>(path, next_id++);
+        images[path] = image;
+        return image;
+    }
+
+    // Texel (x, y) of a level, as a linear color
+    Color texel(const TiledImage& image, int level, int x, int y) {
+        const int size = texture_tiles::tile_size;
+        const unsigned char* tile = get(image, level, x / size, y / size);
+        size_t at = size_t(y % size) * size + x % size;
+        if (image.linear()) {
+            float rgb[3];
+            memcpy(rgb, tile + at * sizeof(rgb), sizeof(rgb));
+            return Color(rgb[0], rgb[1], rgb[2]);
+        }
+        const float* to_linear = texture_tiles::srgb_to_linear_table();
+        const unsigned char* rgb = tile + at * 3;
+        return Color(to_linear[rgb[0]], to_linear[rgb[1]], to_linear[rgb[2]]);
+    }
+
+    // Bytes of the tiles held by the cache
+    size_t size() {
+        size_t bytes = 0;
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            bytes += shard.bytes;
+        }
+        return bytes;
+    }
+
+private:
+    static const int n_shards = 16;
+    static const int n_local = 16;  // Tiles kept by each thread
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<std::pair<uint64_t, Tile>> lru;  // Most recently used first
+        std::unordered_map<uint64_t, std::list<std::pair<uint64_t, Tile>>::iterator> index;
+        size_t bytes = 0;
+    };
+
+    struct LocalTile {
+        uint64_t key = ~uint64_t(0);
+        Tile tile;
+    };
+
+    std::atomic<size_t> budget{size_t(256) << 20};
+    Shard shards[n_shards];
+    std::mutex images_mutex;
+    std::unordered_map<std::string, std::weak_ptr<TiledImage>> images;
+    uint32_t next_id = 0;
+
+    TextureCache() = default;
+
+    static uint64_t key_of(const TiledImage& image, int level, int tx, int ty) {
+        return uint64_t(image.id) << 42 | uint64_t(level) << 37 | uint64_t(ty) << 19 | uint64_t(tx);
+    }
+
+    // The tile stays alive in the thread's own tiles at least until this thread asks for n_local others
+    const unsigned char* get(const TiledImage& image, int level, int tx, int ty) {
+        thread_local LocalTile local[n_local];
+        uint64_t key = key_of(image, level, tx, ty);
+        LocalTile& slot = local[(key ^ key >> 19 ^ key >> 42) % n_local];
+        if (slot.key != key) {
+            slot.tile = shared_tile(image, level, tx, ty, key);
+            slot.key = key;
+        }
+        return slot.tile->data();
+    }
+
+    Tile shared_tile(const TiledImage& image, int level, int tx, int ty, uint64_t key) {
+        Shard& shard = shards[(key ^ key >> 19 ^ key >> 42) % n_shards];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.index.find(key);
+            if (it != shard.index.end()) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                return it->second->second;
+            }
+        }
+        // Read without holding the lock, another thread may read the same tile meanwhile
+        STAT_INC(texture_tile_reads);
+        auto data = std::make_shared<std::vector<unsigned char>>(image.tile_bytes());
+        image.read_tile(level, tx, ty, data->data());
+        Tile tile = data;
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) return it->second->second;
+        shard.lru.emplace_front(key, tile);
+        shard.index[key] = shard.lru.begin();
+        shard.bytes += tile->size();
+        size_t share = budget / n_shards;
+        while (shard.bytes > share && shard.lru.size() > 1) {
+            shard.bytes -= shard.lru.back().second->size();
+            shard.index.erase(shard.lru.back().first);
+            shard.lru.pop_back();
+        }
+        return tile;
+    }
+};
+
+// Texture of an image file, repeated over (u, v) in [0, 1] x [0, 1], v going up the image.
+// Lookups with a footprint pick the level of the pyramid whose texels are as wide as the footprint, and
+// interpolate bilinearly within it, or between the two nearest levels with trilinear filtering.
+class ImageTexture : public Texture {
+public:
+    enum class Filter { Bilinear, Trilinear };
+
+    ImageTexture(std::shared_ptr<TiledImage> image, Filter filter) : image(std::move(image)), filter(filter) {}
+
+    TextureType type() const override { return TextureType::Image; }
+
+    Color value(double u, double v, const Point3d& p) const override {
+        STAT_INC(texture_lookups);
+        return bilinear(0, u, v);
+    }
+
+    Color filtered_value(double u, double v, const Point3d& p, double width) const override {
+        STAT_INC(texture_lookups);
+        double texels = width * std::max(image->width(0), image->height(0));
+        double lod = texels > 1 ? std::log2(texels) : 0;
+        int last = image->levels() - 1;
+        if (filter == Filter::Bilinear || lod >= last)
+            return bilinear(std::min(int(lod + 0.5), last), u, v);
+        int level = int(lod);
+        double t = lod - level;
+        Color fine = bilinear(level, u, v);
+        return t > 0 ? (1 - t) * fine + t * bilinear(level + 1, u, v) : fine;
+    }
+
+    void gather_stats(SceneStats& stats) const override {
+        stats.add_texture_data(sizeof(*this) + image->resident_bytes());
+    }
+
+private:
+    std::shared_ptr<TiledImage> image;
+    Filter filter;
+
+    Color bilinear(int level, double u, double v) const {
+        if (!std::isfinite(u) || !std::isfinite(v)) return Color(0, 0, 0);
+        int w = image->width(level), h = image->height(level);
+        double x = (u - std::floor(u)) * w - 0.5;
+        double y = (std::ceil(v) - v) * h - 0.5;
+        double fx = std::floor(x), fy = std::floor(y);
+        double tx = x - fx, ty = y - fy;
+        int x0 = wrap(int(fx), w), x1 = wrap(int(fx) + 1, w);
+        int y0 = wrap(int(fy), h), y1 = wrap(int(fy) + 1, h);
+        TextureCache& cache = TextureCache::shared();
+        return (1 - ty) * ((1 - tx) * cache.texel(*image, level, x0, y0) + tx * cache.texel(*image, level, x1, y0))
+               + ty * ((1 - tx) * cache.texel(*image, level, x0, y1) + tx * cache.texel(*image, level, x1, y1));
+    }
+
+    static int wrap(int i, int n) {
+        i %= n;
+        return i < 0 ? i + n : i;
+    }
+};
+
+#endif //RAY_TRACING_IMAGE_TEXTURE_H
@@ -7,67 +7,184 @@
 
 #include <utility>
 #include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
 
 #include "common.h"
 #include "hittable.h"
-#include "texture.h"
+#include "texture_program.h"
+
+// Material classes known to the renderer, the wavefront integrator shades hits grouped by type
+enum class MaterialType { Lambertian, Metal, Dielectric, Other, Count };
+
+inline const char* material_type_name(MaterialType type) {
+    static const char* names[int(MaterialType::Count)] = {"Lambertian", "Metal", "Dielectric", "Other"};
+    return names[int(type)];
+}
+
+// Width in (u, v) units of the surface seen through the sample of a hit, for the level of detail of the textures.
+// It is the width of a pixel at the distance of the hit, measured from the last bounce for secondary rays:
+// finer than the true footprint after a diffuse bounce, so textures are never blurrier than they should be.
+inline double texture_footprint(const Ray& ray, const HitStatus& stat) {
+    if (stat.uv_length <= 0) return 0;
+    return stat.t * ray.direction().length() * texture_pixel_angle() / stat.uv_length;
+}
+
+// Closed description of a material of a known type: its type and, in a union, the parameters of that type.
+// Shading switches over the type and runs the scatter of the type inline (see MaterialTable), materials
+// of other classes have the type Other and are called through their virtual functions.
+struct MaterialData {
+    MaterialType type;
+    union {
+        struct {
+            const TextureProgram* program;  // Owned by the material
+            int root;
+        } lambertian;
+        struct {
+            double albedo[3];
+            double fuzz;
+        } metal;
+        struct {
+            double ir;  // Index of Refraction
+        } dielectric;
+    };
+};
 
 class Material {
 public:
+    Material() { closed.type = MaterialType::Other; }
     virtual ~Material() = default;
+    MaterialType type() const { return closed.type; }
+    const MaterialData& data() const { return closed; }
     virtual bool scatter(const Ray& ray_in, const HitStatus& stat, Color& attenuation, Ray& scattered) const = 0;
     virtual Color emitted(double u, double v, const Point3d& p) const {
         return Color(0, 0, 0);
     }
+    // Reflectance at a hit point, written to the albedo buffer that guides the denoiser
+    virtual Color albedo(const HitStatus& stat) const {
+        return Color(1, 1, 1);
+    }
+    // Report this material and its textures to the scene statistics
+    virtual void gather_stats(SceneStats& stats) const {
+        stats.add_material_data(int(type()), sizeof(*this));
+    }
+
+protected:
+    MaterialData closed;  // Filled by the constructors of the known types
 };
 
 class Lambertian : public Material {
 public:
-    explicit Lambertian(const Color& albedo) : tex(make_shared<SolidColor>(albedo)) {}
-    explicit Lambertian(shared_ptr<Texture> tex) : tex(std::move(tex)) {}
+    explicit Lambertian(const Color& albedo) : Lambertian(make_shared<SolidColor>(albedo)) {}
+    explicit Lambertian(shared_ptr<Texture> tex) : tex(std::move(tex)) {
+        closed.type = MaterialType::Lambertian;
+        closed.lambertian.program = &program;
+        closed.lambertian.root = program.add(*this->tex);
+    }
+    // The data points to the program of the material
+    Lambertian(const Lambertian& other) : Lambertian(other.tex) {}
+    Lambertian& operator=(const Lambertian&) = delete;
 
     bool scatter(const Ray& r_in, const HitStatus& stat, Color& attenuation, Ray& scattered)
     const override {
+        return scatter(closed, r_in, stat, attenuation, scattered);
+    }
+
+    static bool scatter(const MaterialData& m, const Ray& r_in, const HitStatus& stat, Color& attenuation,
+                        Ray& scattered) {
+        scattered = scatter_ray(r_in, stat);
+        attenuation = m.lambertian.program->filtered_value(m.lambertian.root, stat.u, stat.v, stat.hit_point,
+                                                           texture_footprint(r_in, stat));
+        return true;
+    }
+
+    // Scattered ray alone, for the callers that look up the texture themselves
+    static Ray scatter_ray(const Ray& r_in, const HitStatus& stat) {
         auto scatter_direction = stat.normal + random_unit_vector();
 
         // Catch degenerate scatter direction
         if (scatter_direction.near_zero())
             scatter_direction = stat.normal;
 
-        scattered = Ray(stat.hit_point, scatter_direction, r_in.time());
-        attenuation = tex->value(stat.u, stat.v, stat.hit_point);
-        return true;
+        return Ray(stat.hit_point, scatter_direction, r_in.time());
+    }
+
+    // Filtered values of the texture at n points at once
+    static void texture_values(const MaterialData& m, int n, const double* u, const double* v, const Point3d* p,
+                               const double* width, Color* out) {
+        m.lambertian.program->filtered_values(m.lambertian.root, n, u, v, p, width, out);
+    }
+
+    Color albedo(const HitStatus& stat) const override {
+        return albedo(closed, stat);
+    }
+
+    static Color albedo(const MaterialData& m, const HitStatus& stat) {
+        return m.lambertian.program->value(m.lambertian.root, stat.u, stat.v, stat.hit_point);
+    }
+
+    void gather_stats(SceneStats& stats) const override {
+        stats.add_material_data(int(type()), sizeof(*this) + program.bytes());
+        if (stats.add_texture(tex.get())) tex->gather_stats(stats);
     }
 
 private:
     shared_ptr<Texture> tex;
+    TextureProgram program;  // The texture compiled, what shading evaluates
 };
 
 
 class Metal : public Material {
 public:
-    Metal(const Color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+    Metal(const Color& albedo, double fuzz) {
+        closed.type = MaterialType::Metal;
+        for (int i = 0; i < 3; ++i) closed.metal.albedo[i] = albedo[i];
+        closed.metal.fuzz = fuzz < 1 ? fuzz : 1;
+    }
 
     bool scatter(const Ray& r_in, const HitStatus& stat, Color& attenuation, Ray& scattered)
     const override {
+        return scatter(closed, r_in, stat, attenuation, scattered);
+    }
+
+    static bool scatter(const MaterialData& m, const Ray& r_in, const HitStatus& stat, Color& attenuation,
+                        Ray& scattered) {
         Vector3d reflected = reflect(unit_vector(r_in.direction()), stat.normal);
-        scattered = Ray(stat.hit_point, reflected + fuzz*random_in_unit_sphere(), r_in.time());
-        attenuation = albedo;
+        scattered = Ray(stat.hit_point, reflected + m.metal.fuzz*random_in_unit_sphere(), r_in.time());
+        attenuation = albedo(m);
         return (dot(scattered.direction(), stat.normal) > 0);
     }
 
-private:
-    Color albedo;
-    double fuzz;
+    Color albedo(const HitStatus& stat) const override {
+        return albedo(closed);
+    }
+
+    static Color albedo(const MaterialData& m) {
+        return Color(m.metal.albedo[0], m.metal.albedo[1], m.metal.albedo[2]);
+    }
+
+    void gather_stats(SceneStats& stats) const override {
+        stats.add_material_data(int(type()), sizeof(*this));
+    }
 };
 
 
 class Dielectric : public Material {
 public:
-    Dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+    Dielectric(double index_of_refraction) {
+        closed.type = MaterialType::Dielectric;
+        closed.dielectric.ir = index_of_refraction;
+    }
 
     bool scatter(const Ray& r_in, const HitStatus& stat, Color& attenuation, Ray& scattered)
     const override {
+        return scatter(closed, r_in, stat, attenuation, scattered);
+    }
+
+    static bool scatter(const MaterialData& m, const Ray& r_in, const HitStatus& stat, Color& attenuation,
+                        Ray& scattered) {
+        double ir = m.dielectric.ir;
         attenuation = Color(1.0, 1.0, 1.0);
         double refraction_ratio = stat.front_face ? (1.0/ir) : ir;
 
@@ -87,9 +204,11 @@ public:
         return true;
     }
 
-private:
-    double ir; // Index of Refraction
+    void gather_stats(SceneStats& stats) const override {
+        stats.add_material_data(int(type()), sizeof(*this));
+    }
 
+private:
     static double reflectance(double cosine, double ref_idx) {
         // Use Schlick's approximation for reflectance.
         auto r0 = (1-ref_idx) / (1+ref_idx);
@@ -98,4 +217,71 @@ private:
     }
 };
 
+// Materials of a scene. Their closed data is stored contiguously and indexed by the primitives, which give
+// the index of their material to their hits: shading reads the data of a hit from one array and switches over its
+// type, running the scatter of the known types inline instead of a virtual call. The table keeps the materials
+// alive, they own what their data points to and are called through their virtual functions for the type Other.
+class MaterialTable {
+public:
+    MaterialTable() = default;
+    // Table of the materials of a scene, whose primitives are given the index of their material
+    explicit MaterialTable(Hittable& world) { world.bind_materials(*this); }
+
+    // Index of a material, added the first time it is seen
+    int add(const shared_ptr<Material>& material) {
+        auto found = index.find(material.get());
+        if (found != index.end()) return found->second;
+        int i = int(materials.size());
+        index[material.get()] = i;
+        materials.push_back(material);
+        closed.push_back(material->data());
+        return i;
+    }
+
+    // Give an object the index of its material. An object keeps one index: binding it again is only
+    // allowed at the same index, as when a table is built again over the same scene, since it would
+    // otherwise send the hits of the scene it was first bound to to another material.
+    void bind(const shared_ptr<Material>& material, int& object_index) {
+        int i = add(material);
+        if (object_index >= 0 && object_index != i)
+            throw std::runtime_error("An object cannot be bound to the material tables of two scenes");
+        object_index = i;
+    }
+
+    // Hits of objects that were not bound to this table have no material in it: they absorb the ray
+    bool contains(int i) const { return unsigned(i) < closed.size(); }
+
+    const MaterialData& operator[](int i) const { return closed[i]; }
+    const Material& material(int i) const { return *materials[i]; }
+    MaterialType type(int i) const { return contains(i) ? closed[i].type : MaterialType::Other; }
+    size_t size() const { return closed.size(); }
+
+    bool scatter(const Ray& r_in, const HitStatus& stat, Color& attenuation, Ray& scattered) const {
+        if (!contains(stat.material)) return false;
+        const MaterialData& m = closed[stat.material];
+        switch (m.type) {
+            case MaterialType::Lambertian: return Lambertian::scatter(m, r_in, stat, attenuation, scattered);
+            case MaterialType::Metal: return Metal::scatter(m, r_in, stat, attenuation, scattered);
+            case MaterialType::Dielectric: return Dielectric::scatter(m, r_in, stat, attenuation, scattered);
+            default: return materials[stat.material]->scatter(r_in, stat, attenuation, scattered);
+        }
+    }
+
+    Color albedo(const HitStatus& stat) const {
+        if (!contains(stat.material)) return Color(0, 0, 0);
+        const MaterialData& m = closed[stat.material];
+        switch (m.type) {
+            case MaterialType::Lambertian: return Lambertian::albedo(m, stat);
+            case MaterialType::Metal: return Metal::albedo(m);
+            case MaterialType::Dielectric: return Color(1, 1, 1);
+            default: return materials[stat.material]->albedo(stat);
+        }
+    }
+
+private:
+    std::vector<MaterialData> closed;             // By index, what shading reads
+    std::vector<shared_ptr<Material>> materials;  // By index, owners of the data
+    std::unordered_map<const Material*, int> index;
+};
+
 #endif //RAY_TRACING_MATERIAL_H
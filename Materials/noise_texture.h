@@ -0,0 +1,283 @@
+#ifndef RAY_TRACING_NOISE_TEXTURE_H
+#define RAY_TRACING_NOISE_TEXTURE_H
+
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <algorithm>
+
+#include "texture.h"
+
+// Gradient noise over the space, Perlin's improved noise or simplex noise, in about [-1, 1].
+// The lattice is hashed through a permutation table drawn once from the seed, so the same seed always gives
+// the same noise and drawing it does not touch the random numbers of the render.
+// Points are evaluated in blocks, stage by stage over arrays: the cell coordinates and the weights, then the
+// hashes of the corners, then the gradients and the interpolation. All but the hashes, table lookups through
+// the permutation, are plain loops without branches that the compiler vectorizes.
+class Noise {
+public:
+    enum class Basis { Perlin, Simplex };
+
+    // Sum of octaves of the noise, each at lacunarity times the frequency and gain times the amplitude of the
+    // previous one, divided by the sum of the amplitudes. Turbulence sums the absolute values instead: in [0, 1].
+    struct Fractal {
+        Basis basis = Basis::Perlin;
+        int octaves = 1;
+        double lacunarity = 2;
+        double gain = 0.5;
+        bool turbulence = false;
+    };
+
+    enum { block = 64 };  // Points evaluated together
+
+    explicit Noise(uint32_t seed = 0) {
+        for (int i = 0; i < 256; ++i) perm[i] = i;
+        std::mt19937 generator(seed);
+        for (int i = 255; i > 0; --i)
+            std::swap(perm[i], perm[std::uniform_int_distribution<int>(0, i)(generator)]);
+        for (int i = 0; i < 256; ++i) perm[256 + i] = perm[i];
+    }
+
+    double perlin(double x, double y, double z) const {
+        double out;
+        perlin(1, &x, &y, &z, &out);
+        return out;
+    }
+
+    double simplex(double x, double y, double z) const {
+        double out;
+        simplex(1, &x, &y, &z, &out);
+        return out;
+    }
+
+    void evaluate(Basis basis, int n, const double* x, const double* y, const double* z, double* out) const {
+        if (basis == Basis::Perlin) perlin(n, x, y, z, out);
+        else simplex(n, x, y, z, out);
+    }
+
+    void perlin(int n, const double* x, const double* y, const double* z, double* out) const {
+        for (int start = 0; start < n; start += block)
+            perlin_block(std::min<int>(block, n - start), x + start, y + start, z + start, out + start);
+    }
+
+    void simplex(int n, const double* x, const double* y, const double* z, double* out) const {
+        for (int start = 0; start < n; start += block)
+            simplex_block(std::min<int>(block, n - start), x + start, y + start, z + start, out + start);
+    }
+
+    void fractal(const Fractal& f, int n, const double* x, const double* y, const double* z, double* out) const {
+        double sx[block], sy[block], sz[block], octave[block];
+        for (int start = 0; start < n; start += block) {
+            int m = std::min<int>(block, n - start);
+            double* sum = out + start;
+            for (int i = 0; i < m; ++i) sum[i] = 0;
+            double frequency = 1, amplitude = 1, total = 0;
+            for (int o = 0; o < std::max(1, f.octaves); ++o) {
+                for (int i = 0; i < m; ++i) {
+                    sx[i] = x[start + i] * frequency;
+                    sy[i] = y[start + i] * frequency;
+                    sz[i] = z[start + i] * frequency;
+                }
+                evaluate(f.basis, m, sx, sy, sz, octave);
+                if (f.turbulence) {
+                    for (int i = 0; i < m; ++i) sum[i] += amplitude * std::fabs(octave[i]);
+                } else {
+                    for (int i = 0; i < m; ++i) sum[i] += amplitude * octave[i];
+                }
+                total += amplitude;
+                frequency *= f.lacunarity;
+                amplitude *= f.gain;
+            }
+            double scale = 1 / total;
+            for (int i = 0; i < m; ++i) sum[i] *= scale;
+        }
+    }
+
+private:
+    uint8_t perm[512];
+
+    // Hash of the lattice point (i, j, k), each in [0, 256]
+    int hash(int i, int j, int k) const {
+        return perm[perm[perm[i] + j] + k];
+    }
+
+    // Dot product with one of the 12 directions to the edges of a cube (4 of them twice), picked by the hash
+    static double gradient(int h, double x, double y, double z) {
+        h &= 15;
+        double u = h < 8 ? x : y;
+        double v = h < 4 ? y : (h == 12 || h == 14 ? x : z);
+        return ((h & 1) ? -u : u) + ((h & 2) ? -v : v);
+    }
+
+    static double fade(double t) { return t * t * t * (t * (t * 6 - 15) + 10); }
+
+    static double lerp(double t, double a, double b) { return a + t * (b - a); }
+
+    void perlin_block(int m, const double* x, const double* y, const double* z, double* out) const {
+        double fx[block], fy[block], fz[block];
+        int cx[block], cy[block], cz[block];
+        int h[8][block];
+
+        // Cells and positions within them
+        for (int i = 0; i < m; ++i) {
+            double X = std::floor(x[i]), Y = std::floor(y[i]), Z = std::floor(z[i]);
+            fx[i] = x[i] - X;
+            fy[i] = y[i] - Y;
+            fz[i] = z[i] - Z;
+            cx[i] = int(int64_t(X) & 255);
+            cy[i] = int(int64_t(Y) & 255);
+            cz[i] = int(int64_t(Z) & 255);
+        }
+        // Hashes of the 8 corners, corner c is at (c & 1, c >> 1 & 1, c >> 2)
+        for (int i = 0; i < m; ++i) {
+            for (int c = 0; c < 8; ++c)
+                h[c][i] = hash(cx[i] + (c & 1), cy[i] + (c >> 1 & 1), cz[i] + (c >> 2));
+        }
+        // Gradients and trilinear interpolation of the corners with the faded weights
+        for (int i = 0; i < m; ++i) {
+            double X = fx[i], Y = fy[i], Z = fz[i];
+            double u = fade(X), v = fade(Y), w = fade(Z);
+            double g0 = gradient(h[0][i], X, Y, Z), g1 = gradient(h[1][i], X - 1, Y, Z);
+            double g2 = gradient(h[2][i], X, Y - 1, Z), g3 = gradient(h[3][i], X - 1, Y - 1, Z);
+            double g4 = gradient(h[4][i], X, Y, Z - 1), g5 = gradient(h[5][i], X - 1, Y, Z - 1);
+            double g6 = gradient(h[6][i], X, Y - 1, Z - 1), g7 = gradient(h[7][i], X - 1, Y - 1, Z - 1);
+            out[i] = lerp(w, lerp(v, lerp(u, g0, g1), lerp(u, g2, g3)),
+                             lerp(v, lerp(u, g4, g5), lerp(u, g6, g7)));
+        }
+    }
+
+    // Contribution of a corner of a simplex at offset (x, y, z) from the point. It falls to 0 at a squared
+    // distance of 0.5, before reaching points outside the simplices of the corner, so the noise is continuous
+    static double corner(int h, double x, double y, double z) {
+        double t = 0.5 - x * x - y * y - z * z;
+        t = t > 0 ? t : 0;
+        t *= t;
+        return t * t * gradient(h, x, y, z);
+    }
+
+    void simplex_block(int m, const double* x, const double* y, const double* z, double* out) const {
+        const double F3 = 1.0 / 3, G3 = 1.0 / 6;
+        double x0[block], y0[block], z0[block];
+        int cx[block], cy[block], cz[block];
+        int rank[3][block];
+        int h[4][block];
+
+        // Skewed cell, offset from its first corner and order of the coordinates, which picks the simplex:
+        // the second corner steps along the largest coordinate, the third along the two largest
+        for (int i = 0; i < m; ++i) {
+            double s = (x[i] + y[i] + z[i]) * F3;
+            double X = std::floor(x[i] + s), Y = std::floor(y[i] + s), Z = std::floor(z[i] + s);
+            double t = (X + Y + Z) * G3;
+            double a = x[i] - (X - t), b = y[i] - (Y - t), c = z[i] - (Z - t);
+            x0[i] = a;
+            y0[i] = b;
+            z0[i] = c;
+            cx[i] = int(int64_t(X) & 255);
+            cy[i] = int(int64_t(Y) & 255);
+            cz[i] = int(int64_t(Z) & 255);
+            rank[0][i] = (a >= b) + (a >= c);
+            rank[1][i] = (b > a) + (b >= c);
+            rank[2][i] = (c > a) + (c > b);
+        }
+        for (int i = 0; i < m; ++i) {
+            int i1 = rank[0][i] >= 2, j1 = rank[1][i] >= 2, k1 = rank[2][i] >= 2;
+            int i2 = rank[0][i] >= 1, j2 = rank[1][i] >= 1, k2 = rank[2][i] >= 1;
+            h[0][i] = hash(cx[i], cy[i], cz[i]);
+            h[1][i] = hash(cx[i] + i1, cy[i] + j1, cz[i] + k1);
+            h[2][i] = hash(cx[i] + i2, cy[i] + j2, cz[i] + k2);
+            h[3][i] = hash(cx[i] + 1, cy[i] + 1, cz[i] + 1);
+        }
+        for (int i = 0; i < m; ++i) {
+            double a = x0[i], b = y0[i], c = z0[i];
+            double i1 = rank[0][i] >= 2, j1 = rank[1][i] >= 2, k1 = rank[2][i] >= 2;
+            double i2 = rank[0][i] >= 1, j2 = rank[1][i] >= 1, k2 = rank[2][i] >= 1;
+            double n = corner(h[0][i], a, b, c)
+                       + corner(h[1][i], a - i1 + G3, b - j1 + G3, c - k1 + G3)
+                       + corner(h[2][i], a - i2 + 2 * G3, b - j2 + 2 * G3, c - k2 + 2 * G3)
+                       + corner(h[3][i], a - 1 + 3 * G3, b - 1 + 3 * G3, c - 1 + 3 * G3);
+            out[i] = 76 * n;
+        }
+    }
+};
+
+// Colors between low and high, picked by a pattern of noise at the hit point scaled by scale:
+// plain noise, fBm (also for clouds), turbulence, marble veins along x distorted by turbulence, or wood rings
+// around the y axis distorted by fBm. The amount of distortion is given by distortion.
+class NoiseTexture : public Texture {
+public:
+    enum class Pattern { Noise, FBm, Turbulence, Marble, Wood };
+
+    NoiseTexture(const Noise& noise, Pattern pattern, double scale, const Noise::Fractal& fractal,
+                 double distortion, const Color& low, const Color& high)
+        : noise(noise), pattern(pattern), scale(scale), fractal(fractal), distortion(distortion),
+          low(low), high(high) {
+        if (pattern == Pattern::Noise) this->fractal.octaves = 1;
+        if (pattern == Pattern::Turbulence || pattern == Pattern::Marble) this->fractal.turbulence = true;
+        if (pattern == Pattern::FBm || pattern == Pattern::Wood) this->fractal.turbulence = false;
+    }
+
+    TextureType type() const override { return TextureType::Noise; }
+
+    Color value(double u, double v, const Point3d& p) const override {
+        Color out;
+        values(1, &p, &out);
+        return out;
+    }
+
+    void filtered_values(int n, const double* u, const double* v, const Point3d* p, const double* width,
+                         Color* out) const override {
+        values(n, p, out);
+    }
+
+    // Values at n points
+    void values(int n, const Point3d* p, Color* out) const {
+        double x[Noise::block], y[Noise::block], z[Noise::block], t[Noise::block];
+        for (int start = 0; start < n; start += Noise::block) {
+            int m = std::min<int>(Noise::block, n - start);
+            for (int i = 0; i < m; ++i) {
+                x[i] = scale * p[start + i].get_x();
+                y[i] = scale * p[start + i].get_y();
+                z[i] = scale * p[start + i].get_z();
+            }
+            noise.fractal(fractal, m, x, y, z, t);
+            shape(m, x, z, t);
+            for (int i = 0; i < m; ++i) {
+                double s = t[i] < 0 ? 0 : (t[i] > 1 ? 1 : t[i]);
+                out[start + i] = (1 - s) * low + s * high;
+            }
+        }
+    }
+
+    void gather_stats(SceneStats& stats) const override { stats.add_texture_data(sizeof(*this)); }
+
+private:
+    Noise noise;
+    Pattern pattern;
+    double scale;
+    Noise::Fractal fractal;
+    double distortion;
+    Color low, high;
+
+    // Turn the fractal noise at scaled points (x, ., z) into the pattern, in [0, 1]
+    void shape(int m, const double* x, const double* z, double* t) const {
+        switch (pattern) {
+            case Pattern::Noise:
+            case Pattern::FBm:
+                for (int i = 0; i < m; ++i) t[i] = 0.5 * (1 + t[i]);
+                break;
+            case Pattern::Turbulence:
+                break;
+            case Pattern::Marble:
+                for (int i = 0; i < m; ++i) t[i] = 0.5 * (1 + std::sin(x[i] + distortion * t[i]));
+                break;
+            case Pattern::Wood:
+                for (int i = 0; i < m; ++i) {
+                    double r = std::sqrt(x[i] * x[i] + z[i] * z[i]) + distortion * t[i];
+                    t[i] = r - std::floor(r);
+                }
+                break;
+        }
+    }
+};
+
+#endif //RAY_TRACING_NOISE_TEXTURE_H
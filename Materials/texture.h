@@ -9,11 +9,32 @@
 
 #include "vector.h"
 #include "color.h"
+#include "scene_stats.h"
+
+// Angle between the rays of two neighbouring pixels, set by the camera for the level of detail of the textures
+inline double& texture_pixel_angle() {
+    static double angle = 0;
+    return angle;
+}
+
+// Texture classes known to the renderer, compiled into flat texture programs (see texture_program.h)
+enum class TextureType { Solid, Checker, Image, Noise, Other };
 
 class Texture {
 public:
     virtual ~Texture() = default;
+    virtual TextureType type() const { return TextureType::Other; }
     virtual Color value(double u, double v, const Point3d& p) const = 0;
+    // Value averaged over a footprint of the given width in (u, v) units, for the textures with details finer
+    // than that; the others simply return their value at (u, v)
+    virtual Color filtered_value(double u, double v, const Point3d& p, double width) const { return value(u, v, p); }
+    // Filtered values at n points at once, for the textures that evaluate many points faster than one by one
+    virtual void filtered_values(int n, const double* u, const double* v, const Point3d* p, const double* width,
+                                 Color* out) const {
+        for (int i = 0; i < n; ++i) out[i] = filtered_value(u[i], v[i], p[i], width[i]);
+    }
+    // Report this texture and the textures it references to the scene statistics
+    virtual void gather_stats(SceneStats& stats) const { stats.add_texture_data(sizeof(*this)); }
 };
 
 class SolidColor : public Texture {
@@ -21,9 +42,12 @@ public:
     SolidColor(const Color& albedo) : albedo(albedo) {}
     SolidColor(double red, double green, double blue)
         : SolidColor(Color(red, green, blue)) {}
+    TextureType type() const override { return TextureType::Solid; }
     Color value(double u, double v, const Point3d& p) const override {
         return albedo;
     }
+    const Color& color() const { return albedo; }
+    void gather_stats(SceneStats& stats) const override { stats.add_texture_data(sizeof(*this)); }
 private:
     Color albedo;
 };
@@ -34,12 +58,27 @@ public:
         : inv_scale(scale), even(std::move(even)), odd(std::move(odd)) {}
     CheckerTexture(double scale, const Color& c1, const Color& c2)
         : inv_scale(scale), even(make_shared<SolidColor>(c1)), odd(make_shared<SolidColor>(c2)) {}
+    TextureType type() const override { return TextureType::Checker; }
     Color value(double u, double v, const Point3d& p) const override {
+        return is_even(inv_scale, p) ? even->value(u,v,p) : odd->value(u,v,p);
+    }
+    Color filtered_value(double u, double v, const Point3d& p, double width) const override {
+        return is_even(inv_scale, p) ? even->filtered_value(u,v,p,width) : odd->filtered_value(u,v,p,width);
+    }
+    // True if p lies in an even square
+    static bool is_even(double inv_scale, const Point3d& p) {
         auto xInt = int(std::floor(inv_scale * p.get_x()));
         auto yInt = int(std::floor(inv_scale * p.get_y()));
         auto zInt = int(std::floor(inv_scale * p.get_z()));
-        bool isEven = (xInt + yInt + zInt) % 2 == 0;
-        return isEven ? even->value(u,v,p) : odd->value(u,v,p);
+        return (xInt + yInt + zInt) % 2 == 0;
+    }
+    double inverse_scale() const { return inv_scale; }
+    const Texture& even_texture() const { return *even; }
+    const Texture& odd_texture() const { return *odd; }
+    void gather_stats(SceneStats& stats) const override {
+        stats.add_texture_data(sizeof(*this));
+        if (stats.add_texture(even.get())) even->gather_stats(stats);
+        if (stats.add_texture(odd.get())) odd->gather_stats(stats);
     }
 private:
     double inv_scale;
@@ -0,0 +1,102 @@
+#ifndef RAY_TRACING_TEXTURE_PROGRAM_H
+#define RAY_TRACING_TEXTURE_PROGRAM_H
+
+#include <vector>
+
+#include "texture.h"
+#include "image_texture.h"
+#include "noise_texture.h"
+
+// Node of a texture program. A checker refers to the nodes of its squares, images and noise keep a pointer to
+// their texture, whose lookups are called directly, and other textures are called through their virtual functions.
+struct TextureNode {
+    TextureType type;
+    int even, odd;              // Checker: nodes of the squares
+    double inv_scale;           // Checker
+    Color color;                // Solid
+    const Texture* texture;     // Image, Noise and Other
+};
+
+// Textures compiled into a flat array of nodes, the textures they use before them, and evaluated by a loop
+// over a switch instead of virtual calls through the shared pointers of the textures: a checker only picks
+// the node of one of its squares, so the walk from a root to the color is a few steps along the array.
+// The textures keep owning what the nodes point to and must outlive the program.
+class TextureProgram {
+public:
+    // Compile a texture and those it uses, which are compiled once if shared, and return the node of the texture
+    int add(const Texture& tex) {
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (nodes[i].texture == &tex) return int(i);
+        }
+        TextureNode node = {tex.type(), -1, -1, 0, Color(0, 0, 0), &tex};
+        switch (node.type) {
+            case TextureType::Solid:
+                node.color = static_cast<const SolidColor&>(tex).color();
+                break;
+            case TextureType::Checker: {
+                const auto& checker = static_cast<const CheckerTexture&>(tex);
+                node.inv_scale = checker.inverse_scale();
+                node.even = add(checker.even_texture());
+                node.odd = add(checker.odd_texture());
+                break;
+            }
+            default:
+                break;
+        }
+        nodes.push_back(node);
+        return int(nodes.size()) - 1;
+    }
+
+    Color value(int root, double u, double v, const Point3d& p) const {
+        return filtered_value(root, u, v, p, 0);
+    }
+
+    Color filtered_value(int root, double u, double v, const Point3d& p, double width) const {
+        int index = root;
+        for (;;) {
+            const TextureNode& node = nodes[index];
+            switch (node.type) {
+                case TextureType::Solid:
+                    return node.color;
+                case TextureType::Checker:
+                    index = CheckerTexture::is_even(node.inv_scale, p) ? node.even : node.odd;
+                    break;
+                case TextureType::Image:
+                    return static_cast<const ImageTexture*>(node.texture)->ImageTexture::filtered_value(u, v, p, width);
+                case TextureType::Noise:
+                    return static_cast<const NoiseTexture*>(node.texture)->NoiseTexture::value(u, v, p);
+                default:
+                    return node.texture->filtered_value(u, v, p, width);
+            }
+        }
+    }
+
+    // Filtered values of the texture of root at n points, noise evaluates all of them in one call
+    void filtered_values(int root, int n, const double* u, const double* v, const Point3d* p, const double* width,
+                         Color* out) const {
+        const TextureNode& node = nodes[root];
+        switch (node.type) {
+            case TextureType::Solid:
+                for (int i = 0; i < n; ++i) out[i] = node.color;
+                break;
+            case TextureType::Noise:
+                static_cast<const NoiseTexture*>(node.texture)->values(n, p, out);
+                break;
+            case TextureType::Other:
+                node.texture->filtered_values(n, u, v, p, width, out);
+                break;
+            default:
+                for (int i = 0; i < n; ++i) out[i] = filtered_value(root, u[i], v[i], p[i], width[i]);
+                break;
+        }
+    }
+
+    size_t size() const { return nodes.size(); }
+
+    size_t bytes() const { return nodes.capacity() * sizeof(TextureNode); }
+
+private:
+    std::vector<TextureNode> nodes;
+};
+
+#endif //RAY_TRACING_TEXTURE_PROGRAM_H
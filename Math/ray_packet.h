@@ -0,0 +1,74 @@
+#ifndef RAY_TRACING_RAY_PACKET_H
+#define RAY_TRACING_RAY_PACKET_H
+
+#include <cstdint>
+
+#include "utils.h"
+#include "vector.h"
+#include "ray.h"
+
+// A bundle of up to 16 coherent rays traced together through the BVH.
+// Origins and directions are stored as structure of arrays so that the per-ray loops of the box
+// tests compile to SIMD instructions. The bounds of the origins and of the inverse directions over
+// the whole packet allow to cull it against a box at once, with interval arithmetic.
+class RayPacket {
+public:
+    static const int max_size = 16;
+
+    int size = 0;
+    double t_min = 0.001;
+    double org[3][max_size];
+    double dir[3][max_size];
+    double inv_dir[3][max_size];
+    double t_max[max_size];       // Closest hit found so far for each ray
+    uint32_t hit_mask = 0;        // Rays that hit something
+
+    // Packet frustum, valid when every axis has directions of a single sign
+    bool coherent = false;
+    double org_lo[3], org_hi[3];
+    double inv_lo[3], inv_hi[3];
+
+    void add(const Ray& ray, double t_max_ray = inf) {
+        Point3d o = ray.origin();
+        Vector3d d = ray.direction();
+        for (int a = 0; a < 3; ++a) {
+            org[a][size] = o[a];
+            dir[a][size] = d[a];
+            inv_dir[a][size] = 1 / d[a];
+        }
+        t_max[size] = t_max_ray;
+        time[size] = ray.time();
+        size++;
+    }
+
+    // Compute the packet frustum once all rays are added
+    void finalize() {
+        coherent = size > 0;
+        for (int a = 0; a < 3; ++a) {
+            org_lo[a] = inv_lo[a] = inf;
+            org_hi[a] = inv_hi[a] = -inf;
+            for (int i = 0; i < size; ++i) {
+                org_lo[a] = fmin(org_lo[a], org[a][i]);
+                org_hi[a] = fmax(org_hi[a], org[a][i]);
+                inv_lo[a] = fmin(inv_lo[a], inv_dir[a][i]);
+                inv_hi[a] = fmax(inv_hi[a], inv_dir[a][i]);
+            }
+            // Mixed signs (or axis-parallel rays) make the inverse direction interval unbounded
+            if (!(inv_lo[a] > 0 || inv_hi[a] < 0) || std::isinf(inv_lo[a]) || std::isinf(inv_hi[a]))
+                coherent = false;
+        }
+    }
+
+    uint32_t full_mask() const {
+        return size >= 32 ? 0xffffffffu : (1u << size) - 1;
+    }
+
+    Ray ray(int i) const {
+        return Ray(Point3d(org[0][i], org[1][i], org[2][i]), Vector3d(dir[0][i], dir[1][i], dir[2][i]), time[i]);
+    }
+
+private:
+    double time[max_size];
+};
+
+#endif //RAY_TRACING_RAY_PACKET_H
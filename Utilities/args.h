@@ -7,6 +7,7 @@
 
 #include <cstring>
 #include <iostream>
+#include <sstream>
 #include "clipp.h"
 #include "vector.h"
 using std::string;
@@ -27,11 +28,48 @@ public:
     int samples_per_pixel = 10;
     int max_depth = 10;
     double vertical_fov = 20;
-    Point3d look_from = Point3d(0,0,0);
-    Point3d look_at   = Point3d(0,0,-1);
+    Point3d look_from = Point3d(13,2,3);
+    Point3d look_at   = Point3d(0,0,0);
     Point3d vec_up      = Vector3d(0,1,0);
-    double defocus_angle = 0;
+    double defocus_angle = 0.6;
     double focus_dist    = 10;
+    double shutter_open  = 0;
+    double shutter_close = 0;
+
+    bool progressive = false;
+    int samples_per_pass = 1;
+    double time_limit = 0;
+    double checkpoint_interval = 60;
+    string checkpoint;
+    string resume;
+    long long seed = -1;
+
+    bool adaptive = false;
+    int min_samples = 8;
+    double error_threshold = 0.02;
+
+    bool denoise = false;
+    int denoise_iterations = 5;
+
+    int packet_size = 1;
+    string integrator = "path";
+    int tile_size = 16;
+    bool ascii_ppm = false;
+    bool binary_stdout = false;
+    bool stream_output = false;
+    int png_level = 6;
+    bool aov = false;
+    string exr_compression = "zip";
+    string tone_map = "gamma";
+    double exposure = 1.0;
+    bool dither = false;
+    int texture_cache = 256;  // Megabytes
+    bool stats = false;
+    string heatmap;
+    string trace;
+    bool scene_stats = false;
+    bool export_cache = false;
+    string frames;
 
     void print(std::ostream& os) const {
         os << "************ ARGS OF RAY-TRACER ************\n";
@@ -40,9 +78,33 @@ public:
                   << "MAX_DEPTH : " << max_depth << "\n";
         os << "OUTPUT TO : " << output_file << ", "
                   << num_threads << " threads-PARALLEL : " << (parallel ? "ON" : "OFF") << ", "
-                  << "ANTI-ALIAS : " << (anti_alias ? "ON" : "OFF") << ", ";
+                  << "ANTI-ALIAS : " << (anti_alias ? "ON" : "OFF") << ", "
+                  << "DENOISE : " << (denoise ? std::to_string(denoise_iterations) + " iterations" : "OFF") << ", "
+                  << "RAY PACKETS : " << (packet_size > 1 ? std::to_string(packet_size) : "OFF") << ", "
+                  << "INTEGRATOR : " << integrator << ", ";
+        os << "\nCAMERA : FROM " << point(look_from) << " TO " << point(look_at) << ", UP " << point(vec_up) << ", "
+           << "FOV : " << vertical_fov << ", DEFOCUS ANGLE : " << defocus_angle << ", FOCUS DISTANCE : " << focus_dist;
+        if (shutter_close > shutter_open)
+            os << ", SHUTTER : " << shutter_open << " TO " << shutter_close;
+        if (progressive) {
+            os << "\nPROGRESSIVE : " << samples_per_pass << " samples per pass, "
+               << "TIME LIMIT : " << (time_limit > 0 ? std::to_string(time_limit) + "s" : "NONE") << ", "
+               << "CHECKPOINT EVERY : " << checkpoint_interval << "s";
+            if (!resume.empty()) os << ", RESUME FROM : " << resume;
+        }
+        if (adaptive) {
+            os << "\nADAPTIVE : " << min_samples << " to " << samples_per_pixel << " samples per pixel, "
+               << "ERROR THRESHOLD : " << error_threshold;
+        }
         os << "\n********************************************\n";
     }
+
+private:
+    static string point(const Vector3d& p) {
+        std::ostringstream os;
+        os << "(" << p.get_x() << ", " << p.get_y() << ", " << p.get_z() << ")";
+        return os.str();
+    }
 };
 
 
@@ -10,36 +10,9 @@
 
 using Color = Vector3d;
 
-double linear_to_gamma(double linear) {
-    if (linear > 0)
-        return std::sqrt(linear);
-    return 0;
-}
-
-void write_color_PPM(std::ostream& os, const Color& pixel_color) {
-    double r = linear_to_gamma(pixel_color.get_x());
-    double g = linear_to_gamma(pixel_color.get_y());
-    double b = linear_to_gamma(pixel_color.get_z());
-    static const Interval intensity_bound(0.000, 0.999);
-    r = int(256 * intensity_bound.clamp(r));
-    g = int(256 * intensity_bound.clamp(g));
-    b = int(256 * intensity_bound.clamp(b));
-
-    os << r << " " << g << " " << b << "\n";
-}
-
-void write_color_PNG(std::vector<unsigned char>& pixels, const Color& pixel_color, int index) {
-    double r = linear_to_gamma(pixel_color.get_x());
-    double g = linear_to_gamma(pixel_color.get_y());
-    double b = linear_to_gamma(pixel_color.get_z());
-    static const Interval intensity_bound(0.000, 0.999);
-    r = (int)(256 * intensity_bound.clamp(r));
-    g = (int)(256 * intensity_bound.clamp(g));
-    b = (int)(256 * intensity_bound.clamp(b));
-
-    pixels[index] = r;
-    pixels[index + 1] = g;
-    pixels[index + 2] = b;
+inline double luminance(const Color& c) {
+    // Relative luminance of a linear Rec.709 color
+    return 0.2126 * c.get_x() + 0.7152 * c.get_y() + 0.0722 * c.get_z();
 }
 
 #endif //RAY_TRACING_COLOR_H
@@ -11,6 +11,9 @@
 #include "interval.h"
 #include "color.h"
 #include "ray.h"
+#include "ray_packet.h"
 #include "aabb.h"
+#include "render_stats.h"
+#include "trace.h"
 
 #endif //RAY_TRACING_COMMON_H
@@ -0,0 +1,684 @@
+#ifndef RAY_TRACING_DEFLATE_H
+#define RAY_TRACING_DEFLATE_H
+
+// Self-contained deflate compressor (RFC 1951, LZ77 + dynamic Huffman codes) and zlib framing (RFC 1950),
+// shared by the PNG and EXR writers so that no system zlib is needed, and the matching decompressor for the
+// PNG reader of the image textures.
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+namespace deflate {
+
+
+// ---------------------------------------------------------------- Checksums
+
+struct CrcTable {
+    uint32_t table[256];
+    CrcTable() {
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+    }
+};
+
+inline uint32_t crc32(const unsigned char* data, size_t len, uint32_t crc = 0) {
+    static const CrcTable crc_table;
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i)
+        crc = crc_table.table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+const uint32_t adler_base = 65521;
+
+inline uint32_t adler32(const unsigned char* data, size_t len, uint32_t adler = 1) {
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (len > 0) {
+        // 5552 is the largest n such that the sums do not overflow 32 bits before the modulo
+        size_t n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= adler_base;
+        b %= adler_base;
+    }
+    return (b << 16) | a;
+}
+
+// Checksum of the concatenation of two buffers, from their checksums and the length of the second one
+inline uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t len2) {
+    uint32_t rem = uint32_t(len2 % adler_base);
+    uint32_t sum1 = adler1 & 0xffff;
+    uint32_t sum2 = (rem * sum1) % adler_base;
+    sum1 += (adler2 & 0xffff) + adler_base - 1;
+    sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + adler_base - rem;
+    if (sum1 >= adler_base) sum1 -= adler_base;
+    if (sum1 >= adler_base) sum1 -= adler_base;
+    if (sum2 >= (adler_base << 1)) sum2 -= (adler_base << 1);
+    if (sum2 >= adler_base) sum2 -= adler_base;
+    return sum1 | (sum2 << 16);
+}
+
+// ---------------------------------------------------------------- Deflate tables
+
+const int length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                             35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const int length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                              3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const int dist_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                           513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const int dist_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7,
+                            8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+const int code_length_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+const int window_size = 32768;
+const int min_match = 3;
+const int max_match = 258;
+
+// Symbol code of every match length and distance
+struct CodeTables {
+    uint8_t length_code[max_match + 1];
+    uint8_t dist_code[window_size + 1];
+    CodeTables() {
+        for (int c = 0; c < 29; ++c)
+            for (int l = length_base[c]; l < (c == 28 ? 259 : length_base[c + 1]); ++l)
+                length_code[l] = uint8_t(c);
+        length_code[258] = 28;
+        for (int c = 0; c < 30; ++c)
+            for (int d = dist_base[c]; d < (c == 29 ? window_size + 1 : dist_base[c + 1]); ++d)
+                dist_code[d] = uint8_t(c);
+    }
+};
+
+inline const CodeTables& code_tables() {
+    static const CodeTables tables;
+    return tables;
+}
+
+// ---------------------------------------------------------------- Bit output
+
+class BitWriter {
+public:
+    std::vector<unsigned char> out;
+
+    void put(uint32_t bits, int n) {
+        buffer |= uint64_t(bits) << count;
+        count += n;
+        while (count >= 8) {
+            out.push_back((unsigned char)(buffer & 0xff));
+            buffer >>= 8;
+            count -= 8;
+        }
+    }
+
+    void align() {
+        if (count > 0) put(0, 8 - count);
+    }
+
+private:
+    uint64_t buffer = 0;
+    int count = 0;
+};
+
+// ---------------------------------------------------------------- Huffman codes
+
+// Huffman code lengths of the symbols, limited to max_bits.
+// Over-long codes are shortened by redistributing the length histogram so that the Kraft sum stays 1,
+// then lengths are given back to the symbols by decreasing frequency.
+inline void build_lengths(const uint32_t* freq, int n, int max_bits, uint8_t* lengths) {
+    std::fill(lengths, lengths + n, uint8_t(0));
+    std::vector<int> symbols;
+    for (int i = 0; i < n; ++i)
+        if (freq[i]) symbols.push_back(i);
+    if (symbols.empty()) return;
+    if (symbols.size() == 1) {
+        lengths[symbols[0]] = 1;
+        return;
+    }
+    std::stable_sort(symbols.begin(), symbols.end(), [&](int a, int b) { return freq[a] < freq[b]; });
+
+    // Two-queue Huffman construction over the sorted leaves
+    size_t m = symbols.size();
+    std::vector<uint64_t> weight(2 * m - 1);
+    std::vector<int> parent(2 * m - 1, -1);
+    for (size_t i = 0; i < m; ++i) weight[i] = freq[symbols[i]];
+    size_t leaf = 0, node = m, next = m;
+    auto pick = [&]() -> size_t {
+        if (leaf < m && (node >= next || weight[leaf] <= weight[node])) return leaf++;
+        return node++;
+    };
+    for (; next < 2 * m - 1; ++next) {
+        size_t a = pick(), b = pick();
+        weight[next] = weight[a] + weight[b];
+        parent[a] = parent[b] = int(next);
+    }
+
+    int num_codes[33] = {0};
+    std::vector<int> depth(2 * m - 1, 0);
+    for (size_t i = 2 * m - 2; i-- > 0;)
+        depth[i] = depth[parent[i]] + 1;
+    for (size_t i = 0; i < m; ++i)
+        num_codes[std::min(depth[i], 32)]++;
+
+    // Enforce the maximum length
+    for (int i = max_bits + 1; i <= 32; ++i) {
+        num_codes[max_bits] += num_codes[i];
+        num_codes[i] = 0;
+    }
+    uint32_t total = 0;
+    for (int i = max_bits; i > 0; --i)
+        total += uint32_t(num_codes[i]) << (max_bits - i);
+    while (total != (1u << max_bits)) {
+        num_codes[max_bits]--;
+        for (int i = max_bits - 1; i > 0; --i) {
+            if (num_codes[i]) {
+                num_codes[i]--;
+                num_codes[i + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    // Most frequent symbols (end of the sorted list) get the shortest codes
+    size_t s = m;
+    for (int len = 1; len <= max_bits; ++len)
+        for (int k = 0; k < num_codes[len]; ++k)
+            lengths[symbols[--s]] = uint8_t(len);
+}
+
+// Canonical codes from the lengths, bit-reversed since deflate emits Huffman codes MSB first
+inline void build_codes(const uint8_t* lengths, int n, uint16_t* codes) {
+    int bl_count[16] = {0};
+    for (int i = 0; i < n; ++i) bl_count[lengths[i]]++;
+    bl_count[0] = 0;
+    int next_code[16] = {0};
+    int code = 0;
+    for (int bits = 1; bits < 16; ++bits) {
+        code = (code + bl_count[bits - 1]) << 1;
+        next_code[bits] = code;
+    }
+    for (int i = 0; i < n; ++i) {
+        int len = lengths[i];
+        if (!len) continue;
+        int c = next_code[len]++, r = 0;
+        for (int b = 0; b < len; ++b) {
+            r = (r << 1) | (c & 1);
+            c >>= 1;
+        }
+        codes[i] = uint16_t(r);
+    }
+}
+
+// ---------------------------------------------------------------- Deflate
+
+struct Symbol {
+    uint16_t value;  // Literal byte, or match length when dist > 0
+    uint16_t dist;
+};
+
+class Deflater {
+public:
+    explicit Deflater(int max_chain) : max_chain(max_chain) {}
+
+    // Compress data as a sequence of deflate blocks. The last one is final when final is set, otherwise the
+    // output ends with an empty stored block so that it stops on a byte boundary.
+    void compress(const unsigned char* data, size_t n, bool final, BitWriter& bw) {
+        const CodeTables& tables = code_tables();
+        std::vector<int> head(hash_size, -1);
+        std::vector<int> prev(window_size, -1);
+        std::vector<Symbol> symbols;
+        symbols.reserve(block_symbols);
+
+        size_t block_start = 0;
+        size_t pos = 0;
+        auto insert = [&](size_t p) {
+            if (p + min_match > n) return;
+            uint32_t h = hash(data + p);
+            prev[p & (window_size - 1)] = head[h];
+            head[h] = int(p);
+        };
+
+        while (pos < n) {
+            int best_len = 0, best_dist = 0;
+            if (pos + min_match <= n) {
+                int limit = int(std::min<size_t>(max_match, n - pos));
+                int cand = head[hash(data + pos)];
+                int chain = max_chain;
+                while (cand >= 0 && chain-- > 0) {
+                    int dist = int(pos) - cand;
+                    if (dist > window_size) break;
+                    if (data[cand + best_len] == data[pos + best_len]) {
+                        int len = 0;
+                        while (len < limit && data[cand + len] == data[pos + len]) len++;
+                        if (len > best_len) {
+                            best_len = len;
+                            best_dist = dist;
+                            if (len == limit) break;
+                        }
+                    }
+                    int next = prev[cand & (window_size - 1)];
+                    if (next >= cand) break; // Slot reused by a newer position
+                    cand = next;
+                }
+            }
+
+            if (best_len >= min_match) {
+                symbols.push_back({uint16_t(best_len), uint16_t(best_dist)});
+                for (int k = 0; k < best_len; ++k) insert(pos + k);
+                pos += best_len;
+            } else {
+                symbols.push_back({data[pos], 0});
+                insert(pos);
+                pos++;
+            }
+
+            if (symbols.size() >= block_symbols) {
+                write_block(symbols, data + block_start, pos - block_start, final && pos == n, tables, bw);
+                symbols.clear();
+                block_start = pos;
+            }
+        }
+        if (!symbols.empty() || block_start == 0)
+            write_block(symbols, data + block_start, pos - block_start, final, tables, bw);
+
+        if (final) {
+            bw.align();
+        } else {
+            // Sync flush: empty non-final stored block
+            bw.put(0, 3);
+            bw.align();
+            bw.put(0x0000, 16);
+            bw.put(0xffff, 16);
+        }
+    }
+
+    // Level 0: stored blocks only, they always end on a byte boundary
+    static void compress_stored(const unsigned char* data, size_t n, bool final, BitWriter& bw) {
+        write_stored(data, n, final, bw);
+    }
+
+private:
+    static const int hash_bits = 15;
+    static const int hash_size = 1 << hash_bits;
+    static const size_t block_symbols = 1 << 15;
+    int max_chain;
+
+    static uint32_t hash(const unsigned char* p) {
+        uint32_t v = uint32_t(p[0]) << 16 | uint32_t(p[1]) << 8 | p[2];
+        return (v * 2654435761u) >> (32 - hash_bits);
+    }
+
+    // Dynamic Huffman block, or stored blocks when the data does not compress
+    static void write_block(const std::vector<Symbol>& symbols, const unsigned char* raw, size_t raw_len,
+                            bool final, const CodeTables& tables, BitWriter& bw) {
+        uint32_t lit_freq[286] = {0}, dist_freq[30] = {0};
+        for (const auto& s : symbols) {
+            if (s.dist == 0) {
+                lit_freq[s.value]++;
+            } else {
+                lit_freq[257 + tables.length_code[s.value]]++;
+                dist_freq[tables.dist_code[s.dist]]++;
+            }
+        }
+        lit_freq[256] = 1;
+        // Keep both codes complete with at least two symbols, some decoders reject a single code
+        if (std::count_if(lit_freq, lit_freq + 286, [](uint32_t f) { return f > 0; }) < 2) lit_freq[0]++;
+        int used_dist = int(std::count_if(dist_freq, dist_freq + 30, [](uint32_t f) { return f > 0; }));
+        if (used_dist < 2) {
+            if (!dist_freq[0]) dist_freq[0] = 1;
+            else dist_freq[1] = 1;
+        }
+
+        uint8_t lit_len[286], dist_len[30];
+        build_lengths(lit_freq, 286, 15, lit_len);
+        build_lengths(dist_freq, 30, 15, dist_len);
+
+        int hlit = 286;
+        while (hlit > 257 && lit_len[hlit - 1] == 0) hlit--;
+        int hdist = 30;
+        while (hdist > 1 && dist_len[hdist - 1] == 0) hdist--;
+
+        // Run-length encode the code lengths with the symbols 16 (repeat previous), 17 and 18 (zeros)
+        std::vector<uint8_t> all_len(lit_len, lit_len + hlit);
+        all_len.insert(all_len.end(), dist_len, dist_len + hdist);
+        std::vector<std::pair<uint8_t, uint8_t>> cl_symbols; // (symbol, extra bits value)
+        for (size_t i = 0; i < all_len.size();) {
+            uint8_t len = all_len[i];
+            size_t run = 1;
+            while (i + run < all_len.size() && all_len[i + run] == len) run++;
+            if (len == 0 && run >= 3) {
+                size_t r = std::min<size_t>(run, 138);
+                if (r >= 11) cl_symbols.push_back({18, uint8_t(r - 11)});
+                else cl_symbols.push_back({17, uint8_t(r - 3)});
+                i += r;
+            } else if (len != 0 && run >= 4) {
+                cl_symbols.push_back({len, 0});
+                size_t r = std::min<size_t>(run - 1, 6);
+                cl_symbols.push_back({16, uint8_t(r - 3)});
+                i += r + 1;
+            } else {
+                cl_symbols.push_back({len, 0});
+                i++;
+            }
+        }
+        uint32_t cl_freq[19] = {0};
+        for (const auto& s : cl_symbols) cl_freq[s.first]++;
+        uint8_t cl_len[19];
+        build_lengths(cl_freq, 19, 7, cl_len);
+        int hclen = 19;
+        while (hclen > 4 && cl_len[code_length_order[hclen - 1]] == 0) hclen--;
+
+        // Size of the dynamic block, to fall back to stored blocks on incompressible data
+        uint64_t bits = 3 + 5 + 5 + 4 + 3 * uint64_t(hclen);
+        for (const auto& s : cl_symbols)
+            bits += cl_len[s.first] + (s.first == 16 ? 2 : s.first == 17 ? 3 : s.first == 18 ? 7 : 0);
+        for (int i = 0; i < 286; ++i)
+            bits += uint64_t(lit_freq[i]) * (lit_len[i] + (i > 256 ? length_extra[i - 257] : 0));
+        for (int i = 0; i < 30; ++i)
+            bits += uint64_t(dist_freq[i]) * (dist_len[i] + dist_extra[i]);
+        uint64_t stored_bits = (raw_len / 65535 + 1) * (3 + 7 + 32) + uint64_t(raw_len) * 8;
+        if (stored_bits < bits) {
+            write_stored(raw, raw_len, final, bw);
+            return;
+        }
+
+        uint16_t lit_code[286] = {0}, dist_code[30] = {0}, cl_code[19] = {0};
+        build_codes(lit_len, 286, lit_code);
+        build_codes(dist_len, 30, dist_code);
+        build_codes(cl_len, 19, cl_code);
+
+        bw.put(final ? 1 : 0, 1);
+        bw.put(2, 2);
+        bw.put(hlit - 257, 5);
+        bw.put(hdist - 1, 5);
+        bw.put(hclen - 4, 4);
+        for (int i = 0; i < hclen; ++i)
+            bw.put(cl_len[code_length_order[i]], 3);
+        for (const auto& s : cl_symbols) {
+            bw.put(cl_code[s.first], cl_len[s.first]);
+            if (s.first == 16) bw.put(s.second, 2);
+            else if (s.first == 17) bw.put(s.second, 3);
+            else if (s.first == 18) bw.put(s.second, 7);
+        }
+
+        for (const auto& s : symbols) {
+            if (s.dist == 0) {
+                bw.put(lit_code[s.value], lit_len[s.value]);
+            } else {
+                int lc = tables.length_code[s.value];
+                bw.put(lit_code[257 + lc], lit_len[257 + lc]);
+                if (length_extra[lc]) bw.put(s.value - length_base[lc], length_extra[lc]);
+                int dc = tables.dist_code[s.dist];
+                bw.put(dist_code[dc], dist_len[dc]);
+                if (dist_extra[dc]) bw.put(s.dist - dist_base[dc], dist_extra[dc]);
+            }
+        }
+        bw.put(lit_code[256], lit_len[256]);
+    }
+
+    static void write_stored(const unsigned char* raw, size_t raw_len, bool final, BitWriter& bw) {
+        size_t offset = 0;
+        do {
+            size_t len = std::min<size_t>(raw_len - offset, 65535);
+            bool last = offset + len == raw_len;
+            bw.put(final && last ? 1 : 0, 1);
+            bw.put(0, 2);
+            bw.align();
+            bw.put(uint32_t(len), 16);
+            bw.put(uint32_t(~len & 0xffff), 16);
+            bw.out.insert(bw.out.end(), raw + offset, raw + offset + len);
+            offset += len;
+        } while (offset < raw_len);
+    }
+};
+
+// Length of the hash chains searched for matches, by compression level from 0 (stored) to 9
+inline int max_chain_for_level(int level) {
+    static const int chain_lengths[10] = {0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096};
+    return chain_lengths[std::max(0, std::min(level, 9))];
+}
+
+// Compress a buffer as a complete zlib stream
+inline std::vector<unsigned char> zlib_compress(const unsigned char* data, size_t n, int level = 6) {
+    BitWriter bw;
+    bw.out = {0x78, 0x9c};
+    int max_chain = max_chain_for_level(level);
+    if (max_chain == 0) {
+        Deflater::compress_stored(data, n, true, bw);
+    } else {
+        Deflater deflater(max_chain);
+        deflater.compress(data, n, true, bw);
+    }
+    uint32_t adler = adler32(data, n);
+    for (int shift = 24; shift >= 0; shift -= 8)
+        bw.out.push_back((unsigned char)(adler >> shift));
+    return bw.out;
+}
+
+// ---------------------------------------------------------------- Decompression
+
+// Bits of a deflate stream, least significant first. Reading past the end gives zeros and marks the
+// stream as truncated.
+class BitReader {
+public:
+    BitReader(const unsigned char* data, size_t n) : data(data), next(data), end(data + n) {}
+
+    uint32_t peek(int n) {
+        if (count < n) refill();
+        return uint32_t(buffer & ((uint64_t(1) << n) - 1));
+    }
+
+    void skip(int n) {
+        buffer >>= n;
+        count -= n;
+    }
+
+    uint32_t get(int n) {
+        if (n == 0) return 0;
+        uint32_t bits = peek(n);
+        skip(n);
+        return bits;
+    }
+
+    // Drop the bits up to the next byte boundary and return the position of that byte
+    const unsigned char* align() {
+        skip(count & 7);
+        const unsigned char* at = next - count / 8;
+        buffer = 0;
+        count = 0;
+        next = at;
+        return at;
+    }
+
+    void seek(const unsigned char* at) { next = at; }
+
+    bool truncated() const { return (next - data) * 8 - count > (end - data) * 8; }
+
+private:
+    const unsigned char* data;
+    const unsigned char* next;
+    const unsigned char* end;
+    uint64_t buffer = 0;
+    int count = 0;
+
+    void refill() {
+        while (count <= 56) {
+            buffer |= uint64_t(next < end ? *next : 0) << count;
+            next++;
+            count += 8;
+        }
+    }
+};
+
+// Canonical Huffman code of a deflate block. Codes up to fast_bits long are decoded with one table lookup,
+// longer ones length by length from the count of codes of each length.
+class HuffmanDecoder {
+public:
+    static const int fast_bits = 10;
+
+    // False if the lengths do not make a prefix code
+    bool build(const uint8_t* lengths, int n) {
+        memset(count, 0, sizeof(count));
+        memset(fast, 0, sizeof(fast));
+        for (int s = 0; s < n; ++s) count[lengths[s]]++;
+        count[0] = 0;
+        int left = 1;
+        for (int len = 1; len <= 15; ++len) {
+            left = (left << 1) - count[len];
+            if (left < 0) return false;
+        }
+        uint16_t offsets[16];
+        offsets[1] = 0;
+        for (int len = 1; len < 15; ++len) offsets[len + 1] = uint16_t(offsets[len] + count[len]);
+        for (int s = 0; s < n; ++s)
+            if (lengths[s]) symbols[offsets[lengths[s]]++] = uint16_t(s);
+
+        uint32_t code = 0;
+        for (int len = 1, index = 0; len <= fast_bits; ++len) {
+            for (int k = 0; k < count[len]; ++k, ++code, ++index) {
+                uint32_t reversed = 0;
+                for (int b = 0; b < len; ++b) reversed |= ((code >> b) & 1u) << (len - 1 - b);
+                for (uint32_t fill = reversed; fill < (1u << fast_bits); fill += 1u << len)
+                    fast[fill] = uint16_t(symbols[index] << 4 | len);
+            }
+            code <<= 1;
+        }
+        return true;
+    }
+
+    // The next symbol, or -1 for a code that is not in the table
+    int decode(BitReader& br) const {
+        uint32_t bits = br.peek(15);
+        uint16_t entry = fast[bits & ((1u << fast_bits) - 1)];
+        if (entry) {
+            br.skip(entry & 15);
+            return entry >> 4;
+        }
+        int code = 0, first = 0, index = 0;
+        for (int len = 1; len <= 15; ++len) {
+            code |= int(bits >> (len - 1) & 1u);
+            int n = count[len];
+            if (code - n < first) {
+                br.skip(len);
+                return symbols[index + code - first];
+            }
+            index += n;
+            first = (first + n) << 1;
+            code <<= 1;
+        }
+        return -1;
+    }
+
+private:
+    uint16_t count[16];
+    uint16_t symbols[288];
+    uint16_t fast[1 << fast_bits];  // Symbol << 4 | code length, 0 for longer codes
+};
+
+// Decompress a raw deflate stream at the end of out, false if it is invalid or truncated
+inline bool inflate(const unsigned char* data, size_t n, std::vector<unsigned char>& out) {
+    BitReader br(data, n);
+    HuffmanDecoder literals, distances;
+    bool final_block = false;
+    while (!final_block) {
+        final_block = br.get(1) != 0;
+        uint32_t type = br.get(2);
+        if (type == 0) {
+            const unsigned char* at = br.align();
+            if (at + 4 > data + n) return false;
+            uint32_t len = at[0] | uint32_t(at[1]) << 8;
+            uint32_t nlen = at[2] | uint32_t(at[3]) << 8;
+            if (len != (~nlen & 0xffff) || at + 4 + len > data + n) return false;
+            out.insert(out.end(), at + 4, at + 4 + len);
+            br.seek(at + 4 + len);
+            continue;
+        }
+        uint8_t lengths[288 + 32];
+        int n_literals = 288, n_distances = 32;
+        if (type == 1) {
+            for (int s = 0; s < 288; ++s) lengths[s] = uint8_t(s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8);
+            for (int s = 0; s < 32; ++s) lengths[288 + s] = 5;
+            literals.build(lengths, 288);
+            distances.build(lengths + 288, 32);
+        } else if (type == 2) {
+            n_literals = int(br.get(5)) + 257;
+            n_distances = int(br.get(5)) + 1;
+            int n_lengths = int(br.get(4)) + 4;
+            uint8_t code_lengths[19] = {};
+            for (int i = 0; i < n_lengths; ++i) code_lengths[code_length_order[i]] = uint8_t(br.get(3));
+            HuffmanDecoder lengths_code;
+            if (!lengths_code.build(code_lengths, 19)) return false;
+            for (int i = 0; i < n_literals + n_distances;) {
+                int sym = lengths_code.decode(br);
+                if (sym < 0) return false;
+                if (sym < 16) {
+                    lengths[i++] = uint8_t(sym);
+                    continue;
+                }
+                int repeat;
+                uint8_t value = 0;
+                if (sym == 16) {
+                    if (i == 0) return false;
+                    value = lengths[i - 1];
+                    repeat = 3 + int(br.get(2));
+                } else {
+                    repeat = sym == 17 ? 3 + int(br.get(3)) : 11 + int(br.get(7));
+                }
+                if (i + repeat > n_literals + n_distances) return false;
+                while (repeat--) lengths[i++] = value;
+            }
+            if (!literals.build(lengths, n_literals) || !distances.build(lengths + n_literals, n_distances))
+                return false;
+        } else {
+            return false;
+        }
+
+        while (true) {
+            int sym = literals.decode(br);
+            if (sym < 0 || br.truncated()) return false;
+            if (sym < 256) {
+                out.push_back((unsigned char)sym);
+                continue;
+            }
+            if (sym == 256) break;
+            sym -= 257;
+            if (sym >= 29) return false;
+            size_t len = size_t(length_base[sym]) + br.get(length_extra[sym]);
+            int dsym = distances.decode(br);
+            if (dsym < 0 || dsym >= 30) return false;
+            size_t dist = size_t(dist_base[dsym]) + br.get(dist_extra[dsym]);
+            if (dist > out.size()) return false;
+            size_t from = out.size() - dist;
+            // The match may overlap the bytes it produces
+            for (size_t k = 0; k < len; ++k) out.push_back(out[from + k]);
+        }
+    }
+    return !br.truncated();
+}
+
+// Decompress a complete zlib stream, false if it is invalid or its checksum does not match.
+// expected is the size of the decompressed data when known, to allocate it at once.
+inline bool zlib_decompress(const unsigned char* data, size_t n, std::vector<unsigned char>& out, size_t expected = 0) {
+    if (n < 6 || (data[0] & 0x0f) != 8 || (uint32_t(data[0]) << 8 | data[1]) % 31 != 0 || (data[1] & 0x20))
+        return false;
+    out.clear();
+    out.reserve(expected);
+    if (!inflate(data + 2, n - 6, out)) return false;
+    const unsigned char* tail = data + n - 4;
+    uint32_t adler = uint32_t(tail[0]) << 24 | uint32_t(tail[1]) << 16 | uint32_t(tail[2]) << 8 | tail[3];
+    return adler == adler32(out.data(), out.size());
+}
+
+} // namespace deflate
+
+#endif //RAY_TRACING_DEFLATE_H
@@ -0,0 +1,31 @@
+#ifndef RAY_TRACING_FILE_STAMP_H
+#define RAY_TRACING_FILE_STAMP_H
+
+#include <cstdint>
+#include <string>
+#include <sys/stat.h>
+
+// Size and modification time of a file, recorded by the files derived from it (scene cache, tiled textures)
+// so that they are made again as soon as it changes
+struct FileStamp {
+    uint64_t size;
+    int64_t mtime_ns;
+
+    bool operator==(const FileStamp& other) const { return size == other.size && mtime_ns == other.mtime_ns; }
+};
+
+inline bool file_stamp(const std::string& path, FileStamp& s) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return false;
+    s.size = uint64_t(st.st_size);
+#if defined(__linux__)
+    s.mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+    s.mtime_ns = int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    s.mtime_ns = int64_t(st.st_mtime) * 1000000000;
+#endif
+    return true;
+}
+
+#endif //RAY_TRACING_FILE_STAMP_H
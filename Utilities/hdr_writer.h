@@ -0,0 +1,294 @@
+#ifndef RAY_TRACING_HDR_WRITER_H
+#define RAY_TRACING_HDR_WRITER_H
+
+// Writers of the linear (not tone mapped) framebuffer.
+//  - PFM: portable float map, 32-bit floats, RGB ("PF") or one channel ("Pf").
+//  - EXR: single-part scanline OpenEXR with any number of named channels, stored as half or float,
+//         uncompressed or with the RLE, ZIPS (one line per block) or ZIP (16 lines per block) compression.
+// All values are written little-endian, as both formats require.
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include "deflate.h"
+#include "trace.h"
+#include "thread_pool.h"
+
+namespace hdr_detail {
+
+// Round a float to the nearest half, ties to even. Overflows become infinities.
+inline uint16_t float_to_half(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, 4);
+    uint32_t sign = (x >> 16) & 0x8000u;
+    uint32_t exp = (x >> 23) & 0xffu;
+    uint32_t mant = x & 0x7fffffu;
+    if (exp == 0xff) return uint16_t(sign | 0x7c00u | (mant ? 0x200u : 0)); // Infinity or NaN
+    int e = int(exp) - 127 + 15;
+    if (e >= 31) return uint16_t(sign | 0x7c00u);
+    if (e <= 0) {
+        // Subnormal half, or zero
+        if (e < -10) return uint16_t(sign);
+        mant |= 0x800000u;
+        int shift = 14 - e;
+        uint32_t h = mant >> shift;
+        uint32_t rest = mant & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (h & 1))) h++;
+        return uint16_t(sign | h);
+    }
+    uint32_t h = sign | uint32_t(e) << 10 | mant >> 13;
+    uint32_t rest = mant & 0x1fffu;
+    // A carry out of the mantissa correctly bumps the exponent
+    if (rest > 0x1000u || (rest == 0x1000u && (h & 1))) h++;
+    return uint16_t(h);
+}
+
+inline void put_le16(std::vector<unsigned char>& out, uint16_t v) {
+    out.push_back((unsigned char)v);
+    out.push_back((unsigned char)(v >> 8));
+}
+
+inline void put_le32(std::vector<unsigned char>& out, uint32_t v) {
+    for (int shift = 0; shift < 32; shift += 8)
+        out.push_back((unsigned char)(v >> shift));
+}
+
+inline void put_le64(std::vector<unsigned char>& out, uint64_t v) {
+    for (int shift = 0; shift < 64; shift += 8)
+        out.push_back((unsigned char)(v >> shift));
+}
+
+inline void put_float(std::vector<unsigned char>& out, float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, 4);
+    put_le32(out, x);
+}
+
+inline void put_string(std::vector<unsigned char>& out, const std::string& s) {
+    out.insert(out.end(), s.begin(), s.end());
+    out.push_back(0);
+}
+
+// EXR header attribute: name, type name, size of the value, value
+inline void put_attribute(std::vector<unsigned char>& out, const char* name, const char* type,
+                          const std::vector<unsigned char>& value) {
+    put_string(out, name);
+    put_string(out, type);
+    put_le32(out, uint32_t(value.size()));
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+// Byte shuffling and delta predictor shared by the RLE and ZIP compressions:
+// the even bytes go to the first half, the odd bytes to the second, then every byte is replaced
+// by its difference with the previous one.
+inline void exr_predict(const unsigned char* data, size_t n, std::vector<unsigned char>& out) {
+    out.resize(n);
+    size_t half = (n + 1) / 2;
+    for (size_t i = 0; i < n; ++i)
+        out[(i & 1) ? half + i / 2 : i / 2] = data[i];
+    int p = n ? out[0] : 0;
+    for (size_t i = 1; i < n; ++i) {
+        int d = int(out[i]) - p + (128 + 256);
+        p = out[i];
+        out[i] = (unsigned char)d;
+    }
+}
+
+// Run-length encoding of OpenEXR: a count c >= 0 repeats the next byte c + 1 times,
+// a negative count -c copies the c next bytes literally.
+inline std::vector<unsigned char> exr_rle(const std::vector<unsigned char>& in) {
+    const size_t min_run = 3, max_run = 127;
+    std::vector<unsigned char> out;
+    size_t n = in.size(), start = 0, end = 1;
+    while (start < n) {
+        while (end < n && in[start] == in[end] && end - start - 1 < max_run)
+            ++end;
+        if (end - start >= min_run) {
+            out.push_back((unsigned char)(end - start - 1));
+            out.push_back(in[start]);
+            start = end;
+        } else {
+            while (end < n && ((end + 1 >= n || in[end] != in[end + 1]) || (end + 2 >= n || in[end + 1] != in[end + 2]))
+                   && end - start < max_run)
+                ++end;
+            out.push_back((unsigned char)(-int(end - start)));
+            out.insert(out.end(), in.begin() + start, in.begin() + end);
+            start = end;
+        }
+        ++end;
+    }
+    return out;
+}
+
+} // namespace hdr_detail
+
+// Write a PFM image. data holds width * height * channels floats, rows from top to bottom,
+// channels is 3 (RGB) or 1 (grayscale).
+inline bool write_pfm(const std::string& path, int width, int height, const float* data, int channels = 3) {
+    TRACE_SCOPE("pfm_write", "output");
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        std::cerr << "Failed to open file " << path << " for writing." << std::endl;
+        return false;
+    }
+    // A negative scale marks little-endian data
+    fprintf(fp, "%s\n%d %d\n-1.0\n", channels == 1 ? "Pf" : "PF", width, height);
+    size_t row_len = size_t(width) * channels;
+    std::vector<unsigned char> row;
+    row.reserve(row_len * 4);
+    // PFM rows go from bottom to top
+    for (int y = height - 1; y >= 0; --y) {
+        row.clear();
+        for (size_t i = 0; i < row_len; ++i)
+            hdr_detail::put_float(row, data[size_t(y) * row_len + i]);
+        fwrite(row.data(), 1, row.size(), fp);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+// One channel of an EXR image, width * height values with rows from top to bottom.
+// Layers are expressed with dotted names, like "albedo.R".
+struct ExrChannel {
+    std::string name;
+    std::vector<float> data;
+    bool full_float;  // Stored as 32-bit float instead of half
+
+    ExrChannel(const std::string& name, size_t size, bool full_float = false)
+        : name(name), data(size), full_float(full_float) {}
+};
+
+enum class ExrCompression { None = 0, RLE = 1, ZIPS = 2, ZIP = 3 };
+
+inline bool parse_exr_compression(const std::string& name, ExrCompression& compression) {
+    if (name == "none") compression = ExrCompression::None;
+    else if (name == "rle") compression = ExrCompression::RLE;
+    else if (name == "zips") compression = ExrCompression::ZIPS;
+    else if (name == "zip") compression = ExrCompression::ZIP;
+    else return false;
+    return true;
+}
+
+// Write a scanline EXR file. Blocks of lines are compressed by num_threads workers of the shared pool.
+inline bool write_exr(const std::string& path, int width, int height, std::vector<ExrChannel> channels,
+                      ExrCompression compression = ExrCompression::ZIP, int num_threads = 1) {
+    using namespace hdr_detail;
+    TRACE_SCOPE("exr_encode", "output");
+    // Channels must be stored in alphabetical order
+    std::sort(channels.begin(), channels.end(),
+              [](const ExrChannel& a, const ExrChannel& b) { return a.name < b.name; });
+
+    std::vector<unsigned char> header = {0x76, 0x2f, 0x31, 0x01};
+    put_le32(header, 2); // Version 2, single-part scanline
+
+    std::vector<unsigned char> value;
+    for (const auto& c : channels) {
+        put_string(value, c.name);
+        put_le32(value, c.full_float ? 2 : 1); // Pixel type FLOAT or HALF
+        value.insert(value.end(), {0, 0, 0, 0}); // pLinear and reserved
+        put_le32(value, 1); // x sampling
+        put_le32(value, 1); // y sampling
+    }
+    value.push_back(0);
+    put_attribute(header, "channels", "chlist", value);
+
+    value = {(unsigned char)compression};
+    put_attribute(header, "compression", "compression", value);
+
+    value.clear();
+    put_le32(value, 0);
+    put_le32(value, 0);
+    put_le32(value, uint32_t(width - 1));
+    put_le32(value, uint32_t(height - 1));
+    put_attribute(header, "dataWindow", "box2i", value);
+    put_attribute(header, "displayWindow", "box2i", value);
+
+    value = {0}; // Increasing y
+    put_attribute(header, "lineOrder", "lineOrder", value);
+    value.clear();
+    put_float(value, 1.f);
+    put_attribute(header, "pixelAspectRatio", "float", value);
+    value.clear();
+    put_float(value, 0.f);
+    put_float(value, 0.f);
+    put_attribute(header, "screenWindowCenter", "v2f", value);
+    value.clear();
+    put_float(value, 1.f);
+    put_attribute(header, "screenWindowWidth", "float", value);
+    header.push_back(0);
+
+    // Every block holds its lines one after the other, each line holds its channels one after the other
+    const int lines_per_block = compression == ExrCompression::ZIP ? 16 : 1;
+    const int n_blocks = (height + lines_per_block - 1) / lines_per_block;
+    std::vector<std::vector<unsigned char>> blocks(n_blocks);
+
+    auto encode_block = [&](int b) {
+        int y0 = b * lines_per_block;
+        int y1 = std::min(y0 + lines_per_block, height);
+        std::vector<unsigned char> raw;
+        for (int y = y0; y < y1; ++y) {
+            for (const auto& c : channels) {
+                const float* row = c.data.data() + size_t(y) * width;
+                for (int x = 0; x < width; ++x) {
+                    if (c.full_float) put_float(raw, row[x]);
+                    else put_le16(raw, float_to_half(row[x]));
+                }
+            }
+        }
+
+        std::vector<unsigned char> packed;
+        if (compression != ExrCompression::None) {
+            std::vector<unsigned char> predicted;
+            exr_predict(raw.data(), raw.size(), predicted);
+            if (compression == ExrCompression::RLE)
+                packed = exr_rle(predicted);
+            else
+                packed = deflate::zlib_compress(predicted.data(), predicted.size());
+        }
+        // Blocks that do not shrink are stored raw, readers tell them apart by their size
+        const std::vector<unsigned char>& data =
+                (compression == ExrCompression::None || packed.size() >= raw.size()) ? raw : packed;
+
+        std::vector<unsigned char>& block = blocks[b];
+        put_le32(block, uint32_t(y0));
+        put_le32(block, uint32_t(data.size()));
+        block.insert(block.end(), data.begin(), data.end());
+    };
+
+    int numThreads = std::max(1, std::min(num_threads, n_blocks));
+    ThreadPool::shared().run(numThreads, [&](int i) {
+        TRACE_SCOPE("exr_blocks", "output");
+        for (int b = i; b < n_blocks; b += numThreads)
+            encode_block(b);
+    });
+
+    // Offset table: absolute file position of every block
+    std::vector<unsigned char> offsets;
+    uint64_t offset = header.size() + 8 * uint64_t(n_blocks);
+    for (const auto& block : blocks) {
+        put_le64(offsets, offset);
+        offset += block.size();
+    }
+
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        std::cerr << "Failed to open file " << path << " for writing." << std::endl;
+        return false;
+    }
+    fwrite(header.data(), 1, header.size(), fp);
+    fwrite(offsets.data(), 1, offsets.size(), fp);
+    for (const auto& block : blocks)
+        fwrite(block.data(), 1, block.size(), fp);
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+#endif //RAY_TRACING_HDR_WRITER_H
@@ -0,0 +1,289 @@
+#ifndef RAY_TRACING_IMAGE_READER_H
+#define RAY_TRACING_IMAGE_READER_H
+
+// Readers of the image files of the textures: PNG (all color types and bit depths, not interlaced),
+// binary and ASCII PPM, and Radiance HDR. They throw std::runtime_error with the file name on invalid files.
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <algorithm>
+
+#include "deflate.h"
+#include "trace.h"
+
+// Pixels of an image as RGB rows from the top: 8-bit sRGB encoded values for PNG and PPM files,
+// linear floats for HDR files
+struct DecodedImage {
+    int width = 0, height = 0;
+    bool linear = false;               // The texels are in floats, else in bytes
+    std::vector<unsigned char> bytes;  // 3 per texel
+    std::vector<float> floats;         // 3 per texel
+};
+
+namespace image_reader_detail {
+
+inline std::runtime_error error(const std::string& path, const std::string& message) {
+    return std::runtime_error(path + ": " + message);
+}
+
+inline std::vector<unsigned char> read_file(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) throw error(path, "cannot open the image file");
+    return std::vector<unsigned char>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+inline uint32_t be32(const unsigned char* p) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+// 16-bit sample to 8 bits, rounded
+inline unsigned char to_8bit(uint32_t v) {
+    return (unsigned char)((v * 255 + 32767) / 65535);
+}
+
+inline int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+// Undo the filter of every row, in place. rows holds height rows of 1 + row_bytes bytes.
+inline bool unfilter(unsigned char* rows, int height, size_t row_bytes, int bpp) {
+    unsigned char* prior = nullptr;
+    for (int y = 0; y < height; ++y) {
+        unsigned char* row = rows + y * (row_bytes + 1) + 1;
+        int filter = row[-1];
+        for (size_t i = 0; i < row_bytes; ++i) {
+            int a = i >= size_t(bpp) ? row[i - bpp] : 0;
+            int b = prior ? prior[i] : 0;
+            int c = prior && i >= size_t(bpp) ? prior[i - bpp] : 0;
+            switch (filter) {
+                case 0: break;
+                case 1: row[i] = (unsigned char)(row[i] + a); break;
+                case 2: row[i] = (unsigned char)(row[i] + b); break;
+                case 3: row[i] = (unsigned char)(row[i] + ((a + b) >> 1)); break;
+                case 4: row[i] = (unsigned char)(row[i] + paeth(a, b, c)); break;
+                default: return false;
+            }
+        }
+        prior = row;
+    }
+    return true;
+}
+
+// Sample x of a row of samples of bit_depth bits, 16-bit samples already reduced to 8 bits
+inline uint32_t sample(const unsigned char* row, int x, int bit_depth) {
+    if (bit_depth == 8) return row[x];
+    if (bit_depth == 16) return to_8bit(uint32_t(row[2 * x]) << 8 | row[2 * x + 1]);
+    int per_byte = 8 / bit_depth;
+    int shift = 8 - bit_depth * (x % per_byte + 1);
+    return (row[x / per_byte] >> shift) & ((1u << bit_depth) - 1);
+}
+
+} // namespace image_reader_detail
+
+inline DecodedImage read_png(const std::string& path) {
+    using namespace image_reader_detail;
+    TRACE_SCOPE("read_png", "texture");
+    std::vector<unsigned char> file = read_file(path);
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    if (file.size() < 8 || memcmp(file.data(), signature, 8) != 0) throw error(path, "not a PNG file");
+
+    int width = 0, height = 0, bit_depth = 0, color_type = 0;
+    std::vector<unsigned char> palette, compressed;
+    size_t at = 8;
+    bool header = false, end = false;
+    while (!end) {
+        if (at + 12 > file.size()) throw error(path, "truncated PNG file");
+        uint32_t len = be32(&file[at]);
+        const unsigned char* type = &file[at + 4];
+        const unsigned char* data = &file[at + 8];
+        if (len > file.size() - at - 12) throw error(path, "truncated PNG file");
+        if (be32(data + len) != deflate::crc32(type, len + 4)) throw error(path, "corrupted PNG chunk");
+        if (!memcmp(type, "IHDR", 4)) {
+            if (len != 13) throw error(path, "invalid PNG header");
+            width = int(be32(data));
+            height = int(be32(data + 4));
+            bit_depth = data[8];
+            color_type = data[9];
+            if (data[12] != 0) throw error(path, "interlaced PNG files are not supported");
+            header = true;
+        } else if (!memcmp(type, "PLTE", 4)) {
+            palette.assign(data, data + len);
+        } else if (!memcmp(type, "IDAT", 4)) {
+            compressed.insert(compressed.end(), data, data + len);
+        } else if (!memcmp(type, "IEND", 4)) {
+            end = true;
+        }
+        at += 12 + len;
+    }
+    int channels = color_type == 0 ? 1 : color_type == 2 ? 3 : color_type == 3 ? 1 : color_type == 4 ? 2 : color_type == 6 ? 4 : 0;
+    bool valid_depth = bit_depth == 8 || (bit_depth == 16 && color_type != 3)
+                       || ((bit_depth == 1 || bit_depth == 2 || bit_depth == 4) && (color_type == 0 || color_type == 3));
+    if (!header || width <= 0 || height <= 0 || !channels || !valid_depth)
+        throw error(path, "unsupported PNG format");
+    if (color_type == 3 && palette.size() < 3) throw error(path, "PNG file without palette");
+
+    size_t row_bytes = (size_t(width) * channels * bit_depth + 7) / 8;
+    std::vector<unsigned char> rows;
+    if (!deflate::zlib_decompress(compressed.data(), compressed.size(), rows, (row_bytes + 1) * height)
+        || rows.size() < (row_bytes + 1) * height)
+        throw error(path, "corrupted PNG image data");
+    if (!unfilter(rows.data(), height, row_bytes, std::max(1, channels * bit_depth / 8)))
+        throw error(path, "invalid PNG row filter");
+
+    DecodedImage image;
+    image.width = width;
+    image.height = height;
+    image.bytes.resize(size_t(width) * height * 3);
+    int gray_scale = bit_depth < 8 ? 255 / ((1 << bit_depth) - 1) : 1;
+    size_t n_colors = palette.size() / 3;
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* row = &rows[y * (row_bytes + 1) + 1];
+        unsigned char* out = &image.bytes[size_t(y) * width * 3];
+        for (int x = 0; x < width; ++x, out += 3) {
+            if (color_type == 3) {
+                uint32_t index = sample(row, x, bit_depth);
+                if (index >= n_colors) throw error(path, "PNG palette index out of range");
+                memcpy(out, &palette[3 * index], 3);
+            } else if (channels <= 2) {
+                out[0] = out[1] = out[2] = (unsigned char)(sample(row, x * channels, bit_depth) * gray_scale);
+            } else {
+                for (int c = 0; c < 3; ++c) out[c] = (unsigned char)sample(row, x * channels + c, bit_depth);
+            }
+        }
+    }
+    return image;
+}
+
+// P6 (binary) and P3 (ASCII) files, 8 or 16 bits per sample
+inline DecodedImage read_ppm(const std::string& path) {
+    using namespace image_reader_detail;
+    TRACE_SCOPE("read_ppm", "texture");
+    std::vector<unsigned char> file = read_file(path);
+    size_t at = 2;
+    if (file.size() < 2 || file[0] != 'P' || (file[1] != '6' && file[1] != '3')) throw error(path, "not a PPM file");
+    bool ascii = file[1] == '3';
+    // Header and ASCII values: numbers separated by white space, comments from # to the end of the line
+    auto number = [&]() {
+        while (at < file.size() && (isspace(file[at]) || file[at] == '#')) {
+            if (file[at] == '#') while (at < file.size() && file[at] != '\n') at++;
+            else at++;
+        }
+        if (at >= file.size() || !isdigit(file[at])) throw error(path, "invalid PPM file");
+        long value = 0;
+        while (at < file.size() && isdigit(file[at]) && value < 1L << 24) value = value * 10 + (file[at++] - '0');
+        return value;
+    };
+    long width = number(), height = number(), max_value = number();
+    if (width <= 0 || height <= 0 || width * height > 1L << 28 || max_value <= 0 || max_value > 65535)
+        throw error(path, "unsupported PPM file");
+    at++;  // The single white space before binary data
+
+    DecodedImage image;
+    image.width = int(width);
+    image.height = int(height);
+    size_t n = size_t(width) * height * 3;
+    image.bytes.resize(n);
+    int sample_bytes = max_value > 255 ? 2 : 1;
+    if (!ascii && at + n * sample_bytes > file.size()) throw error(path, "truncated PPM file");
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t v;
+        if (ascii) v = uint32_t(number());
+        else if (sample_bytes == 1) v = file[at + i];
+        else v = uint32_t(file[at + 2 * i]) << 8 | file[at + 2 * i + 1];
+        if (v > uint32_t(max_value)) v = uint32_t(max_value);
+        image.bytes[i] = (unsigned char)((v * 255 + max_value / 2) / max_value);
+    }
+    return image;
+}
+
+// Radiance RGBE files, flat or run-length encoded, with rows from the top (-Y height +X width)
+inline DecodedImage read_hdr(const std::string& path) {
+    using namespace image_reader_detail;
+    TRACE_SCOPE("read_hdr", "texture");
+    std::vector<unsigned char> file = read_file(path);
+    size_t at = 0;
+    auto line = [&]() {
+        std::string s;
+        while (at < file.size() && file[at] != '\n') s += char(file[at++]);
+        if (at >= file.size()) throw error(path, "truncated HDR header");
+        at++;
+        return s;
+    };
+    std::string first = line();
+    if (first != "#?RADIANCE" && first != "#?RGBE") throw error(path, "not a Radiance HDR file");
+    for (std::string s = line(); !s.empty(); s = line()) {
+        if (s.compare(0, 7, "FORMAT=") == 0 && s != "FORMAT=32-bit_rle_rgbe")
+            throw error(path, "unsupported HDR format " + s.substr(7));
+    }
+    int width = 0, height = 0;
+    std::string resolution = line();
+    if (sscanf(resolution.c_str(), "-Y %d +X %d", &height, &width) != 2 || width <= 0 || height <= 0
+        || double(width) * height > double(1 << 28))
+        throw error(path, "unsupported HDR orientation or size \"" + resolution + "\"");
+
+    DecodedImage image;
+    image.width = width;
+    image.height = height;
+    image.linear = true;
+    image.floats.resize(size_t(width) * height * 3);
+    std::vector<unsigned char> scanline(size_t(width) * 4);
+    for (int y = 0; y < height; ++y) {
+        if (at + 4 > file.size()) throw error(path, "truncated HDR file");
+        const unsigned char* p = &file[at];
+        if (width >= 8 && width < 32768 && p[0] == 2 && p[1] == 2 && (p[2] << 8 | p[3]) == width) {
+            // New run-length encoding: the four components one after the other
+            at += 4;
+            for (int c = 0; c < 4; ++c) {
+                for (int x = 0; x < width;) {
+                    if (at >= file.size()) throw error(path, "truncated HDR file");
+                    int count = file[at++];
+                    bool run = count > 128;
+                    if (run) count -= 128;
+                    if (count == 0 || x + count > width || at + (run ? 1 : count) > file.size())
+                        throw error(path, "corrupted HDR scanline");
+                    for (int k = 0; k < count; ++k, ++x)
+                        scanline[4 * x + c] = run ? file[at] : file[at + k];
+                    at += run ? 1 : count;
+                }
+            }
+        } else {
+            if (at + scanline.size() > file.size()) throw error(path, "truncated HDR file");
+            memcpy(scanline.data(), &file[at], scanline.size());
+            at += scanline.size();
+        }
+        float* out = &image.floats[size_t(y) * width * 3];
+        for (int x = 0; x < width; ++x) {
+            const unsigned char* rgbe = &scanline[4 * x];
+            float scale = rgbe[3] ? float(ldexp(1.0, rgbe[3] - (128 + 8))) : 0.f;
+            for (int c = 0; c < 3; ++c) out[3 * x + c] = rgbe[c] * scale;
+        }
+    }
+    return image;
+}
+
+// PNG, PPM or HDR file, told by its first bytes
+inline DecodedImage read_image(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) throw image_reader_detail::error(path, "cannot open the image file");
+    char magic[2] = {0, 0};
+    file.read(magic, 2);
+    file.close();
+    if (magic[0] == '\x89' && magic[1] == 'P') return read_png(path);
+    if (magic[0] == 'P' && (magic[1] == '6' || magic[1] == '3')) return read_ppm(path);
+    if (magic[0] == '#' && magic[1] == '?') return read_hdr(path);
+    throw image_reader_detail::error(path, "unknown image format, PNG, PPM or HDR expected");
+}
+
+#endif //RAY_TRACING_IMAGE_READER_H
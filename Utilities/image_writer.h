@@ -0,0 +1,124 @@
+#ifndef RAY_TRACING_IMAGE_WRITER_H
+#define RAY_TRACING_IMAGE_WRITER_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "color.h"
+#include "tone_map.h"
+
+// PPM writer emitting one buffered write per row.
+// Binary P6 by default, ASCII P3 is kept for compatibility with text-based tools.
+// The path "cout" writes to the standard output. Rows are expected from top to bottom.
+class PPMWriter {
+public:
+    ToneMapper tone_mapper;
+
+    PPMWriter() = default;
+    PPMWriter(const PPMWriter&) = delete;
+    PPMWriter& operator=(const PPMWriter&) = delete;
+    ~PPMWriter() { close(); }
+
+    bool open(const std::string& path, int w, int h, bool ascii = false) {
+        close();
+        width = w;
+        height = h;
+        binary = !ascii;
+        if (path == "cout") {
+            std::cout.flush();
+            fp = stdout;
+        } else {
+            fp = fopen(path.c_str(), "wb");
+            if (!fp) {
+                std::cerr << "Failed to open file: " << path << std::endl;
+                return false;
+            }
+            owns_file = true;
+        }
+        fprintf(fp, "%s\n%d %d\n255\n", binary ? "P6" : "P3", width, height);
+        row_index = 0;
+        pixels.resize(size_t(width) * 3);
+        // Worst case of "255 255 255\n" per pixel
+        if (!binary) text.resize(size_t(width) * 12);
+        return true;
+    }
+
+    bool is_open() const { return fp != nullptr; }
+
+    void write_row(const Color* row) {
+        tone_mapper.map_row(row, width, row_index++, pixels.data());
+        if (binary) {
+            fwrite(pixels.data(), 1, pixels.size(), fp);
+            return;
+        }
+        char* p = text.data();
+        for (int i = 0; i < width; ++i) {
+            p = format_byte(p, pixels[3 * i]);     *p++ = ' ';
+            p = format_byte(p, pixels[3 * i + 1]); *p++ = ' ';
+            p = format_byte(p, pixels[3 * i + 2]); *p++ = '\n';
+        }
+        fwrite(text.data(), 1, size_t(p - text.data()), fp);
+    }
+
+    void write_row(const std::vector<Color>& row) { write_row(row.data()); }
+
+    void write_rows(const std::vector<std::vector<Color>>& lines) {
+        TRACE_SCOPE("ppm_write", "output");
+        for (const auto& line : lines)
+            write_row(line);
+    }
+
+    void close() {
+        if (!fp) return;
+        if (owns_file) fclose(fp);
+        else fflush(fp);
+        fp = nullptr;
+        owns_file = false;
+    }
+
+private:
+    FILE* fp = nullptr;
+    bool owns_file = false;
+    bool binary = true;
+    int width = 0, height = 0;
+    int row_index = 0;
+    std::vector<unsigned char> pixels;
+    std::vector<char> text;
+
+    static char* format_byte(char* p, unsigned char v) {
+        if (v >= 100) *p++ = char('0' + v / 100);
+        if (v >= 10) *p++ = char('0' + v / 10 % 10);
+        *p++ = char('0' + v % 10);
+        return p;
+    }
+};
+
+// Streams rows to a PPMWriter as soon as they are finished.
+// Rows may complete in any order across threads; each one is written once all rows above it are written,
+// so the output cost overlaps with the rendering of the remaining rows.
+class RowStreamer {
+public:
+    RowStreamer(PPMWriter& writer, const std::vector<std::vector<Color>>& lines)
+        : writer(writer), lines(lines), ready(lines.size(), 0) {}
+
+    void rows_done(int startY, int endY) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int y = startY; y < endY; ++y)
+            ready[y] = 1;
+        while (next_row < int(lines.size()) && ready[next_row])
+            writer.write_row(lines[next_row++]);
+    }
+
+    bool finished() const { return next_row == int(lines.size()); }
+
+private:
+    PPMWriter& writer;
+    const std::vector<std::vector<Color>>& lines;
+    std::vector<char> ready;
+    int next_row = 0;
+    std::mutex mutex;
+};
+
+#endif //RAY_TRACING_IMAGE_WRITER_H
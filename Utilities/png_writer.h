@@ -0,0 +1,167 @@
+#ifndef RAY_TRACING_PNG_WRITER_H
+#define RAY_TRACING_PNG_WRITER_H
+
+// Self-contained PNG encoder using the bundled deflate compressor.
+// Every scanline gets the PNG filter that minimizes the sum of its absolute residuals, and the image
+// is split in bands of rows that are filtered and compressed by workers of the shared thread pool.
+// Each band ends on a byte boundary (an empty stored block, like zlib's Z_SYNC_FLUSH) so that the
+// compressed bands can simply be concatenated into one zlib stream; their Adler-32 checksums are combined.
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include "deflate.h"
+#include "trace.h"
+#include "thread_pool.h"
+
+namespace png_detail {
+
+using namespace deflate;
+
+// ---------------------------------------------------------------- PNG filtering
+
+inline int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+// Filter one scanline with the filter type that minimizes the sum of absolute residuals,
+// out receives the filter byte followed by the filtered bytes. scratch holds 5 * len bytes.
+inline void filter_row(const unsigned char* row, const unsigned char* prior, size_t len, int bpp,
+                       unsigned char* out, unsigned char* scratch) {
+    unsigned char* f[5];
+    for (int t = 0; t < 5; ++t) f[t] = scratch + t * len;
+    size_t lead = std::min(len, size_t(bpp));
+
+    // One loop per filter type keeps the inner loops branch free
+    for (size_t i = 0; i < len; ++i) f[0][i] = row[i];
+    for (size_t i = 0; i < lead; ++i) f[1][i] = row[i];
+    for (size_t i = lead; i < len; ++i) f[1][i] = (unsigned char)(row[i] - row[i - bpp]);
+    if (prior) {
+        for (size_t i = 0; i < len; ++i) f[2][i] = (unsigned char)(row[i] - prior[i]);
+        for (size_t i = 0; i < lead; ++i) f[3][i] = (unsigned char)(row[i] - prior[i] / 2);
+        for (size_t i = lead; i < len; ++i) f[3][i] = (unsigned char)(row[i] - (row[i - bpp] + prior[i]) / 2);
+        for (size_t i = 0; i < lead; ++i) f[4][i] = (unsigned char)(row[i] - prior[i]);
+        for (size_t i = lead; i < len; ++i) f[4][i] = (unsigned char)(row[i] - paeth(row[i - bpp], prior[i], prior[i - bpp]));
+    } else {
+        // First row: Up is None, Average is Sub halved, Paeth is Sub
+        for (size_t i = 0; i < len; ++i) f[2][i] = row[i];
+        for (size_t i = 0; i < lead; ++i) f[3][i] = row[i];
+        for (size_t i = lead; i < len; ++i) f[3][i] = (unsigned char)(row[i] - row[i - bpp] / 2);
+        for (size_t i = 0; i < len; ++i) f[4][i] = f[1][i];
+    }
+
+    int best = 0;
+    uint64_t best_sum = UINT64_MAX;
+    for (int t = 0; t < 5; ++t) {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < len; ++i) {
+            int v = (signed char)f[t][i];
+            sum += uint64_t(v < 0 ? -v : v);
+        }
+        if (sum < best_sum) {
+            best_sum = sum;
+            best = t;
+        }
+    }
+    out[0] = (unsigned char)best;
+    std::memcpy(out + 1, f[best], len);
+}
+
+inline void write_be32(std::vector<unsigned char>& out, uint32_t v) {
+    out.push_back((unsigned char)(v >> 24));
+    out.push_back((unsigned char)(v >> 16));
+    out.push_back((unsigned char)(v >> 8));
+    out.push_back((unsigned char)v);
+}
+
+inline void write_chunk(FILE* fp, const char* type, const unsigned char* data, size_t len) {
+    std::vector<unsigned char> header;
+    write_be32(header, uint32_t(len));
+    header.insert(header.end(), type, type + 4);
+    uint32_t crc = crc32(header.data() + 4, 4);
+    crc = crc32(data, len, crc);
+    std::vector<unsigned char> trailer;
+    write_be32(trailer, crc);
+    fwrite(header.data(), 1, header.size(), fp);
+    if (len) fwrite(data, 1, len, fp);
+    fwrite(trailer.data(), 1, trailer.size(), fp);
+}
+
+} // namespace png_detail
+
+// Write an 8-bit RGB image to a PNG file.
+// level goes from 0 (stored, no compression) to 9 (slowest, best compression).
+inline bool write_png(FILE* fp, int width, int height, const unsigned char* rgb, int num_threads = 1, int level = 6) {
+    using namespace png_detail;
+    TRACE_SCOPE("png_encode", "output");
+    const size_t row_len = size_t(width) * 3;
+    const size_t stride = row_len + 1;
+
+    // Bands of rows compressed in parallel, small images are not worth splitting
+    int n_bands = std::max(1, std::min(num_threads, height));
+    if (size_t(height) * stride < (size_t(256) << 10)) n_bands = 1;
+    const int max_chain = max_chain_for_level(level);
+
+    std::vector<BitWriter> outputs(n_bands);
+    std::vector<uint32_t> adlers(n_bands);
+    std::vector<size_t> band_bytes(n_bands);
+    ThreadPool::shared().run_bands(n_bands, height, [&](int b, int startRow, int endRow) {
+        TRACE_SCOPE_AT("png_band", "output", 0, startRow);
+        std::vector<unsigned char> filtered(size_t(endRow - startRow) * stride);
+        std::vector<unsigned char> scratch(5 * row_len);
+        for (int y = startRow; y < endRow; ++y) {
+            const unsigned char* row = rgb + size_t(y) * row_len;
+            const unsigned char* prior = y > 0 ? row - row_len : nullptr;
+            filter_row(row, prior, row_len, 3, filtered.data() + size_t(y - startRow) * stride, scratch.data());
+        }
+        adlers[b] = adler32(filtered.data(), filtered.size());
+        band_bytes[b] = filtered.size();
+        if (max_chain == 0) {
+            Deflater::compress_stored(filtered.data(), filtered.size(), b == n_bands - 1, outputs[b]);
+        } else {
+            Deflater deflater(max_chain);
+            deflater.compress(filtered.data(), filtered.size(), b == n_bands - 1, outputs[b]);
+        }
+    });
+
+    uint32_t adler = adlers[0];
+    for (int b = 1; b < n_bands; ++b)
+        adler = adler32_combine(adler, adlers[b], band_bytes[b]);
+
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    fwrite(signature, 1, 8, fp);
+
+    std::vector<unsigned char> ihdr;
+    write_be32(ihdr, uint32_t(width));
+    write_be32(ihdr, uint32_t(height));
+    ihdr.push_back(8);  // Bit depth
+    ihdr.push_back(2);  // Color type RGB
+    ihdr.push_back(0);  // Deflate
+    ihdr.push_back(0);  // Adaptive filtering
+    ihdr.push_back(0);  // No interlace
+    write_chunk(fp, "IHDR", ihdr.data(), ihdr.size());
+
+    // zlib stream: header, the concatenated bands, Adler-32 of the filtered data
+    std::vector<unsigned char> zlib = {0x78, 0x9c};
+    for (const auto& o : outputs)
+        zlib.insert(zlib.end(), o.out.begin(), o.out.end());
+    write_be32(zlib, adler);
+    const size_t idat_size = size_t(1) << 18;
+    for (size_t offset = 0; offset < zlib.size(); offset += idat_size)
+        write_chunk(fp, "IDAT", zlib.data() + offset, std::min(idat_size, zlib.size() - offset));
+
+    write_chunk(fp, "IEND", nullptr, 0);
+    return !ferror(fp);
+}
+
+#endif //RAY_TRACING_PNG_WRITER_H
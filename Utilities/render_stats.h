@@ -0,0 +1,123 @@
+#ifndef RAY_TRACING_RENDER_STATS_H
+#define RAY_TRACING_RENDER_STATS_H
+
+#include <cstdint>
+#include <mutex>
+#include <algorithm>
+
+// Render statistics, counted by every thread in its own thread_local counters and merged into the
+// global totals when the thread exits, so counting costs no synchronization.
+// Building with -DRAY_TRACING_STATS=0 turns every STAT_* macro into a no-op.
+#ifndef RAY_TRACING_STATS
+#define RAY_TRACING_STATS 1
+#endif
+
+enum class PrimitiveType { Sphere, Quadrilateral, Triangle, Count };
+
+const int stats_material_slots = 8;  // Upper bound on the number of material classes
+const int stats_path_bins = 64;      // Paths longer than this are counted in the last bin
+
+class RenderStats {
+public:
+    uint64_t primary_rays = 0;
+    uint64_t secondary_rays = 0;
+    uint64_t bvh_nodes_visited = 0;      // Nodes whose box was tested by a single ray
+    uint64_t bvh_packet_nodes_visited = 0; // Nodes whose box was tested by a ray packet
+    uint64_t primitive_tests[int(PrimitiveType::Count)] = {};
+    uint64_t primitive_hits[int(PrimitiveType::Count)] = {};
+    uint64_t material_hits[stats_material_slots] = {};
+    uint64_t path_lengths[stats_path_bins] = {}; // Number of paths by count of traced segments
+    uint64_t texture_lookups = 0;        // Values read from image textures
+    uint64_t texture_tile_reads = 0;     // Tiles of image textures read from their files, not found in the cache
+
+    void merge(const RenderStats& other) {
+        primary_rays += other.primary_rays;
+        secondary_rays += other.secondary_rays;
+        bvh_nodes_visited += other.bvh_nodes_visited;
+        bvh_packet_nodes_visited += other.bvh_packet_nodes_visited;
+        for (int i = 0; i < int(PrimitiveType::Count); ++i) {
+            primitive_tests[i] += other.primitive_tests[i];
+            primitive_hits[i] += other.primitive_hits[i];
+        }
+        for (int i = 0; i < stats_material_slots; ++i)
+            material_hits[i] += other.material_hits[i];
+        for (int i = 0; i < stats_path_bins; ++i)
+            path_lengths[i] += other.path_lengths[i];
+        texture_lookups += other.texture_lookups;
+        texture_tile_reads += other.texture_tile_reads;
+    }
+
+    static const char* primitive_name(int type) {
+        static const char* names[int(PrimitiveType::Count)] = {"Sphere", "Quadrilateral", "Triangle"};
+        return names[type];
+    }
+};
+
+namespace stats_detail {
+
+struct Registry {
+    std::mutex mutex;
+    RenderStats totals;   // Counters of the threads that already exited
+};
+
+inline Registry& registry() {
+    static Registry r;
+    return r;
+}
+
+struct ThreadStats {
+    RenderStats counters;
+    ~ThreadStats() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.totals.merge(counters);
+    }
+};
+
+inline RenderStats& local() {
+    thread_local ThreadStats stats;
+    return stats.counters;
+}
+
+inline int path_bin(int segments) {
+    return std::max(0, std::min(segments, stats_path_bins - 1));
+}
+
+} // namespace stats_detail
+
+// Totals of the exited threads plus the counters of the calling thread.
+// Worker threads must be joined first.
+inline RenderStats collect_stats() {
+    stats_detail::Registry& r = stats_detail::registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    RenderStats stats = r.totals;
+    stats.merge(stats_detail::local());
+    return stats;
+}
+
+// Hand the counters of the calling thread to the totals, for threads that outlive a render
+inline void flush_stats() {
+    stats_detail::Registry& r = stats_detail::registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.totals.merge(stats_detail::local());
+    stats_detail::local() = RenderStats();
+}
+
+inline void reset_stats() {
+    stats_detail::Registry& r = stats_detail::registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.totals = RenderStats();
+    stats_detail::local() = RenderStats();
+}
+
+#if RAY_TRACING_STATS
+#define STAT_INC(field) (++stats_detail::local().field)
+#define STAT_ADD(field, n) (stats_detail::local().field += uint64_t(n))
+#define STAT_PATH(segments) (++stats_detail::local().path_lengths[stats_detail::path_bin(segments)])
+#else
+#define STAT_INC(field) ((void)0)
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_PATH(segments) ((void)0)
+#endif
+
+#endif //RAY_TRACING_RENDER_STATS_H
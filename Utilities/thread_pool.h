@@ -0,0 +1,104 @@
+#ifndef RAY_TRACING_THREAD_POOL_H
+#define RAY_TRACING_THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+#include "render_stats.h"
+#include "trace.h"
+
+// Worker threads kept alive between renders, so that rendering a sequence of frames does not start new
+// threads for every frame. run(n, task) calls task(0) ... task(n - 1) on n workers and returns once all
+// of them are done; the pool grows to the largest n asked for. Tasks must not call run themselves.
+// Workers hand their render counters to the totals after every task, as they do not exit between renders.
+class ThreadPool {
+public:
+    ThreadPool() {
+        // Built before the pool, the registries outlive its workers
+        stats_detail::registry();
+        trace::detail::registry();
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // The pool of the renderers
+    static ThreadPool& shared() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    void run(int n, const std::function<void(int)>& task) {
+        if (n <= 0) return;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (int(workers.size()) < n) {
+            int id = int(workers.size());
+            workers.push_back(std::thread([this, id]() { work(id); }));
+        }
+        current = &task;
+        n_tasks = n;
+        remaining = n;
+        generation++;
+        wake.notify_all();
+        done.wait(lock, [this]() { return remaining == 0; });
+        current = nullptr;
+    }
+
+    // Split [0, count) in n bands of consecutive indices, the last one taking the remainder, and call
+    // task(band, begin, end) for each of them on its own worker
+    template <typename Func>
+    void run_bands(int n, int count, Func&& task) {
+        n = std::max(1, std::min(n, count));
+        const int per_band = count / n;
+        run(n, [&](int band) {
+            int begin = band * per_band;
+            int end = (band == n - 1) ? count : (band + 1) * per_band;
+            task(band, begin, end);
+        });
+    }
+
+    int size() const { return int(workers.size()); }
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(int)>* current = nullptr;
+    int n_tasks = 0;
+    int remaining = 0;
+    uint64_t generation = 0;   // Incremented by every run, workers wait for the next one
+    bool stopping = false;
+
+    // Worker id runs the task of the same index, when the current run has that many
+    void work(int id) {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            if (id >= n_tasks) continue;
+            const std::function<void(int)>& task = *current;
+            lock.unlock();
+            task(id);
+            flush_stats();
+            lock.lock();
+            if (--remaining == 0) done.notify_one();
+        }
+    }
+};
+
+#endif //RAY_TRACING_THREAD_POOL_H
@@ -0,0 +1,157 @@
+#ifndef RAY_TRACING_TONE_MAP_H
+#define RAY_TRACING_TONE_MAP_H
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+#include "color.h"
+#include "trace.h"
+#include "thread_pool.h"
+
+// A row of Colors is read as one flat array of doubles
+static_assert(sizeof(Color) == 3 * sizeof(double), "Color must be three packed doubles");
+
+enum class ToneOperator {
+    Gamma,     // Gamma 2.0 (square root), the historical output of the renderer
+    SRGB,      // sRGB transfer curve
+    Reinhard,  // x / (1 + x) per channel, then sRGB
+    ACES       // Narkowicz's fit of the ACES filmic curve, then sRGB
+};
+
+inline bool parse_tone_operator(const std::string& name, ToneOperator& op) {
+    if (name == "gamma") op = ToneOperator::Gamma;
+    else if (name == "srgb") op = ToneOperator::SRGB;
+    else if (name == "reinhard") op = ToneOperator::Reinhard;
+    else if (name == "aces") op = ToneOperator::ACES;
+    else return false;
+    return true;
+}
+
+// Maps the linear framebuffer to 8-bit display values.
+// Each (operator, dither) pair gets its own kernel, a single loop over the row seen as a flat array of
+// doubles, with no branch nor call in its body so that the compiler turns it into SIMD instructions.
+// Channels are treated alike, the interleaving of RGB does not matter.
+// The dither is a triangular noise of one quantization step derived from a hash of the position in the
+// image, the output does not depend on how the image is split between threads.
+class ToneMapper {
+public:
+    ToneOperator op = ToneOperator::Gamma;
+    double exposure = 1.0;   // Scale applied to the radiance before the curve
+    bool dither = false;
+
+    // Map one row of width pixels to 8-bit RGB, y is the index of the row in the image
+    void map_row(const Color* colors, int width, int y, unsigned char* out) const {
+        const double* in = reinterpret_cast<const double*>(colors);
+        const int n = 3 * width;
+        const uint32_t base = uint32_t(y) * uint32_t(n);
+        switch (op) {
+            case ToneOperator::Gamma:
+                dither ? kernel<ToneOperator::Gamma, true>(in, n, base, out) : kernel<ToneOperator::Gamma, false>(in, n, base, out);
+                break;
+            case ToneOperator::SRGB:
+                dither ? kernel<ToneOperator::SRGB, true>(in, n, base, out) : kernel<ToneOperator::SRGB, false>(in, n, base, out);
+                break;
+            case ToneOperator::Reinhard:
+                dither ? kernel<ToneOperator::Reinhard, true>(in, n, base, out) : kernel<ToneOperator::Reinhard, false>(in, n, base, out);
+                break;
+            case ToneOperator::ACES:
+                dither ? kernel<ToneOperator::ACES, true>(in, n, base, out) : kernel<ToneOperator::ACES, false>(in, n, base, out);
+                break;
+        }
+    }
+
+    // Map a whole image to 8-bit RGB. Tiles of rows are handed out to num_threads workers of the shared pool.
+    void map_image(const std::vector<std::vector<Color>>& lines, unsigned char* out, int num_threads = 1) const {
+        TRACE_SCOPE("tone_map", "output");
+        const int height = int(lines.size());
+        if (height == 0) return;
+        const int width = int(lines[0].size());
+        const int tile_rows = 16;
+        const int n_tiles = (height + tile_rows - 1) / tile_rows;
+        std::atomic<int> next_tile(0);
+
+        auto worker = [&]() {
+            for (int tile = next_tile++; tile < n_tiles; tile = next_tile++) {
+                int endY = std::min(height, (tile + 1) * tile_rows);
+                TRACE_SCOPE_AT("tone_map_tile", "output", 0, tile * tile_rows);
+                for (int y = tile * tile_rows; y < endY; ++y)
+                    map_row(lines[y].data(), width, y, out + size_t(y) * width * 3);
+            }
+        };
+
+        int numThreads = std::max(1, std::min(num_threads, n_tiles));
+        ThreadPool::shared().run(numThreads, [&](int) { worker(); });
+    }
+
+private:
+    // sRGB curve sampled on 4096 intervals of [0, 1] and interpolated linearly.
+    // The error is under 1e-4, far below one 8-bit step.
+    struct SRGBTable {
+        static const int size = 4096;
+        double value[size + 2];
+        SRGBTable() {
+            for (int i = 0; i <= size; ++i) {
+                double x = double(i) / size;
+                value[i] = x <= 0.0031308 ? 12.92 * x : 1.055 * std::pow(x, 1 / 2.4) - 0.055;
+            }
+            value[size + 1] = value[size];
+        }
+    };
+
+    static const SRGBTable& srgb_table() {
+        static const SRGBTable table;
+        return table;
+    }
+
+    template <ToneOperator Op, bool Dither>
+    void kernel(const double* in, int n, uint32_t base, unsigned char* out) const {
+        // Local copies, the byte stores could otherwise alias the members and force reloads
+        const double* srgb = srgb_table().value;
+        const double scale = exposure;
+        for (int i = 0; i < n; ++i) {
+            // Negative and NaN values are black
+            double x = in[i] * scale;
+            x = x > 0 ? x : 0;
+
+            if (Op == ToneOperator::Reinhard)
+                x = x / (1 + x);
+            else if (Op == ToneOperator::ACES)
+                x = (x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14);
+
+            if (Op == ToneOperator::Gamma) {
+                x = std::sqrt(x);
+            } else {
+                double t = (x < 1 ? x : 1) * 4096.;
+                int k = int(t);
+                x = srgb[k] + (t - k) * (srgb[k + 1] - srgb[k]);
+            }
+
+            if (Dither) {
+                // Difference of two uniform values: triangular distribution over (-1, 1) steps.
+                // Signed conversions vectorize, unsigned ones do not.
+                uint32_t h = hash(base + uint32_t(i));
+                x += double(int(h & 0xffffu) - int(h >> 16)) * (1. / (65536. * 256.));
+            }
+
+            // Clamp under 1 and truncate to 256 levels
+            x = x < 0.999 ? x : 0.999;
+            x = x > 0 ? x : 0;
+            out[i] = (unsigned char)int(256 * x);
+        }
+    }
+
+    static uint32_t hash(uint32_t x) {
+        x ^= x >> 16;
+        x *= 0x7feb352du;
+        x ^= x >> 15;
+        x *= 0x846ca68bu;
+        x ^= x >> 16;
+        return x;
+    }
+};
+
+#endif //RAY_TRACING_TONE_MAP_H
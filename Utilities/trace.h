@@ -0,0 +1,190 @@
+#ifndef RAY_TRACING_TRACE_H
+#define RAY_TRACING_TRACE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+
+// Timeline of the phases of a run, written as a Chrome trace (chrome://tracing, https://ui.perfetto.dev).
+// TRACE_SCOPE records the time spent in the enclosing block. Every thread records into its own ring buffer,
+// which keeps the latest events once full; buffers are handed to the registry when their thread exits.
+// Nothing is recorded until trace::enable() is called, a disabled scope costs one relaxed atomic load.
+namespace trace {
+
+struct Event {
+    const char* name;      // String literals only, events keep the pointer
+    const char* category;
+    int64_t start, end;    // Nanoseconds since trace::enable()
+    int x, y;              // Pixel coordinates of tiles and rows, -1 when unused
+};
+
+namespace detail {
+
+using Clock = std::chrono::steady_clock;
+
+struct ThreadBuffer;
+
+struct Registry {
+    std::mutex mutex;
+    std::atomic<bool> enabled{false};
+    size_t capacity = 1 << 16;            // Events kept per thread
+    Clock::time_point epoch;
+    int next_tid = 0;
+    std::vector<ThreadBuffer*> live;
+    std::vector<std::pair<int, std::vector<Event>>> retired;  // Events of the threads that exited, by thread id
+    uint64_t dropped = 0;                 // Events overwritten in full ring buffers
+};
+
+inline Registry& registry() {
+    static Registry r;
+    return r;
+}
+
+struct ThreadBuffer {
+    int tid;
+    std::vector<Event> ring;
+    uint64_t count = 0;   // Events pushed since the thread started, the ring holds the last ones
+
+    ThreadBuffer() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        tid = r.next_tid++;
+        ring.resize(r.capacity);
+        r.live.push_back(this);
+    }
+
+    ~ThreadBuffer() {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.live.erase(std::remove(r.live.begin(), r.live.end(), this), r.live.end());
+        if (count) r.retired.push_back(std::make_pair(tid, events()));
+        r.dropped += dropped();
+    }
+
+    void push(const Event& e) {
+        ring[count++ % ring.size()] = e;
+    }
+
+    // Oldest first
+    std::vector<Event> events() const {
+        size_t n = size_t(std::min<uint64_t>(count, ring.size()));
+        std::vector<Event> out;
+        out.reserve(n);
+        for (uint64_t i = count - n; i < count; ++i)
+            out.push_back(ring[i % ring.size()]);
+        return out;
+    }
+
+    uint64_t dropped() const { return count > ring.size() ? count - ring.size() : 0; }
+};
+
+inline ThreadBuffer& local() {
+    thread_local ThreadBuffer buffer;
+    return buffer;
+}
+
+inline int64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - registry().epoch).count();
+}
+
+} // namespace detail
+
+inline bool enabled() {
+    return detail::registry().enabled.load(std::memory_order_relaxed);
+}
+
+// Start recording, keeping up to capacity events per thread. The calling thread is named "main".
+inline void enable(size_t capacity = 1 << 16) {
+    detail::Registry& r = detail::registry();
+    {
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.capacity = std::max<size_t>(1, capacity);
+        r.epoch = detail::Clock::now();
+    }
+    detail::local();
+    r.enabled.store(true);
+}
+
+class Scope {
+public:
+    Scope(const char* name, const char* category, int x = -1, int y = -1) : active(enabled()) {
+        if (active) {
+            event = {name, category, detail::now(), 0, x, y};
+        }
+    }
+
+    ~Scope() {
+        if (active) {
+            event.end = detail::now();
+            detail::local().push(event);
+        }
+    }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    bool active;
+    Event event;
+};
+
+// Write every recorded event as a Chrome trace JSON file. Worker threads must be joined first.
+inline bool write(const std::string& path) {
+    detail::Registry& r = detail::registry();
+    std::vector<std::pair<int, std::vector<Event>>> threads;
+    uint64_t dropped;
+    {
+        std::lock_guard<std::mutex> lock(r.mutex);
+        threads = r.retired;
+        dropped = r.dropped;
+        for (const detail::ThreadBuffer* b : r.live) {
+            threads.push_back(std::make_pair(b->tid, b->events()));
+            dropped += b->dropped();
+        }
+    }
+
+    FILE* fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        std::cerr << "Failed to open file " << path << " for writing." << std::endl;
+        return false;
+    }
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"ray_tracing\"}}");
+    size_t n_events = 0;
+    for (const auto& t : threads) {
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s%d\"}}",
+                t.first, t.first == 0 ? "main " : "worker ", t.first);
+        for (const Event& e : t.second) {
+            // Chrome traces count in microseconds
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                    e.name, e.category, t.first, e.start * 1e-3, (e.end - e.start) * 1e-3);
+            if (e.x >= 0 || e.y >= 0) fprintf(fp, ",\"args\":{\"x\":%d,\"y\":%d}", e.x, e.y);
+            fprintf(fp, "}");
+            ++n_events;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    bool ok = !ferror(fp);
+    fclose(fp);
+    std::clog << "Trace of " << n_events << " events written to " << path;
+    if (dropped) std::clog << " (" << dropped << " older events dropped, the ring buffers were full)";
+    std::clog << std::endl;
+    return ok;
+}
+
+} // namespace trace
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// Time the rest of the enclosing block
+#define TRACE_SCOPE(name, category) trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(name, category)
+// Same, for a tile or a row starting at pixel (x, y)
+#define TRACE_SCOPE_AT(name, category, x, y) trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(name, category, x, y)
+
+#endif //RAY_TRACING_TRACE_H
@@ -11,6 +11,7 @@
 #include <random>
 #include <iostream>
 #include <chrono>
+#include <cstdint>
 
 using std::fmin;
 using std::fmax;
@@ -26,12 +27,30 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180;
 }
 
+inline std::mt19937& random_generator() {
+    // One generator per thread, seeded once from the system entropy source.
+    // Rendering threads never share generator state.
+    thread_local std::mt19937 gen(std::random_device{}());
+    return gen;
+}
+
+inline void seed_random(uint64_t seed) {
+    random_generator().seed(static_cast<std::mt19937::result_type>(seed ^ (seed >> 32)));
+}
+
+inline uint64_t mix_seed(uint64_t seed, uint64_t stream) {
+    // SplitMix64 finalizer, derives independent seeds for (seed, stream) pairs
+    // so that a given pass/row always replays the same random sequence.
+    uint64_t z = seed + 0x9e3779b97f4a7c15ULL * (stream + 1);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
 inline double random_double() {
     // generate a random real in [0, 1)
-    std::random_device rd;
-    std::mt19937 gen(rd());
     std::uniform_real_distribution<double> dist(0.0, 1.0);
-    return dist(gen);
+    return dist(random_generator());
 }
 
 inline double random_double(double min, double max) {
@@ -7,78 +7,78 @@
 #include "geometry.h"
 #include "texture.h"
 #include "load_scene.h"
+#include "scene_cache.h"
+#include "scenes.h"
+#include "camera_path.h"
 
 // Only function to be modified by users
 HittableList construct() {
-    HittableList world;
+    return random_spheres_scene();
+}
 
-//    auto ground_material = std::make_shared<Lambertian>(Color(0.2, 0.2, 0.2));
-    auto checker = make_shared<CheckerTexture>(0.32, Color(0.2, 0.3, 0.1), Color(0.9, 0.9, 0.9));
-    world.add(std::make_shared<Sphere>(Point3d(0,-1000,0), 1000, make_shared<Lambertian>(checker)));
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            Point3d center(a + 0.9*random_double(), 0.2, b + 0.9*random_double());
-
-            if ((center - Point3d(4, 0.2, 0)).length() > 0.9) {
-                std::shared_ptr<Material> sphere_material;
-
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = Color::random() * Color::random();
-                    sphere_material = std::make_shared<Lambertian>(albedo);
-                    world.add(std::make_shared<Sphere>(center, 0.2, sphere_material));
-                } else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = Color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = std::make_shared<Metal>(albedo, fuzz);
-                    world.add(std::make_shared<Sphere>(center, 0.2, sphere_material));
-                } else {
-                    // glass
-                    sphere_material = std::make_shared<Dielectric>(1.5);
-                    world.add(std::make_shared<Sphere>(center, 0.2, sphere_material));
-                }
-            }
-        }
+// Print the scene statistics and write them next to the image as OUTPUT.scene.json
+void report_scene(const HittableList& world, const std::string& output_file) {
+    SceneStats stats;
+    world.gather_stats(stats);
+    auto material_name = [](int type) { return material_type_name(MaterialType(type)); };
+    stats.print(std::clog, material_name);
+
+    std::string base = output_file == "cout" ? "render" : output_file.substr(0, output_file.find_last_of('.'));
+    std::ofstream file(base + ".scene.json");
+    if (!file.is_open()) {
+        std::cerr << "Failed to open file: " << base << ".scene.json" << std::endl;
+        return;
     }
+    file << stats.to_json(material_name).dump(2) << std::endl;
+}
+
+// Initialize camera
+void configure_camera(Camera& cam, const Args& args, const CameraPose& pose) {
+    cam.aspect_ratio      = args.aspect_ratio;
+    cam.image_width       = args.image_width;
+    cam.samples_per_pixel = args.samples_per_pixel;
+    cam.max_depth         = args.max_depth;
+    cam.vertical_fov      = pose.vertical_fov;
+    cam.look_from         = pose.look_from;
+    cam.look_at           = pose.look_at;
+    cam.vec_up            = pose.vec_up;
+    cam.defocus_angle     = pose.defocus_angle;
+    cam.focus_dist        = pose.focus_dist;
+    cam.shutter_open      = pose.shutter_open;
+    cam.shutter_close     = pose.shutter_close;
+
+    cam.rp.use_anti_alias = args.anti_alias;
+    cam.rp.use_parallel   = args.parallel;
+    cam.rp.output         = args.output_file;
+    cam.rp.num_threads    = args.num_threads;
+    cam.rp.log            = args.message_to_file;
 
-    auto left_red_diffuse = std::make_shared<Lambertian>(Color(1.0, 0.2, 0.2));
-    auto back_green_diffuse = std::make_shared<Lambertian>(Color(0.2, 1.0, 0.2));
-    auto right_blue_metal = std::make_shared<Metal>(Color(0.2, 0.2, 1.0), random_double(0, 0.5));
-    auto upper_teal_metal = std::make_shared<Metal>(Color(0.2, 0.8, 0.8), random_double(0, 0.5));
-    auto lower_teal_glass = std::make_shared<Dielectric>(-1);
-
-    world.add(std::make_shared<Quadrilateral>(
-            Point3d(-3, -2, 5), Vector3d(0, 0, -4), Vector3d(0, 4, 0),
-            left_red_diffuse));
-    world.add(std::make_shared<Quadrilateral>(
-            Point3d(-2, -2, 0), Vector3d(4, 0, 0), Vector3d(0, 4, 0),
-            back_green_diffuse));
-    world.add(std::make_shared<Quadrilateral>(
-            Point3d(3, -2, 1), Vector3d(0, 0, 4), Vector3d(0, 4, 0),
-            right_blue_metal));
-    world.add(std::make_shared<Quadrilateral>(
-            Point3d(-2, 3, 1), Vector3d(4, 0, 0), Vector3d(0, 0, 4),
-            upper_teal_metal));
-    world.add(std::make_shared<Quadrilateral>(
-            Point3d(-2, -3, 5), Vector3d(4, 0, 0), Vector3d(0, 0, -4),
-            lower_teal_glass));
-
-    auto material1 = std::make_shared<Dielectric>(1.5);
-    world.add(std::make_shared<Sphere>(Point3d(0, 1, 0), 1.0, material1));
-
-    auto material2 = std::make_shared<Lambertian>(Color(0.4, 0.2, 0.1));
-    world.add(std::make_shared<Sphere>(Point3d(-4, 1, 0), 1.0, material2));
-
-    auto material3 = std::make_shared<Metal>(Color(0.7, 0.6, 0.5), 0.0);
-    world.add(std::make_shared<Sphere>(Point3d(4, 1, 0), 1.0, material3));
-
-    // Use BVH to reduce complexity
-    world = HittableList(make_shared<BVH_Node>(world));
-
-    return world;
+    cam.rp.progressive         = args.progressive;
+    cam.rp.samples_per_pass    = args.samples_per_pass;
+    cam.rp.time_limit          = args.time_limit;
+    cam.rp.checkpoint_interval = args.checkpoint_interval;
+    cam.rp.checkpoint          = args.checkpoint;
+    cam.rp.resume              = args.resume;
+    cam.rp.seed                = args.seed;
+    cam.rp.adaptive            = args.adaptive;
+    cam.rp.min_samples         = args.min_samples;
+    cam.rp.error_threshold     = args.error_threshold;
+    cam.rp.denoise             = args.denoise;
+    cam.rp.denoise_iterations  = args.denoise_iterations;
+    cam.rp.packet_size         = args.packet_size;
+    cam.rp.integrator          = args.integrator;
+    cam.rp.tile_size           = args.tile_size;
+    cam.rp.ascii_ppm           = args.ascii_ppm;
+    cam.rp.binary_stdout       = args.binary_stdout;
+    cam.rp.stream_output       = args.stream_output;
+    cam.rp.png_level           = args.png_level;
+    cam.rp.aov                 = args.aov;
+    cam.rp.exr_compression     = args.exr_compression;
+    cam.rp.tone_map            = args.tone_map;
+    cam.rp.exposure            = args.exposure;
+    cam.rp.dither              = args.dither;
+    cam.rp.stats               = args.stats;
+    cam.rp.heatmap             = args.heatmap;
 }
 
 int main(int argc, char** argv) {
@@ -86,7 +86,7 @@ int main(int argc, char** argv) {
     // Read and write ray-tracing arguments
     Args args;
     auto cli = (
-            value("output_file", args.output_file).doc("output image to OUTPUT_FILE"),
+            opt_value("output_file", args.output_file).doc("output image to OUTPUT_FILE, required unless the scene file gives one"),
             option("-f", "-file").doc("load scene from SCENE_FILE")
                 & value("scene_file", args.scene_file),
             option("-m", "-message").doc("MESSAGE written to result/log.txt")
@@ -101,10 +101,155 @@ int main(int argc, char** argv) {
                 & value("IMAGE_WIDTH", args.image_width),
             option("-d", "-depth").doc("maxi depth of recursion of rays")
                 & value("MAX_DEPTH", args.max_depth),
+            option("--look-from").doc("camera position")
+                & value("X", args.look_from[0]) & value("Y", args.look_from[1]) & value("Z", args.look_from[2]),
+            option("--look-at").doc("point the camera looks at")
+                & value("X", args.look_at[0]) & value("Y", args.look_at[1]) & value("Z", args.look_at[2]),
+            option("--up").doc("up direction of the camera")
+                & value("X", args.vec_up[0]) & value("Y", args.vec_up[1]) & value("Z", args.vec_up[2]),
+            option("--fov").doc("vertical field of view in degrees")
+                & value("DEGREES", args.vertical_fov),
+            option("--defocus-angle").doc("aperture of the lens as the angle of the cone of rays through a pixel, 0 for a pinhole")
+                & value("DEGREES", args.defocus_angle),
+            option("--focus-dist").doc("distance from the camera to the plane in focus")
+                & value("DISTANCE", args.focus_dist),
+            option("--shutter").doc("times of the scene the shutter opens and closes at, for the motion blur of moving objects")
+                & value("OPEN", args.shutter_open) & value("CLOSE", args.shutter_close),
             option("-n", "num_threads").doc("number of threads to activate")
-                & value("NUM_THREADS", args.num_threads)
+                & value("NUM_THREADS", args.num_threads),
+            option("--progressive").set(args.progressive).doc("render in successive sample passes with checkpoints"),
+            option("--pass-samples").doc("samples per pixel added by each progressive pass")
+                & value("N_SAMPLES", args.samples_per_pass),
+            option("--time-limit").doc("wall-clock budget in seconds, stops with the best image so far (implies --progressive)")
+                & value("SECONDS", args.time_limit),
+            option("--checkpoint").doc("checkpoint file of the progressive mode, OUTPUT_FILE.ckpt by default")
+                & value("CHECKPOINT", args.checkpoint),
+            option("--checkpoint-interval").doc("seconds between two checkpoints and image updates")
+                & value("SECONDS", args.checkpoint_interval),
+            option("--resume").doc("resume a progressive render from CHECKPOINT (implies --progressive)")
+                & value("CHECKPOINT", args.resume),
+            option("--seed").doc("seed of the random sample streams, for reproducible renders")
+                & value("SEED", args.seed),
+            option("--adaptive").set(args.adaptive).doc("stop sampling converged pixels (implies --progressive)"),
+            option("--min-spp").doc("samples of every pixel before it may converge in adaptive mode")
+                & value("N_SAMPLES", args.min_samples),
+            option("--max-spp").doc("maximum samples of a pixel in adaptive mode, same as -s")
+                & value("N_SAMPLES", args.samples_per_pixel),
+            option("--error-threshold").doc("relative standard error under which a pixel is converged")
+                & value("ERROR", args.error_threshold),
+            option("--denoise").set(args.denoise).doc("denoise the image guided by first-hit albedo and normals"),
+            option("--denoise-iterations").doc("number of A-Trous iterations, the filter spans 2^N pixels")
+                & value("N_ITERATIONS", args.denoise_iterations),
+            option("--packets").doc("trace primary rays in packets of 4, 8 or 16 rays (parallel mode)")
+                & value("PACKET_SIZE", args.packet_size),
+            option("--integrator").doc("path (depth-first, default) or wavefront (breadth-first, parallel mode)")
+                & value("INTEGRATOR", args.integrator),
+            option("--tile").doc("tile side in pixels of the wavefront integrator")
+                & value("TILE_SIZE", args.tile_size),
+            option("--ascii-ppm").set(args.ascii_ppm).doc("write text P3 instead of binary P6 PPM images"),
+            option("--binary-stdout").set(args.binary_stdout).doc("write binary P6 instead of text P3 when the output is cout"),
+            option("--stream").set(args.stream_output).doc("write PPM rows as soon as they are rendered (parallel mode)"),
+            option("--png-level").doc("PNG compression level, 0 (none) to 9 (smallest), 6 by default")
+                & value("LEVEL", args.png_level),
+            option("--aov").set(args.aov).doc("add albedo, normal and depth layers to .exr and .pfm outputs"),
+            option("--exr-compression").doc("none, rle, zips or zip (default)")
+                & value("COMPRESSION", args.exr_compression),
+            option("--tonemap").doc("gamma (default), srgb, reinhard or aces, for .ppm and .png outputs")
+                & value("OPERATOR", args.tone_map),
+            option("--exposure").doc("scale of the radiance before tone mapping")
+                & value("EXPOSURE", args.exposure),
+            option("--dither").set(args.dither).doc("dither the 8-bit output to hide banding"),
+            option("--texture-cache").doc("memory budget of the tiles of image textures in megabytes")
+                & value("MB", args.texture_cache),
+            option("--stats").set(args.stats).doc("write ray, BVH and material counters to OUTPUT.stats.json"),
+            option("--heatmap").doc("write the cost of every pixel, time or visits (BVH nodes), to OUTPUT.heatmap.png/.pfm")
+                & value("MODE", args.heatmap),
+            option("--trace").doc("write a Chrome trace (chrome://tracing, Perfetto) of the run phases to TRACE_FILE")
+                & value("TRACE_FILE", args.trace),
+            option("--scene-stats").set(args.scene_stats).doc("report primitives, materials, BVH shape and memory of the scene, also in OUTPUT.scene.json"),
+            option("--frames").doc("render a sequence of frames along the camera poses or keyframes of FRAMES_FILE, to OUTPUT.0000.EXT, ...")
+                & value("FRAMES_FILE", args.frames),
+            option("--export-cache").set(args.export_cache).doc("write the binary cache SCENE_FILE.cache of the scene file, loaded instead of it while it is up to date")
             );
     if(!parse(argc, argv, cli)) std::clog << make_man_page(cli, argv[0]);
+    if (!args.trace.empty()) trace::enable();
+
+    // Construct all world
+    // If args.scene_file is provided, load scene from file
+    HittableList world;
+    json settings;
+    // A binary cache next to the scene file is used as long as the scene file is unchanged
+    if (!args.scene_file.empty()){
+        std::string cache_file = args.scene_file + ".cache";
+        std::shared_ptr<MappedScene> cached;
+        if (!args.export_cache) cached = MappedScene::open(cache_file, args.scene_file);
+        try {
+            if (cached) {
+                settings = cached->settings();
+            } else {
+                SceneRecords records;
+                {
+                    TRACE_SCOPE("load_scene", "scene");
+                    world = load_scene(args.scene_file, args.export_cache ? &records : nullptr, &settings);
+                }
+                if (args.export_cache && records.write(cache_file, args.scene_file, world))
+                    cached = MappedScene::open(cache_file, args.scene_file);
+            }
+            if (cached) world = HittableList(cached);
+            else world = HittableList(std::make_shared<BVH_Node>(world));
+
+            // Settings of the scene file first, then the command line again over them
+            std::string scene_file = args.scene_file;
+            args = Args();
+            apply_scene_settings(settings, args, scene_file);
+            parse(argc, argv, cli);
+            if (args.seed >= 0) seed_random(uint64_t(args.seed));
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    } else {
+        // The built-in scenes draw their random parameters, seed before building them
+        if (args.seed >= 0) seed_random(uint64_t(args.seed));
+        TRACE_SCOPE("construct", "scene");
+        world = construct();
+    }
+
+    if (args.time_limit > 0 || !args.resume.empty() || args.adaptive) args.progressive = true;
+    TextureCache::shared().set_budget(size_t(std::max(args.texture_cache, 1)) << 20);
+    if (args.packet_size != 1 && args.packet_size != 4 && args.packet_size != 8 && args.packet_size != 16) {
+        std::cerr << "Packet size must be 4, 8 or 16, tracing rays one by one." << std::endl;
+        args.packet_size = 1;
+    }
+    if (args.integrator != "path" && args.integrator != "wavefront") {
+        std::cerr << "Unknown integrator " << args.integrator << ", using path." << std::endl;
+        args.integrator = "path";
+    }
+    // Camera poses of a sequence of frames, from --frames or from the scene file
+    CameraPath path;
+    try {
+        if (!args.frames.empty()) {
+            std::ifstream frames_file(args.frames);
+            if (!frames_file.is_open()) throw std::runtime_error("Failed to open file: " + args.frames);
+            json frames = json::parse(frames_file);
+            path = CameraPath::from_json(frames.is_object() && frames.contains("Frames") ? frames["Frames"] : frames,
+                                         CameraPose::of(args), args.frames);
+        } else if (settings.contains("Frames")) {
+            path = CameraPath::from_json(settings["Frames"], CameraPose::of(args), args.scene_file);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    if (!path.empty() && (args.output_file == "cout" || !args.resume.empty())) {
+        std::cerr << "A sequence of frames can neither be written to cout nor resumed." << std::endl;
+        return 1;
+    }
+    if (args.output_file.empty()) {
+        std::cerr << "No output file, give it on the command line or as \"output\" in the \"Render\" block of the scene." << std::endl;
+        std::clog << make_man_page(cli, argv[0]);
+        return 1;
+    }
     args.print(std::clog);
 
     std::ofstream file(args.message_to_file, std::ios::out | std::ios::app);
@@ -116,34 +261,26 @@ int main(int argc, char** argv) {
     args.print(file);
     file.close();
 
-    // Construct all world
-    // If args.scene_file is provided, load scene from file
-    HittableList world;
-    if (!args.scene_file.empty()){
-        world = load_scene(args.scene_file);
-    } else {
-        world = construct();
-    }
+    if (args.scene_stats) report_scene(world, args.output_file);
 
-    // Initialize camera
-    Camera cam;
-    cam.aspect_ratio      = args.aspect_ratio;
-    cam.image_width       = args.image_width;
-    cam.samples_per_pixel = args.samples_per_pixel;
-    cam.max_depth         = args.max_depth;
-    cam.vertical_fov      = 20;
-    cam.look_from         = Point3d(13,2,3);
-    cam.look_at           = Point3d(0,0,0);
-    cam.vec_up            = Vector3d(0,1,0);
-    cam.defocus_angle     = 0.6;
-    cam.focus_dist        = 10.0;
-
-    cam.rp.use_anti_alias = args.anti_alias;
-    cam.rp.use_parallel   = args.parallel;
-    cam.rp.output         = args.output_file;
-    cam.rp.num_threads    = args.num_threads;
-    cam.rp.log            = args.message_to_file;
+    // The materials of the scene in one table, the primitives and their hits refer to them by index
+    MaterialTable materials(world);
 
     // Trace!
-    cam.render(world);
+    if (path.empty()) {
+        Camera cam;
+        configure_camera(cam, args, CameraPose::of(args));
+        cam.render(world, materials);
+    } else {
+        // The scene, its BVH and the render threads stay in memory from one frame to the next
+        for (size_t i = 0; i < path.size(); ++i) {
+            Camera cam;  // Nothing computed for the previous frame is kept
+            configure_camera(cam, args, path.frames[i]);
+            cam.rp.output = CameraPath::frame_file(args.output_file, i, path.size());
+            std::clog << "Frame " << i + 1 << "/" << path.size() << " : " << cam.rp.output << std::endl;
+            cam.render(world, materials);
+        }
+    }
+
+    if (!args.trace.empty()) trace::write(args.trace);
 }
\ No newline at end of file